@@ -25,19 +25,47 @@
 
 #define BASED_RENDERER_FULLSCREEN !BASED_RENDERER_DEBUG
 
+// The based_renderer_bench target defines this. It times startup and frames, then writes the results as JSON.
+#ifndef BASED_RENDERER_BENCH
+#define BASED_RENDERER_BENCH 0
+#endif
+
+// Records CPU trace events and writes them as Chrome trace JSON, which chrome://tracing and Perfetto can open.
+// When it's 0, the TRACE_* macros expand to nothing, so the markers cost nothing.
+#ifndef BASED_RENDERER_TRACE
+#define BASED_RENDERER_TRACE 0
+#endif
+
+#ifdef _WIN32
+#define BASED_RENDERER_WIN32 1
+#else
+#define BASED_RENDERER_WIN32 0
+#endif
+
+// How many frames the CPU can get ahead of the GPU. More frames in flight means more throughput, but also more latency.
+// This has nothing to do with the swapchain image count. In headless mode, there is one offscreen image per frame in flight.
+#define BASED_RENDERER_DEFAULT_FRAMES_IN_FLIGHT 2
+#define BASED_RENDERER_MAX_FRAMES_IN_FLIGHT 4
+
 // TODO: What about other systems?
+#if BASED_RENDERER_WIN32
 #define VK_KHR_platform_surface "VK_KHR_win32_surface"
-
-// TODO: How does printing to the debug output work on other systems?
+#endif
 
 // Works just like std::print, except it prints to the debug console.
+// On systems without a debug console, it prints to stderr instead.
 template<class... Args> 
 static void dprint(std::format_string<Args...> fmt, Args&&... args) noexcept
 {
 	std::string s = std::format(fmt, std::forward<Args>(args)...);
+#if BASED_RENDERER_WIN32
 	OutputDebugStringA(s.c_str());
+#else
+	std::fputs(s.c_str(), stderr);
+#endif
 }
 
+#if BASED_RENDERER_WIN32
 // Same, but the format string is a wide string.
 template<class... Args>
 static void dprint(std::wformat_string<Args...> fmt, Args&&... args) noexcept
@@ -45,6 +73,7 @@ static void dprint(std::wformat_string<Args...> fmt, Args&&... args) noexcept
 	std::wstring s = std::format(fmt, std::forward<Args>(args)...);
 	OutputDebugStringW(s.c_str());
 }
+#endif
 
 // A clever way I found to remove an element from an std::vector.
 // Assumes that i is within the bounds of v.
@@ -87,6 +116,240 @@ static std::string to_string(std::vector<std::string> const &v) noexcept
 // 	return res;
 // }
 
+// Returns std::nullopt if the file couldn't be opened, instead of throwing, since a missing file is usually expected (e.g. a cache miss).
+static std::optional<std::vector<char>> read_entire_binary_file(std::filesystem::path const &path)
+{
+	std::ifstream file{path, std::ios::binary|std::ios::ate};
+	if (!file)
+	{
+		return std::nullopt;
+	}
+
+	std::vector<char> res(static_cast<size_t>(file.tellg()));
+	file.seekg(0);
+	if (!file.read(res.data(), static_cast<std::streamsize>(res.size())))
+	{
+		return std::nullopt;
+	}
+	return res;
+}
+
+// Writes to a temporary file first and renames it, so a crash halfway through can never leave a truncated file behind.
+// Returns an error instead of throwing, since this is used for caches, where failing to write is not fatal.
+static std::error_code write_entire_binary_file_atomically(std::filesystem::path const &path, void const *const data, size_t const size)
+{
+	std::error_code res;
+
+	std::filesystem::path temp_path = path;
+	temp_path += ".tmp";
+	{
+		std::ofstream file{temp_path, std::ios::binary|std::ios::trunc};
+		if (!file.write(static_cast<char const *>(data), static_cast<std::streamsize>(size)))
+		{
+			return std::make_error_code(std::errc::io_error);
+		}
+	}
+	std::filesystem::rename(temp_path, path, res);
+
+	return res;
+}
+
+#if BASED_RENDERER_TRACE
+using TraceClock = std::chrono::steady_clock;
+
+struct TraceEvent
+{
+	char const *name;
+	TraceClock::time_point begin;
+	TraceClock::time_point end;
+};
+
+// Each thread only ever appends to its own buffer, so recording an event never takes a lock.
+// The lock is only taken the first time a thread records something, to register its buffer.
+struct TraceThreadBuffer
+{
+	uint32_t thread_id;
+	std::string thread_name;
+	std::vector<TraceEvent> events;
+};
+
+struct TraceState
+{
+	std::mutex mutex;
+	// unique_ptr, so that buffers don't move when another thread registers.
+	std::vector<std::unique_ptr<TraceThreadBuffer>> buffers;
+	TraceClock::time_point start = TraceClock::now();
+};
+
+// TODO: Remove global variables.
+static TraceState trace_state;
+static thread_local TraceThreadBuffer *trace_thread_buffer = nullptr;
+
+static TraceThreadBuffer &trace_get_thread_buffer()
+{
+	if (!trace_thread_buffer)
+	{
+		std::lock_guard lock{trace_state.mutex};
+		std::unique_ptr<TraceThreadBuffer> buffer = std::make_unique<TraceThreadBuffer>();
+		buffer->thread_id = static_cast<uint32_t>(trace_state.buffers.size());
+		buffer->thread_name = std::format("thread {}", buffer->thread_id);
+		// Enough that a few thousand frames never reallocate in the middle of one.
+		buffer->events.reserve(64*1024);
+		trace_thread_buffer = buffer.get();
+		trace_state.buffers.push_back(std::move(buffer));
+	}
+	return *trace_thread_buffer;
+}
+
+static void trace_set_thread_name(std::string name)
+{
+	trace_get_thread_buffer().thread_name = std::move(name);
+}
+
+static void trace_record(char const *const name, TraceClock::time_point const begin)
+{
+	trace_get_thread_buffer().events.push_back({name, begin, TraceClock::now()});
+}
+
+struct TraceScope
+{
+	char const *name;
+	TraceClock::time_point begin;
+
+	~TraceScope()
+	{
+		trace_record(name, begin);
+	}
+};
+
+// Nothing may be recording while this runs, which is why it only gets called once every other thread has been joined.
+static void trace_write(std::filesystem::path const &path)
+{
+	std::string json = "{\"traceEvents\": [\n";
+	bool first = true;
+	for (std::unique_ptr<TraceThreadBuffer> const &buffer : trace_state.buffers)
+	{
+		json += std::format("{}\t{{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": {}, \"args\": {{\"name\": \"{}\"}}}}", 
+			first ? "" : ",\n", buffer->thread_id, buffer->thread_name);
+		first = false;
+		for (TraceEvent const &event : buffer->events)
+		{
+			json += std::format(",\n\t{{\"name\": \"{}\", \"ph\": \"X\", \"pid\": 1, \"tid\": {}, \"ts\": {:.3f}, \"dur\": {:.3f}}}",
+				event.name,
+				buffer->thread_id,
+				std::chrono::duration<double, std::micro>(event.begin - trace_state.start).count(),
+				std::chrono::duration<double, std::micro>(event.end - event.begin).count());
+		}
+	}
+	json += "\n]}\n";
+
+	std::ofstream file{path};
+	if (!file)
+	{
+		throw std::runtime_error{FORMAT_ERROR(std::format("Failed to open {}.", path.string()))};
+	}
+	file << json;
+}
+
+// For code that isn't a block of its own, like the phases of the frame loop.
+#define TRACE_BEGIN(NAME) TraceClock::time_point const trace_begin_##NAME = TraceClock::now()
+#define TRACE_END(NAME) trace_record(STRINGIFY(NAME), trace_begin_##NAME)
+// Ends along with the enclosing scope.
+#define TRACE_SCOPE(NAME) TraceScope const trace_scope_##NAME{STRINGIFY(NAME), TraceClock::now()}
+#define TRACE_THREAD_NAME(NAME) trace_set_thread_name(NAME)
+#else
+#define TRACE_BEGIN(NAME)
+#define TRACE_END(NAME)
+#define TRACE_SCOPE(NAME)
+#define TRACE_THREAD_NAME(NAME)
+#endif
+
+// A fixed set of worker threads that run jobs in the order they were submitted.
+// Jobs get the index of the thread running them, so they can use per-thread state (e.g. a Slang session) without locking.
+struct JobPool
+{
+	std::vector<std::thread> threads;
+	std::deque<std::function<void(size_t)>> jobs;
+	std::mutex mutex;
+	std::condition_variable condition_variable;
+	bool stopping = false;
+
+	explicit JobPool(size_t thread_count);
+	// Jobs that haven't started yet get thrown away, but the ones that are running get to finish.
+	~JobPool();
+
+	JobPool(JobPool const &) = delete;
+	JobPool &operator=(JobPool const &) = delete;
+};
+
+static void job_pool_thread(JobPool &pool, size_t const thread_idx) noexcept
+{
+	TRACE_THREAD_NAME(std::format("job pool thread {}", thread_idx));
+	for (;;)
+	{
+		std::function<void(size_t)> job;
+		{
+			std::unique_lock lock{pool.mutex};
+			pool.condition_variable.wait(lock, [&pool]{ return pool.stopping || !pool.jobs.empty(); });
+			if (pool.stopping)
+			{
+				return;
+			}
+			job = std::move(pool.jobs.front());
+			pool.jobs.pop_front();
+		}
+		// Exceptions can't escape, since job_pool_submit wraps every job in a std::packaged_task.
+		TRACE_SCOPE(job);
+		job(thread_idx);
+	}
+}
+
+JobPool::JobPool(size_t const thread_count)
+{
+	threads.reserve(thread_count);
+	for (size_t i = 0; i < thread_count; ++i)
+	{
+		threads.emplace_back(job_pool_thread, std::ref(*this), i);
+	}
+}
+
+JobPool::~JobPool()
+{
+	{
+		std::lock_guard lock{mutex};
+		stopping = true;
+	}
+	condition_variable.notify_all();
+	for (std::thread &thread : threads)
+	{
+		thread.join();
+	}
+}
+
+// One thread per core, minus the main thread, which is busy with its own work (e.g. device creation) while the jobs run.
+static size_t job_pool_default_thread_count() noexcept
+{
+	return std::max<size_t>(std::thread::hardware_concurrency(), 2) - 1;
+}
+
+// Exceptions thrown by the job get rethrown by std::future::get.
+template <class F>
+static auto job_pool_submit(JobPool &pool, F &&f) -> std::future<std::invoke_result_t<F, size_t>>
+{
+	using Result = std::invoke_result_t<F, size_t>;
+
+	// std::function has to be copyable and std::packaged_task isn't, hence the std::shared_ptr.
+	auto task = std::make_shared<std::packaged_task<Result(size_t)>>(std::forward<F>(f));
+	std::future<Result> res = task->get_future();
+	{
+		std::lock_guard lock{pool.mutex};
+		pool.jobs.emplace_back([task](size_t const thread_idx){ (*task)(thread_idx); });
+	}
+	pool.condition_variable.notify_one();
+	return res;
+}
+
+#if BASED_RENDERER_WIN32
 // TODO: What about system errors on other systems?
 // TODO: Is there a cross-platform way to get the last error?
 static std::system_error win32_system_error() noexcept
@@ -96,8 +359,10 @@ static std::system_error win32_system_error() noexcept
 	return system_error;
 }
 
-// TODO: Remove global.
+// TODO: Remove globals.
 static bool win32_running;
+// Set when the client area changes size. The main loop recreates the swapchain and clears it.
+static bool win32_resized;
 
 LRESULT WINAPI win32_event_callback(
 	HWND   win32_window,
@@ -114,6 +379,10 @@ LRESULT WINAPI win32_event_callback(
 		{
 			win32_running = false;
 		} break;
+		case WM_SIZE:
+		{
+			win32_resized = true;
+		} break;
 		default: 
 		{
 			res = DefWindowProcW(win32_window, win32_message, win32_w_param, win32_l_param);
@@ -134,6 +403,19 @@ static void win32_message_box(
 		MB_OK
 	);
 }
+#endif // BASED_RENDERER_WIN32
+
+// Shows a message box on Windows. Everywhere else, there is nobody to click OK, so it goes to stderr.
+static void show_error(
+	char const *message,
+	char const *title) noexcept
+{
+#if BASED_RENDERER_WIN32
+	win32_message_box(message, title);
+#else
+	std::fprintf(stderr, "%s: %s\n", title, message);
+#endif
+}
 
 vk::Bool32 VKAPI_PTR vulkan_debug_callback(
 	vk::DebugUtilsMessageSeverityFlagBitsEXT message_severity,
@@ -163,31 +445,63 @@ static VulkanMemoryTypeInfo vulkan_get_memory_type_info(
 	uint32_t const memory_type_bits,
 	vk::BufferUsageFlags const usage)
 {
+	// Only buffers that are nothing but a transfer source or destination are staging or readback buffers.
+	// Anything else that happens to be copied to or from still wants to live in device local memory.
 	vk::MemoryPropertyFlags desired_memory_properties;
-	if (usage&vk::BufferUsageFlagBits::eTransferSrc)
+	// If this isn't empty, the memory type must have all of these, and desired_memory_properties is only a preference.
+	vk::MemoryPropertyFlags required_memory_properties;
+	// Whether shaders can get a pointer to it says nothing about where it should live.
+	vk::BufferUsageFlags const memory_usage = usage&~vk::BufferUsageFlags{vk::BufferUsageFlagBits::eShaderDeviceAddress};
+	if (memory_usage == vk::BufferUsageFlagBits::eTransferSrc)
 	{
 		desired_memory_properties = vk::MemoryPropertyFlagBits::eHostVisible|vk::MemoryPropertyFlagBits::eHostCoherent;
 	}
+	else if (memory_usage == vk::BufferUsageFlagBits::eTransferDst)
+	{
+		// Readback buffers get read by the CPU every frame, and reading uncached memory (like device local memory through resizable BAR) is 
+		// painfully slow. Cached memory might not be coherent, so see vulkan_invalidate_host_reads.
+		required_memory_properties = vk::MemoryPropertyFlagBits::eHostVisible;
+		desired_memory_properties = vk::MemoryPropertyFlagBits::eHostCached;
+	}
+	else if (memory_usage == vk::BufferUsageFlagBits::eUniformBuffer)
+	{
+		// A uniform buffer that can't be copied to has to be written by the host directly.
+		// If it can also be device local (resizable BAR, integrated GPUs), even better, since the GPU reads it every frame.
+		required_memory_properties = vk::MemoryPropertyFlagBits::eHostVisible|vk::MemoryPropertyFlagBits::eHostCoherent;
+		desired_memory_properties = vk::MemoryPropertyFlagBits::eDeviceLocal;
+	}
+	else if (memory_usage == (vk::BufferUsageFlagBits::eSamplerDescriptorBufferEXT|vk::BufferUsageFlagBits::eResourceDescriptorBufferEXT))
+	{
+		// Same as a uniform buffer: descriptors get written straight into it by the host, and read by the GPU all the time.
+		required_memory_properties = vk::MemoryPropertyFlagBits::eHostVisible|vk::MemoryPropertyFlagBits::eHostCoherent;
+		desired_memory_properties = vk::MemoryPropertyFlagBits::eDeviceLocal;
+	}
 	else
 	{
 		desired_memory_properties = vk::MemoryPropertyFlagBits::eDeviceLocal;
 	}
 
-	uint32_t memory_type_idx = physical_device_memory_properties.memoryTypeCount - 1;
-	for (;;)
+	// The second pass only happens if there are required properties, and it drops the preference.
+	for (int pass = 0; pass < (required_memory_properties ? 2 : 1); ++pass)
 	{
-		uint32_t memory_type_bit = 1 << memory_type_idx;		
-		vk::MemoryPropertyFlags memory_properties = physical_device_memory_properties.memoryTypes[memory_type_idx].propertyFlags;
-		if ((memory_type_bits&memory_type_bit) && (desired_memory_properties&memory_properties))
+		uint32_t memory_type_idx = physical_device_memory_properties.memoryTypeCount - 1;
+		for (;;)
 		{
-			VulkanMemoryTypeInfo res;
-			res.idx = memory_type_idx;
-			res.properties = memory_properties;
-			return res;
-		}
+			uint32_t memory_type_bit = 1 << memory_type_idx;		
+			vk::MemoryPropertyFlags memory_properties = physical_device_memory_properties.memoryTypes[memory_type_idx].propertyFlags;
+			if ((memory_type_bits&memory_type_bit) && 
+				(memory_properties&required_memory_properties) == required_memory_properties && 
+				(pass == 1 || (desired_memory_properties&memory_properties)))
+			{
+				VulkanMemoryTypeInfo res;
+				res.idx = memory_type_idx;
+				res.properties = memory_properties;
+				return res;
+			}
 
-		if (memory_type_idx == 0) break;
-		--memory_type_idx;
+			if (memory_type_idx == 0) break;
+			--memory_type_idx;
+		}
 	}
 
 	throw vk::LogicError{FORMAT_ERROR("Failed to find a memory type index.")};
@@ -199,7 +513,7 @@ static VulkanMemoryTypeInfo vulkan_get_memory_type_info(
 	vk::ImageUsageFlags const usage) 
 {
 	vk::MemoryPropertyFlags desired_memory_properties;
-	if (usage&vk::ImageUsageFlagBits::eTransferSrc)
+	if (usage == vk::ImageUsageFlagBits::eTransferSrc)
 	{
 		desired_memory_properties = vk::MemoryPropertyFlagBits::eHostVisible|vk::MemoryPropertyFlagBits::eHostCoherent;
 	}
@@ -228,64 +542,6 @@ static VulkanMemoryTypeInfo vulkan_get_memory_type_info(
 	throw vk::LogicError{FORMAT_ERROR("Failed to find a memory type index.")};
 }
 
-struct VulkanStagingBufferAllocation
-{
-	vk::DeviceMemory memory;
-	vk::DeviceSize offset;
-	vk::DeviceSize size;
-	vk::DeviceSize align;
-	VulkanMemoryTypeInfo memory_type_info;
-	bool dedicated_allocation;
-
-	vk::Buffer handle;
-};
-
-// You might be wondering why we are not using inheritance here, since each of these structs share so many members. The reason is simply convenience. Specifically, it's not possible to initialize staging_buffer.memory_type_info.idx using a designated initializer if memory_type_info is a member of the parent class.
-
-struct VulkanBufferAllocation
-{
-	vk::DeviceMemory memory;
-	vk::DeviceSize offset;
-	vk::DeviceSize size;
-	vk::DeviceSize align;
-	VulkanMemoryTypeInfo memory_type_info;
-	bool dedicated_allocation;
-
-	vk::Buffer handle;
-	VulkanStagingBufferAllocation staging_buffer{
-		.memory_type_info = VulkanMemoryTypeInfo{
-			.idx = 0xFFFFFFFF,
-		},
-	};
-
-	bool has_staging_buffer()
-	{
-		return staging_buffer.memory_type_info.idx != 0xFFFFFFFF;
-	}
-};
-
-struct VulkanImageAllocation
-{
-	vk::DeviceMemory memory;
-	vk::DeviceSize offset;
-	vk::DeviceSize size;
-	vk::DeviceSize align;
-	VulkanMemoryTypeInfo memory_type_info;
-	bool dedicated_allocation;
-
-	vk::Image handle;
-	VulkanStagingBufferAllocation staging_buffer{
-		.memory_type_info = VulkanMemoryTypeInfo{
-			.idx = 0xFFFFFFFF,
-		},
-	};
-
-	bool has_staging_buffer()
-	{
-		return staging_buffer.memory_type_info.idx != 0xFFFFFFFF;
-	}
-};
-
 // https://www.gingerbill.org/article/2019/02/08/memory-allocation-strategies-002/#heading-2-5
 static bool is_power_of_2(vk::DeviceSize const x) 
 {
@@ -311,99 +567,539 @@ static vk::DeviceSize align_forward(vk::DeviceSize offset, vk::DeviceSize const
 	return offset;
 }
 
-void vulkan_allocate(
-	/* in */ vk::Device const device,
-	/* in */ vk::PhysicalDeviceMemoryProperties const &physical_device_memory_properties,
-	/* in */ std::span<vk::BufferCreateInfo> buffer_create_infos,
-	/* in */ std::span<vk::ImageCreateInfo> image_create_infos,
-	/* out */ std::span<VulkanBufferAllocation> buffer_allocations,
-	/* out */ std::span<VulkanImageAllocation> image_allocations) 
-{
-	// TODO: Should I do a warning here?
-	size_t buffer_count = std::min(buffer_create_infos.size(), buffer_allocations.size());
-	size_t image_count = std::min(image_create_infos.size(), image_allocations.size());
+// The heap hands out memory from big blocks, one set of blocks per memory type, using a two-level segregated fit (TLSF) allocator.
+// Allocating and freeing are both O(1): the first level picks a power of two, the second level splits that power of two into 
+// vulkan_heap_sl_count linear steps, and a bitmap for each level finds the first non-empty free list without searching.
+// http://www.gii.upv.es/tlsf/files/papers/ecrts04_tlsf.pdf
 
-	std::vector<vk::BindBufferMemoryInfo> bind_buffer_memory_infos;
-	bind_buffer_memory_infos.reserve(buffer_count);
-	std::vector<vk::BindImageMemoryInfo> bind_image_memory_infos;
-	bind_image_memory_infos.reserve(image_count);
+#define BASED_RENDERER_VULKAN_HEAP_BLOCK_SIZE (64ull*1024*1024)
 
-	for (size_t i = 0; i < buffer_count; ++i) 
-	{
-		VulkanBufferAllocation &buffer_allocation = buffer_allocations[i];
-		buffer_allocation.handle = device.createBuffer(buffer_create_infos[i]);
+static constexpr uint32_t vulkan_heap_sl_bits = 4;
+static constexpr uint32_t vulkan_heap_sl_count = 1u << vulkan_heap_sl_bits;
+static constexpr uint32_t vulkan_heap_fl_count = 64;
+// Every offset and size in the heap is a multiple of this, so that sizes are never small enough to need special cases in the mapping.
+static constexpr vk::DeviceSize vulkan_heap_min_align = vulkan_heap_sl_count;
+static constexpr uint32_t vulkan_heap_null = 0xFFFFFFFF;
 
-		vk::MemoryDedicatedRequirements memory_dedicated_requirements;
-		
-		vk::BufferMemoryRequirementsInfo2 memory_requirements_info;
-		memory_requirements_info.buffer = buffer_allocation.handle;
-		
-		vk::MemoryRequirements2 buffer_memory_requirements;
-		buffer_memory_requirements.pNext = &memory_dedicated_requirements;
-		device.getBufferMemoryRequirements2(&memory_requirements_info, &buffer_memory_requirements);
+// A range of a block, either free or in use. 
+// Nodes that are next to each other in memory are linked, so that freeing can merge with its neighbors.
+// Free nodes are also linked into the free list for their size.
+struct VulkanHeapNode
+{
+	vk::DeviceSize offset;
+	vk::DeviceSize size;
+	uint32_t block_idx;
+	uint32_t prev_physical;
+	uint32_t next_physical;
+	uint32_t prev_free;
+	uint32_t next_free;
+	bool free;
+};
 
-		buffer_allocation.size = buffer_memory_requirements.memoryRequirements.size;
-		buffer_allocation.align = buffer_memory_requirements.memoryRequirements.alignment;
+struct VulkanHeapBlock
+{
+	vk::DeviceMemory memory;
+	vk::DeviceSize size;
+	std::byte *mapped; // Only set if the memory is host visible.
+};
 
-		buffer_allocation.memory_type_info = vulkan_get_memory_type_info(
-			physical_device_memory_properties,
-			buffer_memory_requirements.memoryRequirements.memoryTypeBits,
-			buffer_create_infos[i].usage);
+// There are two pools per memory type: one for buffers and linear images, one for optimal images.
+// Keeping them apart means a linear and a non-linear resource can never end up in the same bufferImageGranularity page,
+// so we never have to pad for it.
+struct VulkanHeapPool
+{
+	uint32_t memory_type_idx;
+	vk::DeviceSize block_size;
+	std::vector<VulkanHeapBlock> blocks;
 
-		if (!(buffer_allocation.memory_type_info.properties&(vk::MemoryPropertyFlagBits::eDeviceLocal|vk::MemoryPropertyFlagBits::eHostVisible)))
-		{
-			VulkanStagingBufferAllocation staging_buffer_allocation{};
-			staging_buffer_allocation.handle = device.createBuffer({
-				vk::BufferCreateFlags{},
-				buffer_allocation.size,
-				vk::BufferUsageFlagBits::eTransferSrc,
-			});
+	uint64_t fl_bitmap;
+	std::array<uint32_t, vulkan_heap_fl_count> sl_bitmaps;
+	std::array<std::array<uint32_t, vulkan_heap_sl_count>, vulkan_heap_fl_count> free_lists;
+};
 
-			vk::BufferMemoryRequirementsInfo2 staging_buffer_memory_requirements_info;
-			staging_buffer_memory_requirements_info.buffer = staging_buffer_allocation.handle;
-			
-			vk::MemoryRequirements2 staging_buffer_memory_requirements;
-			device.getBufferMemoryRequirements2(&staging_buffer_memory_requirements_info, &staging_buffer_memory_requirements);
+struct VulkanHeap
+{
+	vk::Device device;
+	vk::PhysicalDeviceMemoryProperties memory_properties;
+	std::vector<VulkanHeapPool> pools;
+	std::vector<VulkanHeapNode> nodes;
+	std::vector<uint32_t> unused_nodes;
+
+	// Drivers only allow so many allocateMemory calls to be alive at once.
+	uint32_t memory_allocation_count;
+	uint32_t max_memory_allocation_count;
+};
 
-			staging_buffer_allocation.size = staging_buffer_memory_requirements.memoryRequirements.size;
-			staging_buffer_allocation.align = staging_buffer_memory_requirements.memoryRequirements.alignment;
+struct VulkanHeapAllocation
+{
+	vk::DeviceMemory memory;
+	vk::DeviceSize offset;
+	std::byte *mapped; // Only set if the memory is host visible.
 
-			staging_buffer_allocation.memory_type_info = vulkan_get_memory_type_info(
-				physical_device_memory_properties,
-				staging_buffer_memory_requirements.memoryRequirements.memoryTypeBits,
-				vk::BufferUsageFlagBits::eTransferSrc);
+	// vulkan_heap_null if the allocation has its own vk::DeviceMemory.
+	uint32_t pool_idx = vulkan_heap_null;
+	uint32_t node_idx = vulkan_heap_null;
+};
 
-			buffer_allocation.staging_buffer = staging_buffer_allocation;
-		}
+static VulkanHeap vulkan_heap_create(
+	vk::Device const device,
+	vk::PhysicalDevice const physical_device)
+{
+	VulkanHeap res{};
+	res.device = device;
+	res.memory_properties = physical_device.getMemoryProperties();
+	res.max_memory_allocation_count = physical_device.getProperties().limits.maxMemoryAllocationCount;
 
-		if (memory_dedicated_requirements.prefersDedicatedAllocation || memory_dedicated_requirements.requiresDedicatedAllocation) 
+	res.pools.resize(res.memory_properties.memoryTypeCount*2);
+	for (size_t i = 0; i < res.pools.size(); ++i)
+	{
+		VulkanHeapPool &pool = res.pools[i];
+		pool.memory_type_idx = static_cast<uint32_t>(i/2);
+
+		// Small heaps, like the 256 MiB host visible device local heap on GPUs without resizable BAR, get smaller blocks,
+		// so that a single block doesn't hog the whole heap.
+		uint32_t memory_heap_idx = res.memory_properties.memoryTypes[pool.memory_type_idx].heapIndex;
+		vk::DeviceSize memory_heap_size = res.memory_properties.memoryHeaps[memory_heap_idx].size;
+		pool.block_size = std::min<vk::DeviceSize>(BASED_RENDERER_VULKAN_HEAP_BLOCK_SIZE, std::bit_floor(memory_heap_size/8));
+		pool.block_size = std::max(pool.block_size, vulkan_heap_min_align);
+
+		pool.fl_bitmap = 0;
+		pool.sl_bitmaps.fill(0);
+		for (std::array<uint32_t, vulkan_heap_sl_count> &free_list : pool.free_lists)
 		{
-			buffer_allocation.dedicated_allocation = true;
-			buffer_allocation.offset = 0;
+			free_list.fill(vulkan_heap_null);
+		}
+	}
 
-			vk::MemoryDedicatedAllocateInfo memory_dedicated_allocate_info;
-			memory_dedicated_allocate_info.buffer = buffer_allocation.handle;
-			
-			vk::MemoryAllocateInfo memory_allocate_info;
-			memory_allocate_info.pNext = &memory_dedicated_allocate_info;
-			memory_allocate_info.allocationSize = buffer_allocation.size;
-			memory_allocate_info.memoryTypeIndex = buffer_allocation.memory_type_info.idx;
+	return res;
+}
 
-			buffer_allocation.memory = device.allocateMemory(memory_allocate_info);
+// Assumes that size is at least vulkan_heap_min_align.
+static void vulkan_heap_mapping(vk::DeviceSize const size, uint32_t &fl, uint32_t &sl) noexcept
+{
+	fl = static_cast<uint32_t>(std::bit_width(size)) - 1;
+	sl = static_cast<uint32_t>(size >> (fl - vulkan_heap_sl_bits)) ^ vulkan_heap_sl_count;
+}
 
-			vk::BindBufferMemoryInfo bind_buffer_memory_info;
-			bind_buffer_memory_info.buffer = buffer_allocation.handle;
-			bind_buffer_memory_info.memory = buffer_allocation.memory;
-			bind_buffer_memory_infos.push_back(bind_buffer_memory_info);
-		}
+static uint32_t vulkan_heap_new_node(VulkanHeap &heap)
+{
+	uint32_t res;
+	if (heap.unused_nodes.size() > 0)
+	{
+		res = heap.unused_nodes.back();
+		heap.unused_nodes.pop_back();
 	}
-
-	for (size_t i = 0; i < image_count; ++i) 
+	else
 	{
-		VulkanImageAllocation &image_allocation = image_allocations[i];
-		image_allocation.handle = device.createImage(image_create_infos[i]);
+		res = static_cast<uint32_t>(heap.nodes.size());
+		heap.nodes.emplace_back();
+	}
+	heap.nodes[res] = VulkanHeapNode{
+		.offset = 0,
+		.size = 0,
+		.block_idx = vulkan_heap_null,
+		.prev_physical = vulkan_heap_null,
+		.next_physical = vulkan_heap_null,
+		.prev_free = vulkan_heap_null,
+		.next_free = vulkan_heap_null,
+		.free = false,
+	};
+	return res;
+}
 
-		vk::MemoryDedicatedRequirements memory_dedicated_requirements;
+static void vulkan_heap_insert_free(VulkanHeap &heap, VulkanHeapPool &pool, uint32_t const node_idx) noexcept
+{
+	VulkanHeapNode &node = heap.nodes[node_idx];
+	uint32_t fl, sl;
+	vulkan_heap_mapping(node.size, fl, sl);
+
+	uint32_t &head = pool.free_lists[fl][sl];
+	node.free = true;
+	node.prev_free = vulkan_heap_null;
+	node.next_free = head;
+	if (head != vulkan_heap_null)
+	{
+		heap.nodes[head].prev_free = node_idx;
+	}
+	head = node_idx;
+
+	pool.fl_bitmap |= uint64_t{1} << fl;
+	pool.sl_bitmaps[fl] |= 1u << sl;
+}
+
+static void vulkan_heap_remove_free(VulkanHeap &heap, VulkanHeapPool &pool, uint32_t const node_idx) noexcept
+{
+	VulkanHeapNode &node = heap.nodes[node_idx];
+	uint32_t fl, sl;
+	vulkan_heap_mapping(node.size, fl, sl);
+
+	if (node.prev_free != vulkan_heap_null)
+	{
+		heap.nodes[node.prev_free].next_free = node.next_free;
+	}
+	else
+	{
+		pool.free_lists[fl][sl] = node.next_free;
+	}
+	if (node.next_free != vulkan_heap_null)
+	{
+		heap.nodes[node.next_free].prev_free = node.prev_free;
+	}
+
+	if (pool.free_lists[fl][sl] == vulkan_heap_null)
+	{
+		pool.sl_bitmaps[fl] &= ~(1u << sl);
+		if (pool.sl_bitmaps[fl] == 0)
+		{
+			pool.fl_bitmap &= ~(uint64_t{1} << fl);
+		}
+	}
+
+	node.free = false;
+	node.prev_free = vulkan_heap_null;
+	node.next_free = vulkan_heap_null;
+}
+
+// Returns vulkan_heap_null if there is no free node that is big enough.
+static uint32_t vulkan_heap_find_free(VulkanHeap const &heap, VulkanHeapPool const &pool, vk::DeviceSize size) noexcept
+{
+	UNUSED(heap);
+
+	// Round up to the start of the next second level list. That way, every node in whatever list we find is big enough,
+	// and we never have to walk a list.
+	uint32_t fl = static_cast<uint32_t>(std::bit_width(size)) - 1;
+	size += (vk::DeviceSize{1} << (fl - vulkan_heap_sl_bits)) - 1;
+	uint32_t sl;
+	vulkan_heap_mapping(size, fl, sl);
+
+	uint32_t sl_bitmap = pool.sl_bitmaps[fl] & (~0u << sl);
+	if (sl_bitmap == 0)
+	{
+		uint64_t fl_bitmap = fl + 1 < vulkan_heap_fl_count ? pool.fl_bitmap & (~uint64_t{0} << (fl + 1)) : 0;
+		if (fl_bitmap == 0)
+		{
+			return vulkan_heap_null;
+		}
+		fl = static_cast<uint32_t>(std::countr_zero(fl_bitmap));
+		sl_bitmap = pool.sl_bitmaps[fl];
+	}
+	sl = static_cast<uint32_t>(std::countr_zero(sl_bitmap));
+
+	return pool.free_lists[fl][sl];
+}
+
+static vk::DeviceMemory vulkan_heap_allocate_memory(
+	VulkanHeap &heap,
+	vk::MemoryAllocateInfo const &memory_allocate_info,
+	std::byte *&mapped)
+{
+	if (heap.memory_allocation_count >= heap.max_memory_allocation_count)
+	{
+		throw vk::TooManyObjectsError{FORMAT_ERROR(std::format("Reached maxMemoryAllocationCount ({}).", heap.max_memory_allocation_count))};
+	}
+
+	// Any buffer might end up being read through a pointer, see PushConstants, so all memory can back one.
+	vk::MemoryAllocateFlagsInfo memory_allocate_flags_info{
+		vk::MemoryAllocateFlagBits::eDeviceAddress,
+		0,
+		memory_allocate_info.pNext,
+	};
+	vk::MemoryAllocateInfo device_address_memory_allocate_info = memory_allocate_info;
+	device_address_memory_allocate_info.pNext = &memory_allocate_flags_info;
+
+	vk::DeviceMemory res = heap.device.allocateMemory(device_address_memory_allocate_info);
+	heap.memory_allocation_count += 1;
+
+	// Host visible memory gets mapped once and stays mapped for as long as it lives.
+	mapped = nullptr;
+	if (heap.memory_properties.memoryTypes[memory_allocate_info.memoryTypeIndex].propertyFlags&vk::MemoryPropertyFlagBits::eHostVisible)
+	{
+		void *data;
+		vk::detail::resultCheck(heap.device.mapMemory(res, 0, vk::WholeSize, vk::MemoryMapFlags{}, &data), "Failed to map memory!");
+		mapped = static_cast<std::byte *>(data);
+	}
+
+	return res;
+}
+
+static void vulkan_heap_pool_grow(VulkanHeap &heap, uint32_t const pool_idx)
+{
+	VulkanHeapPool &pool = heap.pools[pool_idx];
+
+	vk::MemoryAllocateInfo memory_allocate_info;
+	memory_allocate_info.allocationSize = pool.block_size;
+	memory_allocate_info.memoryTypeIndex = pool.memory_type_idx;
+
+	VulkanHeapBlock block;
+	block.size = pool.block_size;
+	block.memory = vulkan_heap_allocate_memory(heap, memory_allocate_info, block.mapped);
+	pool.blocks.push_back(block);
+
+	uint32_t node_idx = vulkan_heap_new_node(heap);
+	VulkanHeapNode &node = heap.nodes[node_idx];
+	node.offset = 0;
+	node.size = block.size;
+	node.block_idx = static_cast<uint32_t>(pool.blocks.size() - 1);
+	vulkan_heap_insert_free(heap, pool, node_idx);
+}
+
+// Returns false if there is no free node big enough in the pool.
+static bool vulkan_heap_pool_allocate(
+	VulkanHeap &heap,
+	uint32_t const pool_idx,
+	vk::DeviceSize size,
+	vk::DeviceSize align,
+	VulkanHeapAllocation &res)
+{
+	VulkanHeapPool &pool = heap.pools[pool_idx];
+
+	size = align_forward(std::max(size, vulkan_heap_min_align), vulkan_heap_min_align);
+	align = std::max(align, vulkan_heap_min_align);
+
+	// Searching for the worst case padding as well means that whatever we find fits, no matter where it starts.
+	vk::DeviceSize search_size = size + (align - vulkan_heap_min_align);
+	uint32_t node_idx = vulkan_heap_find_free(heap, pool, search_size);
+	if (node_idx == vulkan_heap_null)
+	{
+		return false;
+	}
+	vulkan_heap_remove_free(heap, pool, node_idx);
+
+	// Since free nodes are always merged with their free neighbors, the neighbors of the node we just took are in use.
+	// So the pieces we split off here can go straight back into the free lists without merging.
+
+	vk::DeviceSize padding = align_forward(heap.nodes[node_idx].offset, align) - heap.nodes[node_idx].offset;
+	if (padding > 0)
+	{
+		uint32_t padding_node_idx = vulkan_heap_new_node(heap);
+		VulkanHeapNode &node = heap.nodes[node_idx];
+		VulkanHeapNode &padding_node = heap.nodes[padding_node_idx];
+		padding_node.offset = node.offset;
+		padding_node.size = padding;
+		padding_node.block_idx = node.block_idx;
+		padding_node.prev_physical = node.prev_physical;
+		padding_node.next_physical = node_idx;
+		if (node.prev_physical != vulkan_heap_null)
+		{
+			heap.nodes[node.prev_physical].next_physical = padding_node_idx;
+		}
+		node.prev_physical = padding_node_idx;
+		node.offset += padding;
+		node.size -= padding;
+		vulkan_heap_insert_free(heap, pool, padding_node_idx);
+	}
+
+	if (heap.nodes[node_idx].size - size >= vulkan_heap_min_align)
+	{
+		uint32_t remainder_node_idx = vulkan_heap_new_node(heap);
+		VulkanHeapNode &node = heap.nodes[node_idx];
+		VulkanHeapNode &remainder_node = heap.nodes[remainder_node_idx];
+		remainder_node.offset = node.offset + size;
+		remainder_node.size = node.size - size;
+		remainder_node.block_idx = node.block_idx;
+		remainder_node.prev_physical = node_idx;
+		remainder_node.next_physical = node.next_physical;
+		if (node.next_physical != vulkan_heap_null)
+		{
+			heap.nodes[node.next_physical].prev_physical = remainder_node_idx;
+		}
+		node.next_physical = remainder_node_idx;
+		node.size = size;
+		vulkan_heap_insert_free(heap, pool, remainder_node_idx);
+	}
+
+	VulkanHeapNode const &node = heap.nodes[node_idx];
+	VulkanHeapBlock const &block = pool.blocks[node.block_idx];
+	res.memory = block.memory;
+	res.offset = node.offset;
+	res.mapped = block.mapped ? block.mapped + node.offset : nullptr;
+	res.pool_idx = pool_idx;
+	res.node_idx = node_idx;
+	return true;
+}
+
+// If dedicated_allocate_info is not null, the allocation gets its own vk::DeviceMemory.
+// The same happens for anything too big to fit comfortably in a block.
+static VulkanHeapAllocation vulkan_heap_allocate(
+	VulkanHeap &heap,
+	vk::MemoryRequirements const &memory_requirements,
+	uint32_t const memory_type_idx,
+	bool const non_linear,
+	vk::MemoryDedicatedAllocateInfo const *const dedicated_allocate_info)
+{
+	VulkanHeapAllocation res{};
+
+	uint32_t pool_idx = memory_type_idx*2 + (non_linear ? 1 : 0);
+	if (!dedicated_allocate_info && memory_requirements.size <= heap.pools[pool_idx].block_size/2)
+	{
+		if (vulkan_heap_pool_allocate(heap, pool_idx, memory_requirements.size, memory_requirements.alignment, res))
+		{
+			return res;
+		}
+
+		vulkan_heap_pool_grow(heap, pool_idx);
+		if (vulkan_heap_pool_allocate(heap, pool_idx, memory_requirements.size, memory_requirements.alignment, res))
+		{
+			return res;
+		}
+
+		throw vk::LogicError{FORMAT_ERROR("Failed to allocate from a brand new block.")};
+	}
+
+	vk::MemoryAllocateInfo memory_allocate_info;
+	memory_allocate_info.pNext = dedicated_allocate_info;
+	memory_allocate_info.allocationSize = memory_requirements.size;
+	memory_allocate_info.memoryTypeIndex = memory_type_idx;
+
+	res.memory = vulkan_heap_allocate_memory(heap, memory_allocate_info, res.mapped);
+	res.offset = 0;
+	return res;
+}
+
+static void vulkan_heap_free(VulkanHeap &heap, VulkanHeapAllocation const &allocation)
+{
+	if (!allocation.memory)
+	{
+		return;
+	}
+
+	if (allocation.pool_idx == vulkan_heap_null)
+	{
+		heap.device.freeMemory(allocation.memory);
+		heap.memory_allocation_count -= 1;
+		return;
+	}
+
+	// Blocks are never given back to the driver. The whole point is to not pay for allocateMemory again.
+	VulkanHeapPool &pool = heap.pools[allocation.pool_idx];
+	uint32_t node_idx = allocation.node_idx;
+
+	uint32_t prev_node_idx = heap.nodes[node_idx].prev_physical;
+	if (prev_node_idx != vulkan_heap_null && heap.nodes[prev_node_idx].free)
+	{
+		vulkan_heap_remove_free(heap, pool, prev_node_idx);
+		VulkanHeapNode &prev_node = heap.nodes[prev_node_idx];
+		VulkanHeapNode const &node = heap.nodes[node_idx];
+		prev_node.size += node.size;
+		prev_node.next_physical = node.next_physical;
+		if (node.next_physical != vulkan_heap_null)
+		{
+			heap.nodes[node.next_physical].prev_physical = prev_node_idx;
+		}
+		heap.unused_nodes.push_back(node_idx);
+		node_idx = prev_node_idx;
+	}
+
+	uint32_t next_node_idx = heap.nodes[node_idx].next_physical;
+	if (next_node_idx != vulkan_heap_null && heap.nodes[next_node_idx].free)
+	{
+		vulkan_heap_remove_free(heap, pool, next_node_idx);
+		VulkanHeapNode &node = heap.nodes[node_idx];
+		VulkanHeapNode const &next_node = heap.nodes[next_node_idx];
+		node.size += next_node.size;
+		node.next_physical = next_node.next_physical;
+		if (next_node.next_physical != vulkan_heap_null)
+		{
+			heap.nodes[next_node.next_physical].prev_physical = node_idx;
+		}
+		heap.unused_nodes.push_back(next_node_idx);
+	}
+
+	vulkan_heap_insert_free(heap, pool, node_idx);
+}
+
+struct VulkanBufferAllocation
+{
+	VulkanHeapAllocation heap_allocation;
+	vk::DeviceSize size;
+	vk::DeviceSize align;
+	VulkanMemoryTypeInfo memory_type_info;
+
+	vk::Buffer handle;
+
+	// Memory the host can't see has to be uploaded through the uploader's staging ring.
+	bool needs_staging() const
+	{
+		return !(memory_type_info.properties&vk::MemoryPropertyFlagBits::eHostVisible);
+	}
+};
+
+struct VulkanImageAllocation
+{
+	VulkanHeapAllocation heap_allocation;
+	vk::DeviceSize size;
+	vk::DeviceSize align;
+	VulkanMemoryTypeInfo memory_type_info;
+
+	vk::Image handle;
+};
+
+// Creates the buffers and images and sub-allocates memory for them from the heap.
+// Nothing here calls allocateMemory unless the heap runs out of room, or a resource wants a dedicated allocation.
+void vulkan_allocate(
+	/* in out */ VulkanHeap &heap,
+	/* in */ std::span<vk::BufferCreateInfo> buffer_create_infos,
+	/* in */ std::span<vk::ImageCreateInfo> image_create_infos,
+	/* out */ std::span<VulkanBufferAllocation> buffer_allocations,
+	/* out */ std::span<VulkanImageAllocation> image_allocations) 
+{
+	vk::Device const device = heap.device;
+
+	// TODO: Should I do a warning here?
+	size_t buffer_count = std::min(buffer_create_infos.size(), buffer_allocations.size());
+	size_t image_count = std::min(image_create_infos.size(), image_allocations.size());
+
+	std::vector<vk::BindBufferMemoryInfo> bind_buffer_memory_infos;
+	bind_buffer_memory_infos.reserve(buffer_count);
+	std::vector<vk::BindImageMemoryInfo> bind_image_memory_infos;
+	bind_image_memory_infos.reserve(image_count);
+
+	for (size_t i = 0; i < buffer_count; ++i) 
+	{
+		VulkanBufferAllocation &buffer_allocation = buffer_allocations[i];
+		buffer_allocation.handle = device.createBuffer(buffer_create_infos[i]);
+
+		vk::MemoryDedicatedRequirements memory_dedicated_requirements;
+		
+		vk::BufferMemoryRequirementsInfo2 memory_requirements_info;
+		memory_requirements_info.buffer = buffer_allocation.handle;
+		
+		vk::MemoryRequirements2 buffer_memory_requirements;
+		buffer_memory_requirements.pNext = &memory_dedicated_requirements;
+		device.getBufferMemoryRequirements2(&memory_requirements_info, &buffer_memory_requirements);
+
+		buffer_allocation.size = buffer_memory_requirements.memoryRequirements.size;
+		buffer_allocation.align = buffer_memory_requirements.memoryRequirements.alignment;
+
+		buffer_allocation.memory_type_info = vulkan_get_memory_type_info(
+			heap.memory_properties,
+			buffer_memory_requirements.memoryRequirements.memoryTypeBits,
+			buffer_create_infos[i].usage);
+
+		vk::MemoryDedicatedAllocateInfo memory_dedicated_allocate_info;
+		memory_dedicated_allocate_info.buffer = buffer_allocation.handle;
+		bool dedicated = memory_dedicated_requirements.prefersDedicatedAllocation || memory_dedicated_requirements.requiresDedicatedAllocation;
+
+		buffer_allocation.heap_allocation = vulkan_heap_allocate(
+			heap,
+			buffer_memory_requirements.memoryRequirements,
+			buffer_allocation.memory_type_info.idx,
+			false,
+			dedicated ? &memory_dedicated_allocate_info : nullptr);
+
+		vk::BindBufferMemoryInfo bind_buffer_memory_info;
+		bind_buffer_memory_info.buffer = buffer_allocation.handle;
+		bind_buffer_memory_info.memory = buffer_allocation.heap_allocation.memory;
+		bind_buffer_memory_info.memoryOffset = buffer_allocation.heap_allocation.offset;
+		bind_buffer_memory_infos.push_back(bind_buffer_memory_info);
+	}
+
+	for (size_t i = 0; i < image_count; ++i) 
+	{
+		VulkanImageAllocation &image_allocation = image_allocations[i];
+		image_allocation.handle = device.createImage(image_create_infos[i]);
+
+		vk::MemoryDedicatedRequirements memory_dedicated_requirements;
 		
 		vk::ImageMemoryRequirementsInfo2 memory_requirements_info;
 		memory_requirements_info.image = image_allocation.handle;
@@ -412,404 +1108,2644 @@ void vulkan_allocate(
 		image_memory_requirements.pNext = &memory_dedicated_requirements;
 		device.getImageMemoryRequirements2(&memory_requirements_info, &image_memory_requirements);
 
-		image_allocation.size = image_memory_requirements.memoryRequirements.size;
-		image_allocation.align = image_memory_requirements.memoryRequirements.alignment;
-		image_allocation.memory_type_info = vulkan_get_memory_type_info(
-			physical_device_memory_properties,
-			image_memory_requirements.memoryRequirements.memoryTypeBits,
-			image_create_infos[i].usage);
+		image_allocation.size = image_memory_requirements.memoryRequirements.size;
+		image_allocation.align = image_memory_requirements.memoryRequirements.alignment;
+		image_allocation.memory_type_info = vulkan_get_memory_type_info(
+			heap.memory_properties,
+			image_memory_requirements.memoryRequirements.memoryTypeBits,
+			image_create_infos[i].usage);
+
+		vk::MemoryDedicatedAllocateInfo memory_dedicated_allocate_info;
+		memory_dedicated_allocate_info.image = image_allocation.handle;
+		bool dedicated = memory_dedicated_requirements.prefersDedicatedAllocation || memory_dedicated_requirements.requiresDedicatedAllocation;
+
+		image_allocation.heap_allocation = vulkan_heap_allocate(
+			heap,
+			image_memory_requirements.memoryRequirements,
+			image_allocation.memory_type_info.idx,
+			image_create_infos[i].tiling == vk::ImageTiling::eOptimal,
+			dedicated ? &memory_dedicated_allocate_info : nullptr);
+
+		vk::BindImageMemoryInfo bind_image_memory_info;
+		bind_image_memory_info.image = image_allocation.handle;
+		bind_image_memory_info.memory = image_allocation.heap_allocation.memory;
+		bind_image_memory_info.memoryOffset = image_allocation.heap_allocation.offset;
+		bind_image_memory_infos.push_back(bind_image_memory_info);
+	}
+
+	device.bindBufferMemory2(bind_buffer_memory_infos);
+	device.bindImageMemory2(bind_image_memory_infos);
+}
+
+// Destroys the buffer and gives its memory back to the heap. The GPU must be done with it.
+static void vulkan_free(VulkanHeap &heap, VulkanBufferAllocation &buffer_allocation)
+{
+	heap.device.destroyBuffer(buffer_allocation.handle);
+	vulkan_heap_free(heap, buffer_allocation.heap_allocation);
+	buffer_allocation = VulkanBufferAllocation{};
+}
+
+// Same, but for images.
+static void vulkan_free(VulkanHeap &heap, VulkanImageAllocation &image_allocation)
+{
+	heap.device.destroyImage(image_allocation.handle);
+	vulkan_heap_free(heap, image_allocation.heap_allocation);
+	image_allocation = VulkanImageAllocation{};
+}
+
+// Uploads are recorded into their own command buffers and submitted to the transfer queue, so they overlap with rendering 
+// instead of sitting in front of it in the graphics command buffer. 
+// Completion is tracked with a timeline semaphore: every flush signals the next value, and whoever uses the uploaded data waits on it.
+//
+// All uploads go through one staging ring, so the host visible memory used for staging stays the same no matter how much gets uploaded.
+// Uploads that are bigger than BASED_RENDERER_VULKAN_STAGING_CHUNK_SIZE get split into chunks, and when the ring is full,
+// the uploader waits for the oldest batch to finish, since the space it used can be reused after that.
+#define BASED_RENDERER_VULKAN_STAGING_RING_SIZE (16*1024*1024)
+#define BASED_RENDERER_VULKAN_STAGING_CHUNK_SIZE (BASED_RENDERER_VULKAN_STAGING_RING_SIZE/4)
+// Enough for copies into any image format too, if that ever happens.
+#define BASED_RENDERER_VULKAN_STAGING_ALIGN 16
+
+struct VulkanUploadBatch
+{
+	vk::CommandBuffer command_buffer;
+	// The batch is done once the timeline semaphore reaches this.
+	uint64_t timeline_value;
+	// Where the batch's space in the staging ring ends. Once the batch is done, everything up to here is free.
+	vk::DeviceSize staging_end;
+};
+
+struct VulkanUploader
+{
+	vk::Device device;
+	vk::Queue queue;
+	uint32_t queue_family_idx;
+	// The queue family that uses the uploaded data. If it's different from queue_family_idx, every upload needs an ownership transfer.
+	uint32_t dst_queue_family_idx;
+	vk::DeviceSize non_coherent_atom_size;
+
+	vk::CommandPool command_pool;
+	vk::Semaphore timeline_semaphore;
+	// The value the last flushed batch signals.
+	uint64_t timeline_value;
+
+	// head and tail only ever go up, and wrap around the ring with %. Everything in [tail, head) is in use.
+	VulkanBufferAllocation staging_ring;
+	vk::DeviceSize staging_head;
+	vk::DeviceSize staging_tail;
+
+	// The batch that's being recorded. Null if nothing has been uploaded since the last flush.
+	vk::CommandBuffer command_buffer;
+	std::vector<vk::BufferMemoryBarrier2> release_barriers;
+	std::vector<vk::BufferMemoryBarrier2> pending_acquire_barriers;
+	vk::PipelineStageFlags2 pending_acquire_stages;
+
+	// What the destination queue has to do before it can use anything from the flushed batches. See vulkan_uploader_acquire.
+	std::vector<vk::BufferMemoryBarrier2> acquire_barriers;
+	vk::PipelineStageFlags2 acquire_stages;
+	// 0 if there's nothing to wait for.
+	uint64_t acquire_timeline_value;
+
+	// Oldest first.
+	std::deque<VulkanUploadBatch> batches_in_flight;
+	std::vector<vk::CommandBuffer> free_command_buffers;
+};
+
+// staging_ring has to be host visible, and BASED_RENDERER_VULKAN_STAGING_RING_SIZE big.
+static VulkanUploader vulkan_uploader_create(
+	vk::Device const device, 
+	vk::Queue const queue, 
+	uint32_t const queue_family_idx, 
+	uint32_t const dst_queue_family_idx,
+	vk::DeviceSize const non_coherent_atom_size,
+	VulkanBufferAllocation const &staging_ring)
+{
+	VulkanUploader res{};
+	res.device = device;
+	res.queue = queue;
+	res.queue_family_idx = queue_family_idx;
+	res.dst_queue_family_idx = dst_queue_family_idx;
+	res.non_coherent_atom_size = non_coherent_atom_size;
+	res.staging_ring = staging_ring;
+
+	res.command_pool = device.createCommandPool({
+		vk::CommandPoolCreateFlags(vk::CommandPoolCreateFlagBits::eTransient|vk::CommandPoolCreateFlagBits::eResetCommandBuffer),
+		queue_family_idx,
+	});
+
+	vk::SemaphoreTypeCreateInfo semaphore_type_create_info{
+		vk::SemaphoreType::eTimeline,
+		0,
+	};
+	res.timeline_semaphore = device.createSemaphore({{}, &semaphore_type_create_info});
+
+	return res;
+}
+
+// Host writes to memory that isn't host coherent have to be flushed before the GPU can see them.
+// The range has to be aligned to nonCoherentAtomSize, or go all the way to the end of the memory, which is what this does.
+static void vulkan_uploader_flush_host_writes(VulkanUploader const &uploader, VulkanBufferAllocation const &buffer, vk::DeviceSize const offset)
+{
+	if (!(buffer.memory_type_info.properties&vk::MemoryPropertyFlagBits::eHostCoherent))
+	{
+		vk::DeviceSize flush_offset = (buffer.heap_allocation.offset + offset)/uploader.non_coherent_atom_size*uploader.non_coherent_atom_size;
+		uploader.device.flushMappedMemoryRanges({{buffer.heap_allocation.memory, flush_offset, vk::WholeSize}});
+	}
+}
+
+// The other direction: GPU writes to memory that isn't host coherent have to be invalidated before the host can see them.
+// Same alignment rules as flushing.
+static void vulkan_invalidate_host_reads(
+	vk::Device const device, 
+	VulkanBufferAllocation const &buffer, 
+	vk::DeviceSize const non_coherent_atom_size)
+{
+	if (!(buffer.memory_type_info.properties&vk::MemoryPropertyFlagBits::eHostCoherent))
+	{
+		vk::DeviceSize invalidate_offset = buffer.heap_allocation.offset/non_coherent_atom_size*non_coherent_atom_size;
+		device.invalidateMappedMemoryRanges({{buffer.heap_allocation.memory, invalidate_offset, vk::WholeSize}});
+	}
+}
+
+// Gives the command buffers and staging space of finished batches back. If wait is true, it first waits for the oldest batch to finish.
+static void vulkan_uploader_reclaim(VulkanUploader &uploader, bool const wait)
+{
+	if (wait && !uploader.batches_in_flight.empty())
+	{
+		vk::detail::resultCheck(uploader.device.waitSemaphores(
+			{{}, uploader.timeline_semaphore, uploader.batches_in_flight.front().timeline_value},
+			std::numeric_limits<uint64_t>::max()), "Failed to wait for upload.");
+	}
+
+	uint64_t completed_timeline_value = uploader.device.getSemaphoreCounterValue(uploader.timeline_semaphore);
+	while (!uploader.batches_in_flight.empty() && uploader.batches_in_flight.front().timeline_value <= completed_timeline_value)
+	{
+		uploader.free_command_buffers.push_back(uploader.batches_in_flight.front().command_buffer);
+		uploader.staging_tail = uploader.batches_in_flight.front().staging_end;
+		uploader.batches_in_flight.pop_front();
+	}
+}
+
+static void vulkan_uploader_flush(VulkanUploader &uploader);
+
+// Returns the offset in the staging ring of size contiguous bytes. Never wraps in the middle of an allocation.
+// size must not be bigger than BASED_RENDERER_VULKAN_STAGING_CHUNK_SIZE.
+static vk::DeviceSize vulkan_uploader_allocate_staging(VulkanUploader &uploader, vk::DeviceSize const size)
+{
+	vk::DeviceSize const ring_size = BASED_RENDERER_VULKAN_STAGING_RING_SIZE;
+	for (;;)
+	{
+		vk::DeviceSize head = align_forward(uploader.staging_head, BASED_RENDERER_VULKAN_STAGING_ALIGN);
+		// Skip whatever is left at the end of the ring if it's too small.
+		if (head%ring_size + size > ring_size)
+		{
+			head += ring_size - head%ring_size;
+		}
+
+		if (head + size - uploader.staging_tail <= ring_size)
+		{
+			uploader.staging_head = head + size;
+			return head%ring_size;
+		}
+
+		// The ring is full. If it's full of the batch that's being recorded, that has to be submitted first, or there'd be nothing to wait on.
+		if (uploader.batches_in_flight.empty())
+		{
+			vulkan_uploader_flush(uploader);
+		}
+		vulkan_uploader_reclaim(uploader, true);
+	}
+}
+
+// Copies size bytes of data to offset in dst. dst_stages and dst_access are how the destination queue is going to use it.
+// Host visible buffers just get written directly, everything else goes through the staging ring and the transfer queue.
+// Nothing gets submitted until vulkan_uploader_flush, unless the staging ring fills up.
+static void vulkan_uploader_upload_buffer(
+	VulkanUploader &uploader,
+	VulkanBufferAllocation const &dst,
+	vk::DeviceSize const offset,
+	void const *const data,
+	vk::DeviceSize const size,
+	vk::PipelineStageFlags2 const dst_stages,
+	vk::AccessFlags2 const dst_access)
+{
+	if (!dst.needs_staging())
+	{
+		std::memcpy(dst.heap_allocation.mapped + offset, data, size);
+		vulkan_uploader_flush_host_writes(uploader, dst, offset);
+		return;
+	}
+
+	for (vk::DeviceSize chunk_offset = 0; chunk_offset < size; chunk_offset += BASED_RENDERER_VULKAN_STAGING_CHUNK_SIZE)
+	{
+		vk::DeviceSize chunk_size = std::min<vk::DeviceSize>(size - chunk_offset, BASED_RENDERER_VULKAN_STAGING_CHUNK_SIZE);
+		vk::DeviceSize staging_offset = vulkan_uploader_allocate_staging(uploader, chunk_size);
+		std::memcpy(uploader.staging_ring.heap_allocation.mapped + staging_offset, static_cast<std::byte const *>(data) + chunk_offset, chunk_size);
+
+		// Allocating might have flushed, so this has to come after it.
+		if (!uploader.command_buffer)
+		{
+			if (uploader.free_command_buffers.empty())
+			{
+				uploader.command_buffer = uploader.device.allocateCommandBuffers({
+					uploader.command_pool,
+					vk::CommandBufferLevel::ePrimary,
+					1,
+				})[0];
+			}
+			else
+			{
+				uploader.command_buffer = uploader.free_command_buffers.back();
+				uploader.free_command_buffers.pop_back();
+			}
+			uploader.command_buffer.begin({
+				vk::CommandBufferUsageFlagBits::eOneTimeSubmit,
+			});
+		}
+
+		uploader.command_buffer.copyBuffer(uploader.staging_ring.handle, dst.handle, {{staging_offset, offset + chunk_offset, chunk_size}});
+	}
+
+	if (uploader.queue_family_idx != uploader.dst_queue_family_idx)
+	{
+		// The release and the acquire have to match exactly.
+		vk::BufferMemoryBarrier2 barrier{
+			vk::PipelineStageFlagBits2::eCopy,
+			vk::AccessFlagBits2::eTransferWrite,
+			vk::PipelineStageFlagBits2::eNone,
+			vk::AccessFlagBits2::eNone,
+			uploader.queue_family_idx,
+			uploader.dst_queue_family_idx,
+			dst.handle,
+			offset,
+			size,
+		};
+		uploader.release_barriers.push_back(barrier);
+
+		// The acquire's source stages are the same as the stages that wait on the semaphore, which makes it part of the same dependency chain.
+		barrier.srcStageMask = dst_stages;
+		barrier.srcAccessMask = vk::AccessFlagBits2::eNone;
+		barrier.dstStageMask = dst_stages;
+		barrier.dstAccessMask = dst_access;
+		uploader.pending_acquire_barriers.push_back(barrier);
+	}
+	// With only one queue family, the semaphore wait alone makes the copy visible.
+	uploader.pending_acquire_stages |= dst_stages;
+}
+
+// Submits everything that was uploaded since the last flush. Does nothing if there wasn't anything.
+static void vulkan_uploader_flush(VulkanUploader &uploader)
+{
+	vulkan_uploader_reclaim(uploader, false);
+
+	if (!uploader.command_buffer)
+	{
+		return;
+	}
+
+	// A chunk can straddle the end of the ring's memory, so everything from the start of the ring gets flushed.
+	vulkan_uploader_flush_host_writes(uploader, uploader.staging_ring, 0);
+
+	// The release barriers only get recorded once an upload is done, so an upload that got split across batches releases in the last one.
+	if (!uploader.release_barriers.empty())
+	{
+		uploader.command_buffer.pipelineBarrier2({
+			vk::DependencyFlags{},
+			{},
+			uploader.release_barriers,
+			{},
+		});
+	}
+	uploader.command_buffer.end();
+
+	uploader.timeline_value += 1;
+
+	std::array<vk::CommandBufferSubmitInfo, 1> command_buffer_submit_infos{
+		{
+			uploader.command_buffer,
+		},
+	};
+	std::array<vk::SemaphoreSubmitInfo, 1> signal_semaphore_infos{
+		vk::SemaphoreSubmitInfo{
+			uploader.timeline_semaphore,
+			uploader.timeline_value,
+			vk::PipelineStageFlagBits2::eAllCommands,
+		},
+	};
+	uploader.queue.submit2({
+		vk::SubmitInfo2{
+			{},
+			{},
+			command_buffer_submit_infos,
+			signal_semaphore_infos,
+		}
+	});
+
+	uploader.batches_in_flight.push_back({uploader.command_buffer, uploader.timeline_value, uploader.staging_head});
+	uploader.command_buffer = nullptr;
+	uploader.release_barriers.clear();
+
+	uploader.acquire_barriers.insert(
+		uploader.acquire_barriers.end(), 
+		uploader.pending_acquire_barriers.begin(), 
+		uploader.pending_acquire_barriers.end());
+	uploader.pending_acquire_barriers.clear();
+	uploader.acquire_stages |= uploader.pending_acquire_stages;
+	uploader.pending_acquire_stages = vk::PipelineStageFlags2{};
+	uploader.acquire_timeline_value = uploader.timeline_value;
+}
+
+// Whether vulkan_uploader_acquire has anything to record.
+static bool vulkan_uploader_has_pending_acquire(VulkanUploader const &uploader) noexcept
+{
+	return uploader.acquire_timeline_value != 0;
+}
+
+// Records the ownership acquires for everything flushed since the last call into command_buffer, 
+// and adds the timeline semaphore wait its submit needs to wait_semaphore_infos. Does nothing if nothing was flushed.
+static void vulkan_uploader_acquire(
+	VulkanUploader &uploader, 
+	vk::CommandBuffer const command_buffer, 
+	std::vector<vk::SemaphoreSubmitInfo> &wait_semaphore_infos)
+{
+	if (uploader.acquire_timeline_value == 0)
+	{
+		return;
+	}
+
+	if (!uploader.acquire_barriers.empty())
+	{
+		command_buffer.pipelineBarrier2({
+			vk::DependencyFlags{},
+			{},
+			uploader.acquire_barriers,
+			{},
+		});
+	}
+	wait_semaphore_infos.push_back(vk::SemaphoreSubmitInfo{
+		uploader.timeline_semaphore,
+		uploader.acquire_timeline_value,
+		uploader.acquire_stages,
+	});
+
+	uploader.acquire_barriers.clear();
+	uploader.acquire_stages = vk::PipelineStageFlags2{};
+	uploader.acquire_timeline_value = 0;
+}
+
+// How many descriptors of each kind the bindless table has room for, unless the device supports fewer.
+#define BASED_RENDERER_VULKAN_BINDLESS_SAMPLED_IMAGE_COUNT 4096
+#define BASED_RENDERER_VULKAN_BINDLESS_SAMPLER_COUNT 256
+#define BASED_RENDERER_VULKAN_BINDLESS_STORAGE_IMAGE_COUNT 256
+
+// The bindings of the bindless table, one array per kind of descriptor. Has to match bindless.slang.
+static constexpr uint32_t vulkan_bindless_sampled_image_binding = 0;
+static constexpr uint32_t vulkan_bindless_sampler_binding = 1;
+static constexpr uint32_t vulkan_bindless_storage_image_binding = 2;
+static constexpr uint32_t vulkan_bindless_binding_count = 3;
+// Both the bindless table and the push constants are visible to every stage of every pipeline.
+static constexpr vk::ShaderStageFlags vulkan_bindless_stages = 
+	vk::ShaderStageFlagBits::eVertex|vk::ShaderStageFlagBits::eFragment|vk::ShaderStageFlagBits::eCompute;
+// What the bindless table's buffer gets created with when it lives in a descriptor buffer. Binding it has to repeat these.
+static constexpr vk::BufferUsageFlags vulkan_bindless_descriptor_buffer_usage = 
+	vk::BufferUsageFlagBits::eSamplerDescriptorBufferEXT|vk::BufferUsageFlagBits::eResourceDescriptorBufferEXT|vk::BufferUsageFlagBits::eShaderDeviceAddress;
+
+// One global descriptor set that every pipeline binds at set 0, holding every image and sampler any shader can get at.
+// Shaders find them by index, and the indices come from push constants, see PushConstants, so switching to a different
+// material is just a different index instead of another descriptor set to allocate and bind. Buffers don't need descriptors at all,
+// since shaders read them through pointers.
+// Every binding is update-after-bind and partially bound, so descriptors can get written while the set is bound in command buffers
+// that are recorded or even in flight, as long as those don't use the ones being written.
+// With VK_EXT_descriptor_buffer, the set is just memory in a host visible buffer from our own heap instead of something the driver 
+// allocates from a pool. Each binding's array sits at the offset the layout says, and writing a descriptor is a memcpy of whatever 
+// vkGetDescriptorEXT hands back, so there are no pools, no vkUpdateDescriptorSets and nothing to fragment. Descriptor buffers have 
+// the same rules as update-after-bind, so nothing else has to change.
+struct VulkanBindlessTable
+{
+	vk::DescriptorSetLayout descriptor_set_layout;
+	// Only without a descriptor buffer.
+	vk::DescriptorPool descriptor_pool;
+	vk::DescriptorSet descriptor_set;
+	std::array<vk::DescriptorType, vulkan_bindless_binding_count> types;
+	std::array<uint32_t, vulkan_bindless_binding_count> capacities;
+	// Nothing ever gets removed yet, so the next free index of each binding only grows.
+	std::array<uint32_t, vulkan_bindless_binding_count> counts;
+
+	bool descriptor_buffer;
+	// Only with a descriptor buffer. The buffer itself gets allocated with everything else, see vulkan_bindless_table_set_buffer,
+	// so until then only buffer_size is known.
+	vk::DeviceSize buffer_size;
+	vk::DeviceSize buffer_align;
+	// Where the table starts, which is the first aligned address in the buffer, not necessarily the start of it.
+	vk::DeviceAddress buffer_address;
+	std::byte *buffer_mapped;
+	std::array<vk::DeviceSize, vulkan_bindless_binding_count> binding_offsets;
+	std::array<size_t, vulkan_bindless_binding_count> descriptor_sizes;
+};
+
+// descriptor_buffer_properties is null unless the table should live in a descriptor buffer.
+// Only one of limits and properties applies, since descriptor buffer layouts aren't update-after-bind.
+static VulkanBindlessTable vulkan_bindless_table_create(
+	vk::Device const device, 
+	vk::PhysicalDeviceLimits const &limits,
+	vk::PhysicalDeviceVulkan12Properties const &properties,
+	vk::PhysicalDeviceDescriptorBufferPropertiesEXT const *const descriptor_buffer_properties,
+	vk::detail::DispatchLoaderDynamic const &dispatch)
+{
+	VulkanBindlessTable res{};
+	res.types = {
+		vk::DescriptorType::eSampledImage,
+		vk::DescriptorType::eSampler,
+		vk::DescriptorType::eStorageImage,
+	};
+	res.descriptor_buffer = descriptor_buffer_properties != nullptr;
+	if (res.descriptor_buffer)
+	{
+		res.capacities = {
+			std::min({
+				static_cast<uint32_t>(BASED_RENDERER_VULKAN_BINDLESS_SAMPLED_IMAGE_COUNT),
+				limits.maxPerStageDescriptorSampledImages,
+				limits.maxDescriptorSetSampledImages,
+			}),
+			std::min({
+				static_cast<uint32_t>(BASED_RENDERER_VULKAN_BINDLESS_SAMPLER_COUNT),
+				limits.maxPerStageDescriptorSamplers,
+				limits.maxDescriptorSetSamplers,
+			}),
+			std::min({
+				static_cast<uint32_t>(BASED_RENDERER_VULKAN_BINDLESS_STORAGE_IMAGE_COUNT),
+				limits.maxPerStageDescriptorStorageImages,
+				limits.maxDescriptorSetStorageImages,
+			}),
+		};
+	}
+	else
+	{
+		res.capacities = {
+			std::min({
+				static_cast<uint32_t>(BASED_RENDERER_VULKAN_BINDLESS_SAMPLED_IMAGE_COUNT),
+				properties.maxPerStageDescriptorUpdateAfterBindSampledImages,
+				properties.maxDescriptorSetUpdateAfterBindSampledImages,
+			}),
+			std::min({
+				static_cast<uint32_t>(BASED_RENDERER_VULKAN_BINDLESS_SAMPLER_COUNT),
+				properties.maxPerStageDescriptorUpdateAfterBindSamplers,
+				properties.maxDescriptorSetUpdateAfterBindSamplers,
+			}),
+			std::min({
+				static_cast<uint32_t>(BASED_RENDERER_VULKAN_BINDLESS_STORAGE_IMAGE_COUNT),
+				properties.maxPerStageDescriptorUpdateAfterBindStorageImages,
+				properties.maxDescriptorSetUpdateAfterBindStorageImages,
+			}),
+		};
+	}
+
+	std::array<vk::DescriptorSetLayoutBinding, vulkan_bindless_binding_count> bindings;
+	std::array<vk::DescriptorBindingFlags, vulkan_bindless_binding_count> binding_flags;
+	std::array<vk::DescriptorPoolSize, vulkan_bindless_binding_count> pool_sizes;
+	for (uint32_t i = 0; i < vulkan_bindless_binding_count; ++i)
+	{
+		bindings[i] = vk::DescriptorSetLayoutBinding{
+			i,
+			res.types[i],
+			res.capacities[i],
+			vulkan_bindless_stages,
+		};
+		binding_flags[i] = 
+			vk::DescriptorBindingFlagBits::eUpdateAfterBind|
+			vk::DescriptorBindingFlagBits::eUpdateUnusedWhilePending|
+			vk::DescriptorBindingFlagBits::ePartiallyBound;
+		pool_sizes[i] = vk::DescriptorPoolSize{res.types[i], res.capacities[i]};
+	}
+
+	if (res.descriptor_buffer)
+	{
+		// Descriptor buffer layouts can't be update-after-bind, and don't need to be, since nothing stops the host from writing
+		// to a buffer that's in use. Unused descriptors are never looked at either, so partially bound comes for free too.
+		res.descriptor_set_layout = device.createDescriptorSetLayout(vk::DescriptorSetLayoutCreateInfo{
+			vk::DescriptorSetLayoutCreateFlagBits::eDescriptorBufferEXT,
+			bindings,
+		});
+		vk::DeviceSize const layout_size = device.getDescriptorSetLayoutSizeEXT(res.descriptor_set_layout, dispatch);
+		// The buffer holds samplers and resources both, so the whole table has to fit in either range.
+		if (layout_size > descriptor_buffer_properties->maxSamplerDescriptorBufferRange || 
+			layout_size > descriptor_buffer_properties->maxResourceDescriptorBufferRange)
+		{
+			throw vk::LogicError{FORMAT_ERROR(std::format("The bindless table needs {} bytes, which is more than a descriptor buffer can address.", layout_size))};
+		}
+		// Nothing promises that a buffer's address is aligned the way a bound descriptor buffer has to be,
+		// so there's enough padding to start the table at the first address that is.
+		res.buffer_align = descriptor_buffer_properties->descriptorBufferOffsetAlignment;
+		res.buffer_size = layout_size + res.buffer_align - 1;
+		for (uint32_t i = 0; i < vulkan_bindless_binding_count; ++i)
+		{
+			res.binding_offsets[i] = device.getDescriptorSetLayoutBindingOffsetEXT(res.descriptor_set_layout, i, dispatch);
+		}
+		res.descriptor_sizes = {
+			descriptor_buffer_properties->sampledImageDescriptorSize,
+			descriptor_buffer_properties->samplerDescriptorSize,
+			descriptor_buffer_properties->storageImageDescriptorSize,
+		};
+		return res;
+	}
+
+	vk::DescriptorSetLayoutBindingFlagsCreateInfo binding_flags_create_info{binding_flags};
+	res.descriptor_set_layout = device.createDescriptorSetLayout(vk::DescriptorSetLayoutCreateInfo{
+		vk::DescriptorSetLayoutCreateFlagBits::eUpdateAfterBindPool,
+		bindings,
+		&binding_flags_create_info,
+	});
+	res.descriptor_pool = device.createDescriptorPool(vk::DescriptorPoolCreateInfo{
+		vk::DescriptorPoolCreateFlagBits::eUpdateAfterBind,
+		1,
+		pool_sizes,
+	});
+	res.descriptor_set = device.allocateDescriptorSets({
+		res.descriptor_pool,
+		1,
+		&res.descriptor_set_layout,
+	})[0];
+	return res;
+}
+
+// Only with a descriptor buffer. The buffer has to be at least table.buffer_size, created with vulkan_bindless_descriptor_buffer_usage,
+// and host visible, which vulkan_get_memory_type_info makes sure of.
+static void vulkan_bindless_table_set_buffer(VulkanBindlessTable &table, vk::Device const device, VulkanBufferAllocation const &buffer)
+{
+	vk::DeviceAddress const address = device.getBufferAddress({buffer.handle});
+	table.buffer_address = (address + table.buffer_align - 1)/table.buffer_align*table.buffer_align;
+	table.buffer_mapped = buffer.heap_allocation.mapped + (table.buffer_address - address);
+}
+
+// Hands out the next free index of binding, without writing anything to it yet.
+static uint32_t vulkan_bindless_table_reserve(VulkanBindlessTable &table, uint32_t const binding)
+{
+	if (table.counts[binding] >= table.capacities[binding])
+	{
+		throw vk::LogicError{FORMAT_ERROR(std::format("The bindless table is out of {} descriptors.", vk::to_string(table.types[binding])))};
+	}
+	return table.counts[binding]++;
+}
+
+// For sampled images, samplers and storage images, which all get described by a vk::DescriptorImageInfo.
+static void vulkan_bindless_table_write_image(
+	vk::Device const device, 
+	VulkanBindlessTable const &table, 
+	uint32_t const binding, 
+	uint32_t const idx, 
+	vk::DescriptorImageInfo const &image_info,
+	vk::detail::DispatchLoaderDynamic const &dispatch)
+{
+	if (table.descriptor_buffer)
+	{
+		// The memory is host coherent, so the next submit sees this without any flushing.
+		vk::DescriptorDataEXT data;
+		if (table.types[binding] == vk::DescriptorType::eSampler)
+		{
+			data.pSampler = &image_info.sampler;
+		}
+		else if (table.types[binding] == vk::DescriptorType::eSampledImage)
+		{
+			data.pSampledImage = &image_info;
+		}
+		else
+		{
+			data.pStorageImage = &image_info;
+		}
+		size_t const descriptor_size = table.descriptor_sizes[binding];
+		device.getDescriptorEXT(
+			vk::DescriptorGetInfoEXT{table.types[binding], data},
+			descriptor_size,
+			table.buffer_mapped + table.binding_offsets[binding] + idx*descriptor_size,
+			dispatch);
+		return;
+	}
+
+	device.updateDescriptorSets(vk::WriteDescriptorSet{
+		table.descriptor_set,
+		binding, 
+		idx,
+		1,
+		table.types[binding],
+		&image_info,
+	}, {});
+}
+
+static uint32_t vulkan_bindless_table_add_image(
+	vk::Device const device, 
+	VulkanBindlessTable &table, 
+	uint32_t const binding, 
+	vk::DescriptorImageInfo const &image_info,
+	vk::detail::DispatchLoaderDynamic const &dispatch)
+{
+	uint32_t idx = vulkan_bindless_table_reserve(table, binding);
+	vulkan_bindless_table_write_image(device, table, binding, idx, image_info, dispatch);
+	return idx;
+}
+
+// Binds the table at set 0, one way or the other. Pipelines that use a descriptor buffer have to be created with eDescriptorBufferEXT.
+static void vulkan_bindless_table_bind(
+	vk::CommandBuffer const cb, 
+	VulkanBindlessTable const &table, 
+	vk::PipelineBindPoint const bind_point, 
+	vk::PipelineLayout const pipeline_layout,
+	vk::detail::DispatchLoaderDynamic const &dispatch)
+{
+	if (table.descriptor_buffer)
+	{
+		cb.bindDescriptorBuffersEXT(vk::DescriptorBufferBindingInfoEXT{table.buffer_address, vulkan_bindless_descriptor_buffer_usage}, dispatch);
+		uint32_t const buffer_idx = 0;
+		vk::DeviceSize const offset = 0;
+		cb.setDescriptorBufferOffsetsEXT(bind_point, pipeline_layout, 0, buffer_idx, offset, dispatch);
+		return;
+	}
+
+	cb.bindDescriptorSets(bind_point, pipeline_layout, 0, {table.descriptor_set}, {});
+}
+
+// Everything a shader needs to find its data, for whatever is being recorded. Buffers are device addresses, which shaders read
+// through pointers, and images are indices into the bindless table. Every pipeline shares the same layout, so this has room for
+// everything that any of the shaders need, and each shader only reads its own part. Has to match PushConstants in scene.slang.
+struct PushConstants
+{
+	// This frame's Uniforms in the uniform ring.
+	vk::DeviceAddress uniforms;
+	vk::DeviceAddress vertices;
+	vk::DeviceAddress instances;
+	vk::DeviceAddress draws;
+	vk::DeviceAddress draw_count;
+	uint32_t instance_count;
+	// Sampled images.
+	uint32_t hiz;
+	uint32_t src;
+	// Storage images.
+	uint32_t dst;
+};
+// The most any device is guaranteed to support.
+static_assert(sizeof(PushConstants) <= 128);
+
+// Draw lists at least twice this long get split across the job pool and recorded into secondary command buffers.
+// Below that, handing the work to other threads costs more than just recording it.
+#define BASED_RENDERER_VULKAN_MIN_DRAWS_PER_RECORDING_JOB 1024
+
+// Laid out just like vk::DrawIndexedIndirectCommand, which is what the culling shader writes on the GPU.
+struct VulkanDraw
+{
+	uint32_t index_count;
+	uint32_t instance_count;
+	uint32_t first_index;
+	int32_t vertex_offset;
+	uint32_t first_instance;
+};
+static_assert(sizeof(VulkanDraw) == sizeof(vk::DrawIndexedIndirectCommand));
+
+// Everything a range of draws needs to be recorded on its own. Secondary command buffers inherit none of this from the primary.
+struct VulkanDrawState
+{
+	vk::Pipeline pipeline;
+	vk::PipelineLayout pipeline_layout;
+	VulkanBindlessTable const *bindless_table;
+	// Only needed for binding a descriptor buffer.
+	vk::detail::DispatchLoaderDynamic const *dispatch;
+	PushConstants push_constants;
+	vk::Extent2D extent;
+	// Always 16 bit indices.
+	vk::Buffer index_buffer;
+	// Null if there is no depth pre-pass.
+	vk::Pipeline depth_prepass_pipeline;
+};
+
+// Everything but the pipeline, which vulkan_record_passes binds.
+static void vulkan_record_draw_state(vk::CommandBuffer const cb, VulkanDrawState const &state)
+{
+	cb.setViewport(0, vk::Viewport{
+		0.0f,
+		0.0f,
+		static_cast<float>(state.extent.width),
+		static_cast<float>(state.extent.height),
+		0.0f,
+		1.0f,
+	});
+	cb.setScissor(0, vk::Rect2D{
+		vk::Offset2D{0, 0},
+		state.extent,
+	});
+	vulkan_bindless_table_bind(cb, *state.bindless_table, vk::PipelineBindPoint::eGraphics, state.pipeline_layout, *state.dispatch);
+	cb.pushConstants<PushConstants>(state.pipeline_layout, vulkan_bindless_stages, 0, state.push_constants);
+	cb.bindIndexBuffer(state.index_buffer, 0, vk::IndexType::eUint16);
+}
+
+// Calls draw once per pass, after binding that pass's pipeline. The depth pre-pass, if there is one, lays down the depth of everything first,
+// so that the main pass only shades the fragments that end up visible.
+template <class F>
+static void vulkan_record_passes(vk::CommandBuffer const cb, VulkanDrawState const &state, F &&draw)
+{
+	vulkan_record_draw_state(cb, state);
+	if (state.depth_prepass_pipeline)
+	{
+		cb.bindPipeline(vk::PipelineBindPoint::eGraphics, state.depth_prepass_pipeline);
+		draw();
+	}
+	cb.bindPipeline(vk::PipelineBindPoint::eGraphics, state.pipeline);
+	draw();
+}
+
+static void vulkan_record_draws(vk::CommandBuffer const cb, VulkanDrawState const &state, std::span<VulkanDraw const> const draws)
+{
+	vulkan_record_passes(cb, state, [&]
+	{
+		for (VulkanDraw const &draw : draws)
+		{
+			cb.drawIndexed(draw.index_count, draw.instance_count, draw.first_index, draw.vertex_offset, draw.first_instance);
+		}
+	});
+}
+
+static size_t vulkan_recording_job_count(size_t const draw_count, size_t const max_job_count) noexcept
+{
+	return std::min(draw_count/BASED_RENDERER_VULKAN_MIN_DRAWS_PER_RECORDING_JOB, max_job_count);
+}
+
+// Splits the draws into one contiguous range per job and records each range into its own secondary command buffer,
+// which the primary then executes inside a render pass begun with eContentsSecondaryCommandBuffers.
+// With a depth pre-pass, each range gets its own pre-pass, so later ranges don't benefit from it as much.
+// The main thread records the first range itself instead of just waiting, so recording job i uses command pool i
+// no matter which thread runs it, and no pool ever gets used by two threads at once.
+// The secondary command buffers get allocated up front, since allocating from a pool also counts as using it.
+// Returns the secondary command buffers that were recorded, in draw order.
+static std::span<vk::CommandBuffer const> vulkan_record_draws_parallel(
+	JobPool &job_pool,
+	vk::Device const device,
+	std::span<vk::CommandPool const> const command_pools,
+	std::vector<vk::CommandBuffer> &secondary_command_buffers,
+	vk::Format const color_format,
+	vk::Format const depth_format,
+	VulkanDrawState const &state,
+	std::span<VulkanDraw const> const draws)
+{
+	size_t const job_count = std::max<size_t>(vulkan_recording_job_count(draws.size(), command_pools.size()), 1);
+	for (size_t i = secondary_command_buffers.size(); i < job_count; ++i)
+	{
+		secondary_command_buffers.push_back(device.allocateCommandBuffers({
+			command_pools[i],
+			vk::CommandBufferLevel::eSecondary,
+			1,
+		})[0]);
+	}
+
+	auto record = [&](size_t const job_idx)
+	{
+		TRACE_SCOPE(record_draws);
+		size_t const begin = draws.size()*job_idx/job_count;
+		size_t const end = draws.size()*(job_idx + 1)/job_count;
+
+		// The flags have to match the ones the render pass gets begun with, minus eContentsSecondaryCommandBuffers.
+		vk::CommandBufferInheritanceRenderingInfo inheritance_rendering_info{
+			vk::RenderingFlags{},
+			0,
+			color_format,
+			depth_format,
+		};
+		vk::CommandBufferInheritanceInfo inheritance_info{
+			vk::RenderPass{},
+			0,
+			vk::Framebuffer{},
+			vk::False,
+			vk::QueryControlFlags{},
+			vk::QueryPipelineStatisticFlags{},
+			&inheritance_rendering_info,
+		};
+		vk::CommandBuffer const cb = secondary_command_buffers[job_idx];
+		cb.begin({
+			vk::CommandBufferUsageFlags{vk::CommandBufferUsageFlagBits::eRenderPassContinue},
+			&inheritance_info,
+		});
+		vulkan_record_draws(cb, state, draws.subspan(begin, end - begin));
+		cb.end();
+	};
+
+	std::vector<std::future<void>> futures;
+	futures.reserve(job_count - 1);
+	for (size_t i = 1; i < job_count; ++i)
+	{
+		futures.push_back(job_pool_submit(job_pool, [&record, i](size_t)
+		{
+			record(i);
+		}));
+	}
+	// Every job has to finish before anything gets thrown, since they all reference this stack frame.
+	std::exception_ptr exception;
+	try
+	{
+		record(0);
+	}
+	catch (...)
+	{
+		exception = std::current_exception();
+	}
+	for (std::future<void> &future : futures)
+	{
+		future.wait();
+	}
+	if (exception)
+	{
+		std::rethrow_exception(exception);
+	}
+	for (std::future<void> &future : futures)
+	{
+		future.get();
+	}
+
+	return std::span<vk::CommandBuffer const>{secondary_command_buffers}.first(job_count);
+}
+
+// A command buffer that gets recorded once and then submitted again and again, until something it depends on changes.
+struct VulkanRecordedCommandBuffer
+{
+	vk::CommandBuffer command_buffer;
+	// What it was recorded with. If either doesn't match anymore, it has to be recorded again.
+	// A generation of 0 means it was never recorded.
+	uint64_t generation;
+	vk::DeviceAddress uniforms_address;
+	// Only used when the draws get recorded in parallel. Secondary command buffer i comes from the frame's recording_command_pools[i].
+	std::vector<vk::CommandBuffer> secondary_command_buffers;
+};
+
+// Everything that belongs to one frame in flight. None of it gets touched again until the frame timeline says the frame is done.
+struct VulkanFrame
+{
+	// For what changes every frame. The whole pool gets reset at the start of the frame.
+	vk::CommandPool command_pool;
+	vk::CommandBuffer command_buffer;
+	// For everything else. One command buffer per render target image, since which image a frame renders to is up to the swapchain.
+	vk::CommandPool recorded_command_pool;
+	std::vector<VulkanRecordedCommandBuffer> recorded_command_buffers;
+	// One per recording job, so that no pool ever gets used by two threads at once. See vulkan_record_draws_parallel.
+	std::vector<vk::CommandPool> recording_command_pools;
+	// Signalled once the acquired swapchain image can be rendered to. Not used in headless mode.
+	vk::Semaphore acquire_semaphore;
+	// Where the depth image is in the bindless table, for building the first level of the Hi-Z pyramid from it. The depth image gets 
+	// reallocated along with the swapchain, and this can only be pointed at the new one once nothing in flight uses it anymore, 
+	// so it keeps track of which generation of the command buffers it was last written for.
+	uint32_t depth_image_bindless_idx;
+	uint64_t depth_image_bindless_generation;
+};
+
+// Used for both creating and recreating the swapchain. The format and present mode never change, since the surface stays the same.
+static vk::SwapchainCreateInfoKHR vulkan_get_swapchain_create_info(
+	vk::PhysicalDevice const physical_device,
+	vk::SurfaceKHR const surface,
+	vk::Format const format,
+	vk::PresentModeKHR const present_mode,
+	vk::Extent2D const client_extent,
+	vk::SwapchainKHR const old_swapchain)
+{
+	vk::SurfaceCapabilitiesKHR capabilities = physical_device.getSurfaceCapabilitiesKHR(surface);
+
+	vk::Extent2D extent{
+		std::clamp(client_extent.width, capabilities.minImageExtent.width, capabilities.maxImageExtent.width),
+		std::clamp(client_extent.height, capabilities.minImageExtent.height, capabilities.maxImageExtent.height),
+	};
+
+	vk::SurfaceTransformFlagBitsKHR pre_transform = 
+		(capabilities.supportedTransforms & vk::SurfaceTransformFlagBitsKHR::eIdentity) ? 
+		vk::SurfaceTransformFlagBitsKHR::eIdentity : 
+		capabilities.currentTransform;
+
+	vk::CompositeAlphaFlagBitsKHR composite_alpha = 
+		(capabilities.supportedCompositeAlpha & vk::CompositeAlphaFlagBitsKHR::ePreMultiplied) ? 
+			vk::CompositeAlphaFlagBitsKHR::ePreMultiplied : 
+			(capabilities.supportedCompositeAlpha & vk::CompositeAlphaFlagBitsKHR::ePostMultiplied) ? 
+				vk::CompositeAlphaFlagBitsKHR::ePostMultiplied : 
+				(capabilities.supportedCompositeAlpha & vk::CompositeAlphaFlagBitsKHR::eInherit) ? 
+					vk::CompositeAlphaFlagBitsKHR::eInherit : 
+					vk::CompositeAlphaFlagBitsKHR::eOpaque;
+
+	return vk::SwapchainCreateInfoKHR{
+		vk::SwapchainCreateFlagsKHR(),
+		surface,
+		// One more than the minimum, so that acquiring doesn't have to wait for the presentation engine to let go of an image.
+		// How far ahead the CPU gets is up to the frames in flight, not the image count. A maxImageCount of 0 means there is no maximum.
+		capabilities.maxImageCount == 0 ? 
+			capabilities.minImageCount + 1 : 
+			std::min(capabilities.minImageCount + 1, capabilities.maxImageCount),
+		format,
+		vk::ColorSpaceKHR::eSrgbNonlinear,
+		extent,
+		1,
+		vk::ImageUsageFlagBits::eColorAttachment,
+		vk::SharingMode::eExclusive,
+		{},
+		pre_transform,
+		composite_alpha,
+		present_mode,
+		true,
+		old_swapchain,
+	};
+}
+
+static std::vector<vk::ImageView> vulkan_create_swapchain_image_views(
+	vk::Device const device, 
+	std::span<vk::Image const> const images, 
+	vk::Format const format)
+{
+	std::vector<vk::ImageView> res;
+	res.reserve(images.size());
+	vk::ImageViewCreateInfo image_view_create_info{
+		{}, 
+		{},
+		vk::ImageViewType::e2D, 
+		format, 
+		{}, 
+		{vk::ImageAspectFlagBits::eColor, 0, 1, 0, 1}
+	};
+	for (vk::Image image : images)
+	{
+		image_view_create_info.image = image;
+		res.push_back(device.createImageView(image_view_create_info));
+	}
+	return res;
+}
+
+// Present semaphores belong to the swapchain image, not the frame. The only way to know that a present is done waiting on its semaphore
+// is to acquire the same image again, so a semaphore per frame could still be in use by the presentation engine when the frame comes back around.
+// Acquire semaphores can be per frame, since waiting for the frame to finish covers the wait on them.
+static std::vector<vk::Semaphore> vulkan_create_present_semaphores(vk::Device const device, size_t const image_count)
+{
+	std::vector<vk::Semaphore> res{image_count};
+	for (vk::Semaphore &semaphore : res)
+	{
+		semaphore = device.createSemaphore({});
+	}
+	return res;
+}
+
+static vk::ImageView vulkan_create_depth_stencil_image_view(vk::Device const device, vk::Image const image, vk::Format const format)
+{
+	return device.createImageView({
+		vk::ImageViewCreateFlags{},
+		image,
+		vk::ImageViewType::e2D,
+		format,
+		vk::ComponentMapping{},
+		vk::ImageSubresourceRange{
+			vk::ImageAspectFlagBits::eDepth,
+			0,
+			1,
+			0,
+			1
+		},
+	});
+}
+
+// A swapchain that got replaced, along with everything that was sized for it.
+// Frames in flight might still be rendering to its images, and the presentation engine might still be waiting on its present semaphores.
+struct VulkanRetiredSwapchain
+{
+	vk::SwapchainKHR swapchain;
+	std::vector<vk::ImageView> image_views;
+	std::vector<vk::Semaphore> present_semaphores;
+	VulkanImageAllocation depth_stencil_image;
+	vk::ImageView depth_stencil_image_view;
+	// Once the frame timeline reaches this, it's safe to destroy.
+	uint64_t destroy_timeline_value;
+};
+
+#define BASED_RENDERER_VULKAN_UNIFORM_RING_REGION_SIZE (256*1024)
+
+// A persistently mapped uniform buffer, split into one region per frame in flight. 
+// A frame only ever writes to its own region, and only after waiting for the last frame that used it to finish, so the CPU never writes
+// anything the GPU is still reading. Within a region, allocating is a pointer bump, and draws find their data through its device address.
+struct VulkanUniformRing
+{
+	vk::DeviceAddress address;
+	std::byte *mapped;
+	vk::DeviceSize region_size;
+	vk::DeviceSize align;
+	size_t region_idx;
+	vk::DeviceSize head;
+};
+
+static void vulkan_uniform_ring_begin_frame(VulkanUniformRing &ring, size_t const frame_idx) noexcept
+{
+	ring.region_idx = frame_idx;
+	ring.head = 0;
+}
+
+// Returns where to write size bytes of uniforms. device_address is where shaders find them.
+static void *vulkan_uniform_ring_allocate(VulkanUniformRing &ring, vk::DeviceSize const size, vk::DeviceAddress &device_address)
+{
+	vk::DeviceSize offset = align_forward(ring.head, ring.align);
+	if (offset + size > ring.region_size)
+	{
+		throw std::length_error{FORMAT_ERROR(std::format("Ran out of uniform ring space ({} bytes per frame).", ring.region_size))};
+	}
+	ring.head = offset + size;
+
+	vk::DeviceSize buffer_offset = ring.region_idx*ring.region_size + offset;
+	device_address = ring.address + buffer_offset;
+	return ring.mapped + buffer_offset;
+}
+
+// Measures how long it takes from the start of a frame until it's actually on screen, using VK_KHR_present_id and VK_KHR_present_wait.
+// Waiting for a present blocks, and the swapchain can't be used from another thread while waiting, so instead, this polls once per frame
+// with a timeout of 0. That means a measurement can be up to one frame late, so treat it as an upper bound.
+struct VulkanPresentLatency
+{
+	struct Pending
+	{
+		uint64_t present_id;
+		std::chrono::steady_clock::time_point frame_start;
+	};
+	// Oldest first, since presents complete in order.
+	std::deque<Pending> pending;
+	std::vector<double> latency_ms;
+};
+
+static void vulkan_present_latency_poll(
+	VulkanPresentLatency &latency, 
+	vk::Device const device, 
+	vk::SwapchainKHR const swapchain, 
+	vk::detail::DispatchLoaderDynamic const &dispatch)
+{
+	while (!latency.pending.empty())
+	{
+		vk::Result result;
+		try
+		{
+			result = device.waitForPresentKHR(swapchain, latency.pending.front().present_id, 0, dispatch);
+		}
+		catch (vk::OutOfDateKHRError const &)
+		{
+			// The swapchain is about to get recreated, and these presents won't ever be seen.
+			latency.pending.clear();
+			break;
+		}
+		if (result == vk::Result::eTimeout)
+		{
+			break;
+		}
+		latency.latency_ms.push_back(std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - latency.pending.front().frame_start).count());
+		latency.pending.pop_front();
+	}
+}
+
+static void vulkan_present_latency_report(VulkanPresentLatency const &latency)
+{
+	if (latency.latency_ms.empty())
+	{
+		return;
+	}
+
+	std::vector<double> sorted_ms = latency.latency_ms;
+	std::sort(sorted_ms.begin(), sorted_ms.end());
+	dprint("Present latency over {} frames: min {:.2f} ms, median {:.2f} ms, p99 {:.2f} ms, max {:.2f} ms.\n",
+		sorted_ms.size(),
+		sorted_ms.front(),
+		sorted_ms[sorted_ms.size()/2],
+		sorted_ms[sorted_ms.size()*99/100],
+		sorted_ms.back());
+}
+
+// How many zones a frame can have. Every zone takes two timestamp queries.
+#define BASED_RENDERER_VULKAN_PROFILER_MAX_ZONES 32
+
+struct VulkanProfilerZone
+{
+	char const *name;
+	// The end query is always the one after this.
+	uint32_t begin_query;
+};
+
+// The zones one frame in flight recorded. Its queries are only read back once the frame timeline says the frame is done,
+// which the main loop waits for anyway, so reading them never stalls.
+struct VulkanProfilerFrame
+{
+	uint64_t frame_number;
+	std::vector<VulkanProfilerZone> zones;
+};
+
+struct VulkanProfilerResult
+{
+	uint64_t frame_number;
+	char const *zone_name;
+	double ms;
+};
+
+// Times zones of a command buffer with timestamp queries. Every frame in flight gets its own range of the query pool.
+// If the queue doesn't support timestamps, or profiling wasn't asked for, every function here does nothing.
+struct VulkanProfiler
+{
+	vk::Device device;
+	vk::QueryPool query_pool;
+	// How many nanoseconds one tick is.
+	double timestamp_period;
+	// Timestamps only have timestampValidBits bits, and wrap around after that.
+	uint64_t timestamp_mask;
+	std::vector<VulkanProfilerFrame> frames;
+	size_t frame_idx;
+	std::vector<VulkanProfilerResult> results;
+};
+
+static VulkanProfiler vulkan_profiler_create(
+	vk::Device const device, 
+	size_t const frame_count, 
+	float const timestamp_period, 
+	uint32_t const timestamp_valid_bits)
+{
+	VulkanProfiler res{};
+	res.device = device;
+	if (timestamp_valid_bits == 0)
+	{
+		dprint("The graphics queue doesn't support timestamps, so there won't be a GPU profile.\n");
+		return res;
+	}
+
+	res.query_pool = device.createQueryPool({
+		vk::QueryPoolCreateFlags{},
+		vk::QueryType::eTimestamp,
+		static_cast<uint32_t>(frame_count*BASED_RENDERER_VULKAN_PROFILER_MAX_ZONES*2),
+	});
+	res.timestamp_period = static_cast<double>(timestamp_period);
+	res.timestamp_mask = timestamp_valid_bits >= 64 ? std::numeric_limits<uint64_t>::max() : (uint64_t{1} << timestamp_valid_bits) - 1;
+	res.frames.resize(frame_count);
+	return res;
+}
+
+// Reads back the zones of the last frame that used frame_idx, which must be done.
+static void vulkan_profiler_collect(VulkanProfiler &profiler, size_t const frame_idx)
+{
+	VulkanProfilerFrame &frame = profiler.frames[frame_idx];
+	uint32_t first_query = static_cast<uint32_t>(frame_idx*BASED_RENDERER_VULKAN_PROFILER_MAX_ZONES*2);
+	if (!frame.zones.empty())
+	{
+		std::array<uint64_t, BASED_RENDERER_VULKAN_PROFILER_MAX_ZONES*2> timestamps;
+		uint32_t query_count = static_cast<uint32_t>(frame.zones.size()*2);
+		// No eWait, so if the results somehow aren't there yet, this frame's zones get dropped instead of stalling.
+		vk::Result result = profiler.device.getQueryPoolResults(
+			profiler.query_pool,
+			first_query,
+			query_count,
+			query_count*sizeof(uint64_t),
+			timestamps.data(),
+			sizeof(uint64_t),
+			vk::QueryResultFlagBits::e64);
+		if (result == vk::Result::eSuccess)
+		{
+			for (VulkanProfilerZone const &zone : frame.zones)
+			{
+				uint64_t begin = timestamps[zone.begin_query - first_query];
+				uint64_t end = timestamps[zone.begin_query - first_query + 1];
+				uint64_t ticks = (end - begin) & profiler.timestamp_mask;
+				profiler.results.push_back({frame.frame_number, zone.name, static_cast<double>(ticks)*profiler.timestamp_period/1'000'000.0});
+			}
+		}
+	}
+}
+
+// Collects the results of the last frame that used frame_idx, and resets its queries. 
+// The last frame that used frame_idx must be done. Its zones are kept, since the command buffer that writes them might get submitted again
+// without being recorded again. See vulkan_profiler_begin_recording.
+static void vulkan_profiler_begin_frame(VulkanProfiler &profiler, vk::CommandBuffer const cb, size_t const frame_idx, uint64_t const frame_number)
+{
+	if (!profiler.query_pool)
+	{
+		return;
+	}
+
+	vulkan_profiler_collect(profiler, frame_idx);
+
+	uint32_t first_query = static_cast<uint32_t>(frame_idx*BASED_RENDERER_VULKAN_PROFILER_MAX_ZONES*2);
+	profiler.frames[frame_idx].frame_number = frame_number;
+	profiler.frame_idx = frame_idx;
+	cb.resetQueryPool(profiler.query_pool, first_query, BASED_RENDERER_VULKAN_PROFILER_MAX_ZONES*2);
+}
+
+// Has to be called before recording zones for frame_idx. Since zones always get recorded in the same order, every command buffer
+// recorded for a frame in flight ends up with the same zones.
+static void vulkan_profiler_begin_recording(VulkanProfiler &profiler, size_t const frame_idx) noexcept
+{
+	if (!profiler.query_pool)
+	{
+		return;
+	}
+
+	profiler.frames[frame_idx].zones.clear();
+}
+
+// Returns what to pass to vulkan_profiler_end_zone.
+static uint32_t vulkan_profiler_begin_zone(VulkanProfiler &profiler, vk::CommandBuffer const cb, char const *const name)
+{
+	if (!profiler.query_pool)
+	{
+		return 0;
+	}
+
+	VulkanProfilerFrame &frame = profiler.frames[profiler.frame_idx];
+	if (frame.zones.size() == BASED_RENDERER_VULKAN_PROFILER_MAX_ZONES)
+	{
+		throw std::length_error{FORMAT_ERROR(std::format("Ran out of profiler zones ({} per frame).", BASED_RENDERER_VULKAN_PROFILER_MAX_ZONES))};
+	}
+	uint32_t begin_query = static_cast<uint32_t>((profiler.frame_idx*BASED_RENDERER_VULKAN_PROFILER_MAX_ZONES + frame.zones.size())*2);
+	frame.zones.push_back({name, begin_query});
+	cb.writeTimestamp2(vk::PipelineStageFlagBits2::eAllCommands, profiler.query_pool, begin_query);
+	return begin_query;
+}
+
+static void vulkan_profiler_end_zone(VulkanProfiler &profiler, vk::CommandBuffer const cb, uint32_t const begin_query)
+{
+	if (!profiler.query_pool)
+	{
+		return;
+	}
+
+	cb.writeTimestamp2(vk::PipelineStageFlagBits2::eAllCommands, profiler.query_pool, begin_query + 1);
+}
+
+// Collects the frames that were still in flight. Everything must be done.
+static void vulkan_profiler_end(VulkanProfiler &profiler)
+{
+	if (!profiler.query_pool)
+	{
+		return;
+	}
+
+	// Oldest first, so that the results stay sorted by frame.
+	for (size_t i = 1; i <= profiler.frames.size(); ++i)
+	{
+		vulkan_profiler_collect(profiler, (profiler.frame_idx + i) % profiler.frames.size());
+	}
+}
+
+#define VULKAN_PROFILER_ZONE_BEGIN(PROFILER, CB, NAME) uint32_t const vulkan_profiler_zone_##NAME = vulkan_profiler_begin_zone(PROFILER, CB, STRINGIFY(NAME))
+#define VULKAN_PROFILER_ZONE_END(PROFILER, CB, NAME) vulkan_profiler_end_zone(PROFILER, CB, vulkan_profiler_zone_##NAME)
+
+// Writes JSON if path ends in .json, and CSV otherwise.
+static void vulkan_profiler_write_results(VulkanProfiler const &profiler, std::string const &path)
+{
+	std::string out;
+	if (std::filesystem::path{path}.extension() == ".json")
+	{
+		out = "{\n";
+		out += std::format("\t\"timestamp_period_ns\": {},\n", profiler.timestamp_period);
+		out += "\t\"frames\": [\n";
+		for (size_t i = 0; i < profiler.results.size();)
+		{
+			uint64_t frame_number = profiler.results[i].frame_number;
+			out += std::format("\t\t{{\"frame\": {}, \"zones_ms\": {{", frame_number);
+			for (bool first = true; i < profiler.results.size() && profiler.results[i].frame_number == frame_number; ++i, first = false)
+			{
+				out += std::format("{}\"{}\": {:.4f}", first ? "" : ", ", profiler.results[i].zone_name, profiler.results[i].ms);
+			}
+			out += std::format("}}}}{}\n", i < profiler.results.size() ? "," : "");
+		}
+		out += "\t]\n";
+		out += "}\n";
+	}
+	else
+	{
+		out = "frame,zone,ms\n";
+		for (VulkanProfilerResult const &result : profiler.results)
+		{
+			out += std::format("{},{},{:.4f}\n", result.frame_number, result.zone_name, result.ms);
+		}
+	}
+
+	std::ofstream file{path};
+	if (!file)
+	{
+		throw std::runtime_error{FORMAT_ERROR(std::format("Failed to open {}.", path))};
+	}
+	file << out;
+}
+
+// Relative to the working directory, just like the shader cache.
+#define BASED_RENDERER_VULKAN_PIPELINE_CACHE_PATH "pipeline_cache.bin"
+// How often (in frames) the pipeline cache gets written to disk, if anything new went into it.
+// It also gets written at shutdown, this is just so that a crash doesn't throw everything away.
+#define BASED_RENDERER_VULKAN_PIPELINE_CACHE_SAVE_INTERVAL 1000
+
+// Drivers are supposed to ignore pipeline cache data from a different device or driver version, but not all of them do, 
+// so the header gets checked here before the driver ever sees it.
+static bool vulkan_pipeline_cache_data_is_compatible(std::span<char const> const data, vk::PhysicalDeviceProperties const &properties) noexcept
+{
+	vk::PipelineCacheHeaderVersionOne header;
+	if (data.size() < sizeof(header))
+	{
+		return false;
+	}
+	std::memcpy(&header, data.data(), sizeof(header));
+
+	return header.headerSize >= sizeof(header) &&
+		header.headerSize <= data.size() &&
+		header.headerVersion == vk::PipelineCacheHeaderVersion::eOne &&
+		header.vendorID == properties.vendorID &&
+		header.deviceID == properties.deviceID &&
+		std::memcmp(header.pipelineCacheUUID.data(), properties.pipelineCacheUUID.data(), VK_UUID_SIZE) == 0;
+}
+
+// Creates an empty pipeline cache and merges whatever was saved by the last run into it.
+static vk::PipelineCache vulkan_pipeline_cache_create(
+	vk::Device const device, 
+	vk::PipelineCacheCreateFlags const flags, 
+	vk::PhysicalDeviceProperties const &properties)
+{
+	vk::PipelineCache res = device.createPipelineCache({flags});
+
+	std::optional<std::vector<char>> data = read_entire_binary_file(BASED_RENDERER_VULKAN_PIPELINE_CACHE_PATH);
+	if (!data)
+	{
+		dprint("No pipeline cache found at {}.\n", BASED_RENDERER_VULKAN_PIPELINE_CACHE_PATH);
+	}
+	else if (!vulkan_pipeline_cache_data_is_compatible(*data, properties))
+	{
+		dprint("Ignoring {}, it was written by a different device or driver.\n", BASED_RENDERER_VULKAN_PIPELINE_CACHE_PATH);
+	}
+	else
+	{
+		vk::PipelineCache loaded = device.createPipelineCache({flags, data->size(), data->data()});
+		device.mergePipelineCaches(res, {loaded});
+		device.destroyPipelineCache(loaded);
+		dprint("Loaded {} bytes of pipeline cache from {}.\n", data->size(), BASED_RENDERER_VULKAN_PIPELINE_CACHE_PATH);
+	}
+
+	return res;
+}
+
+static void vulkan_pipeline_cache_save(vk::Device const device, vk::PipelineCache const pipeline_cache)
+{
+	std::vector<uint8_t> data = device.getPipelineCacheData(pipeline_cache);
+	std::error_code error_code = write_entire_binary_file_atomically(BASED_RENDERER_VULKAN_PIPELINE_CACHE_PATH, data.data(), data.size());
+	if (error_code)
+	{
+		dprint("Failed to write {}: {}\n", BASED_RENDERER_VULKAN_PIPELINE_CACHE_PATH, error_code.message());
+	}
+}
+
+struct VulkanPipelineBuildResult
+{
+	// In the same order as the create infos.
+	std::vector<vk::Pipeline> pipelines;
+	// Only counts pipelines the driver gave creation feedback for.
+	size_t cache_hit_count;
+	size_t cache_miss_count;
+	// Summed over all pipelines, so with more than one thread this is more than the time it actually took.
+	double driver_ms;
+};
+
+// Creates one pipeline per job on the job pool. Every thread gets its own pipeline cache, seeded with the contents of pipeline_cache,
+// so no cache ever gets used by two threads at once and they can all stay externally synchronized. 
+// Once everything is done, the per-thread caches get merged back into pipeline_cache.
+// CreateInfo is either vk::GraphicsPipelineCreateInfo or vk::ComputePipelineCreateInfo.
+template <class CreateInfo>
+static VulkanPipelineBuildResult vulkan_create_pipelines(
+	JobPool &job_pool,
+	vk::Device const device,
+	vk::PipelineCache const pipeline_cache,
+	vk::PipelineCacheCreateFlags const pipeline_cache_flags,
+	std::span<CreateInfo const> const create_infos)
+{
+	std::vector<uint8_t> const pipeline_cache_data = device.getPipelineCacheData(pipeline_cache);
+	std::vector<vk::PipelineCache> thread_pipeline_caches(job_pool.threads.size());
+	for (vk::PipelineCache &thread_pipeline_cache : thread_pipeline_caches)
+	{
+		thread_pipeline_cache = device.createPipelineCache({pipeline_cache_flags, pipeline_cache_data.size(), pipeline_cache_data.data()});
+	}
+
+	// Creation feedback is how we find out whether the pipeline cache actually had the pipeline.
+	std::vector<vk::PipelineCreationFeedback> feedbacks(create_infos.size());
+	std::vector<vk::PipelineCreationFeedbackCreateInfo> feedback_create_infos(create_infos.size());
+
+	std::vector<std::future<vk::Pipeline>> futures;
+	for (size_t i = 0; i < create_infos.size(); ++i)
+	{
+		feedback_create_infos[i] = vk::PipelineCreationFeedbackCreateInfo{
+			&feedbacks[i],
+			0,
+			nullptr,
+			create_infos[i].pNext,
+		};
+
+		futures.push_back(job_pool_submit(job_pool, [&, i](size_t const thread_idx)
+		{
+			TRACE_SCOPE(create_pipeline);
+			CreateInfo create_info = create_infos[i];
+			create_info.pNext = &feedback_create_infos[i];
+			if constexpr (std::is_same_v<CreateInfo, vk::ComputePipelineCreateInfo>)
+			{
+				return device.createComputePipeline(thread_pipeline_caches[thread_idx], create_info).value;
+			}
+			else
+			{
+				return device.createGraphicsPipeline(thread_pipeline_caches[thread_idx], create_info).value;
+			}
+		}));
+	}
+
+	// Everything has to finish before anything gets thrown, since the jobs use the caches and the feedback.
+	for (std::future<vk::Pipeline> &future : futures)
+	{
+		future.wait();
+	}
+
+	VulkanPipelineBuildResult res{};
+	for (std::future<vk::Pipeline> &future : futures)
+	{
+		res.pipelines.push_back(future.get());
+	}
+
+	device.mergePipelineCaches(pipeline_cache, thread_pipeline_caches);
+	for (vk::PipelineCache thread_pipeline_cache : thread_pipeline_caches)
+	{
+		device.destroyPipelineCache(thread_pipeline_cache);
+	}
+
+	for (vk::PipelineCreationFeedback const &feedback : feedbacks)
+	{
+		if (feedback.flags & vk::PipelineCreationFeedbackFlagBits::eValid)
+		{
+			if (feedback.flags & vk::PipelineCreationFeedbackFlagBits::eApplicationPipelineCacheHit)
+			{
+				res.cache_hit_count += 1;
+			}
+			else
+			{
+				res.cache_miss_count += 1;
+			}
+			res.driver_ms += static_cast<double>(feedback.duration)/1e6;
+		}
+	}
+
+	return res;
+}
+
+#define SLANG_CHECK(RESULT) STMT( \
+	switch (RESULT) \
+	{ \
+		case SLANG_OK: \
+			break; \
+		case SLANG_FAIL: \
+			throw std::runtime_error{FORMAT_ERROR("Slang: failed for unknown reason.")}; \
+		case SLANG_E_NOT_IMPLEMENTED: \
+			throw std::logic_error{FORMAT_ERROR("Slang: function not implemented.")}; \
+		case SLANG_E_NO_INTERFACE: \
+			throw std::logic_error{FORMAT_ERROR("Slang: no interface.")}; \
+		case SLANG_E_ABORT: \
+			throw std::runtime_error{FORMAT_ERROR("Slang: error was aborted.")}; \
+		case SLANG_E_INVALID_HANDLE: \
+			throw std::logic_error{FORMAT_ERROR("Slang: invalid handle")}; \
+		case SLANG_E_INVALID_ARG: \
+			throw std::invalid_argument{FORMAT_ERROR("Slang: invalid argument.")}; \
+		case SLANG_E_OUT_OF_MEMORY: \
+			throw std::runtime_error{FORMAT_ERROR("Slang: ran out of memory.")}; \
+	} \
+)
+
+struct BasedRendererOptions
+{
+	// Renders into offscreen images instead of a window, so it runs without a window system or a compositor.
+	bool headless;
+	// Only used in headless mode. Headless mode has no window to close, so it stops after this many frames.
+	uint64_t frame_count;
+	// Only used in headless mode.
+	uint32_t width;
+	uint32_t height;
+	// Only used in headless mode. If set, the last frame that was read back gets written here as a binary PPM.
+	std::optional<std::string> dump_path;
+	// See BASED_RENDERER_DEFAULT_FRAMES_IN_FLIGHT.
+	uint32_t frames_in_flight;
+	// How many cubes there are.
+	uint32_t instance_count;
+	// How many draws the cubes get split into. See BASED_RENDERER_VULKAN_MIN_DRAWS_PER_RECORDING_JOB.
+	// Not used with GPU culling, which draws every cube that survives culling with a single drawIndexedIndirectCount.
+	uint32_t draw_count;
+	// Falls back to CPU draws if the device doesn't support it.
+	bool gpu_culling;
+	// Only used with GPU culling. Also tests every cube against a Hi-Z pyramid built from the last frame's depth.
+	bool occlusion_culling;
+	// Draws everything into the depth buffer first, so the main pass only shades what's visible.
+	bool depth_prepass;
+	// Puts the bindless table in a VK_EXT_descriptor_buffer instead of a descriptor pool. Falls back to the pool if the device doesn't support it.
+	bool descriptor_buffer;
+	// Only used when there is a swapchain. Falls back to FIFO, which is always supported, if the surface doesn't support it.
+	vk::PresentModeKHR present_mode;
+	// If set, per-frame GPU timings get written here at exit. See vulkan_profiler_write_results for the format.
+	std::optional<std::string> gpu_profile_path;
+#if BASED_RENDERER_TRACE
+	// Where the CPU trace gets written at exit.
+	std::string trace_path;
+#endif
+#if BASED_RENDERER_BENCH
+	// Frames at the start that don't count towards the frame time statistics, since they include things like pipeline warmup.
+	uint64_t bench_warmup_frame_count;
+	// If not set, the results get written to stdout.
+	std::optional<std::string> bench_output_path;
+#endif
+};
+
+static uint32_t parse_uint32(std::string_view const arg)
+{
+	uint32_t res = 0;
+	auto [ptr, ec] = std::from_chars(arg.data(), arg.data() + arg.size(), res);
+	if (ec != std::errc{} || ptr != arg.data() + arg.size())
+	{
+		throw std::invalid_argument{FORMAT_ERROR(std::format("\"{}\" is not a valid unsigned integer.", arg))};
+	}
+	return res;
+}
+
+static vk::PresentModeKHR parse_present_mode(std::string_view const arg)
+{
+	if (arg == "fifo") return vk::PresentModeKHR::eFifo;
+	if (arg == "fifo-relaxed") return vk::PresentModeKHR::eFifoRelaxed;
+	if (arg == "mailbox") return vk::PresentModeKHR::eMailbox;
+	if (arg == "immediate") return vk::PresentModeKHR::eImmediate;
+	throw std::invalid_argument{FORMAT_ERROR(std::format("\"{}\" is not a present mode. Use fifo, fifo-relaxed, mailbox or immediate.", arg))};
+}
+
+static BasedRendererOptions parse_options(int const argc, char const *const *const argv)
+{
+	BasedRendererOptions res{
+		// There is no window system to use on other systems yet, so they always run headless.
+		// Benchmarks default to headless too, so that the compositor doesn't end up in the numbers.
+		.headless = !BASED_RENDERER_WIN32 || BASED_RENDERER_BENCH,
+		.frame_count = BASED_RENDERER_BENCH ? 5000 : 1000,
+		.width = 1280,
+		.height = 720,
+		.frames_in_flight = BASED_RENDERER_DEFAULT_FRAMES_IN_FLIGHT,
+		.instance_count = 1,
+		.draw_count = 1,
+		.gpu_culling = true,
+		.occlusion_culling = true,
+		.depth_prepass = false,
+		.descriptor_buffer = false,
+		.present_mode = vk::PresentModeKHR::eFifo,
+#if BASED_RENDERER_TRACE
+		.trace_path = "trace.json",
+#endif
+#if BASED_RENDERER_BENCH
+		.bench_warmup_frame_count = 100,
+#endif
+	};
+
+	for (int i = 1; i < argc; ++i)
+	{
+		std::string_view arg{argv[i]};
+		bool has_value = i + 1 < argc;
+		if (arg == "--headless")
+		{
+			res.headless = true;
+		}
+		else if (arg == "--frames" && has_value)
+		{
+			res.frame_count = parse_uint32(argv[++i]);
+		}
+		else if (arg == "--width" && has_value)
+		{
+			res.width = parse_uint32(argv[++i]);
+		}
+		else if (arg == "--height" && has_value)
+		{
+			res.height = parse_uint32(argv[++i]);
+		}
+		else if (arg == "--dump" && has_value)
+		{
+			res.dump_path = argv[++i];
+		}
+		else if (arg == "--frames-in-flight" && has_value)
+		{
+			res.frames_in_flight = parse_uint32(argv[++i]);
+		}
+		else if (arg == "--instances" && has_value)
+		{
+			res.instance_count = parse_uint32(argv[++i]);
+		}
+		else if (arg == "--draws" && has_value)
+		{
+			res.draw_count = parse_uint32(argv[++i]);
+		}
+		else if (arg == "--no-gpu-culling")
+		{
+			res.gpu_culling = false;
+		}
+		else if (arg == "--no-occlusion-culling")
+		{
+			res.occlusion_culling = false;
+		}
+		else if (arg == "--depth-prepass")
+		{
+			res.depth_prepass = true;
+		}
+		else if (arg == "--descriptor-buffer")
+		{
+			res.descriptor_buffer = true;
+		}
+		else if (arg == "--present-mode" && has_value)
+		{
+			res.present_mode = parse_present_mode(argv[++i]);
+		}
+		else if (arg == "--gpu-profile" && has_value)
+		{
+			res.gpu_profile_path = argv[++i];
+		}
+#if BASED_RENDERER_TRACE
+		else if (arg == "--trace" && has_value)
+		{
+			res.trace_path = argv[++i];
+		}
+#endif
+#if BASED_RENDERER_BENCH
+		else if (arg == "--windowed")
+		{
+			res.headless = false;
+		}
+		else if (arg == "--warmup" && has_value)
+		{
+			res.bench_warmup_frame_count = parse_uint32(argv[++i]);
+		}
+		else if (arg == "--bench-output" && has_value)
+		{
+			res.bench_output_path = argv[++i];
+		}
+#endif
+		else
+		{
+			throw std::invalid_argument{FORMAT_ERROR(std::format("Unknown argument \"{}\".", arg))};
+		}
+	}
+
+	if (res.width == 0 || res.height == 0)
+	{
+		throw std::invalid_argument{FORMAT_ERROR("The width and height must not be 0.")};
+	}
+	if (res.frames_in_flight < 1 || res.frames_in_flight > BASED_RENDERER_MAX_FRAMES_IN_FLIGHT)
+	{
+		throw std::invalid_argument{FORMAT_ERROR(std::format("The frames in flight must be between 1 and {}.", BASED_RENDERER_MAX_FRAMES_IN_FLIGHT))};
+	}
+	if (res.draw_count == 0 || res.draw_count > res.instance_count)
+	{
+		throw std::invalid_argument{FORMAT_ERROR("The draw count must be between 1 and the instance count.")};
+	}
+#if BASED_RENDERER_BENCH
+	if (res.bench_warmup_frame_count >= res.frame_count)
+	{
+		throw std::invalid_argument{FORMAT_ERROR("There must be more frames than warmup frames.")};
+	}
+#endif
 
-		if (!(image_allocation.memory_type_info.properties&(vk::MemoryPropertyFlagBits::eDeviceLocal|vk::MemoryPropertyFlagBits::eHostVisible)) && !(image_create_infos[i].usage&vk::ImageUsageFlagBits::eDepthStencilAttachment))
-		{
-			VulkanStagingBufferAllocation staging_buffer_allocation{};
-			staging_buffer_allocation.handle = device.createBuffer({
-				vk::BufferCreateFlags{},
-				image_allocation.size,
-				vk::BufferUsageFlagBits::eTransferSrc,
-			});
+	return res;
+}
 
-			vk::BufferMemoryRequirementsInfo2 staging_buffer_memory_requirements_info;
-			staging_buffer_memory_requirements_info.buffer = staging_buffer_allocation.handle;
-			
-			vk::MemoryRequirements2 staging_buffer_memory_requirements;
-			device.getBufferMemoryRequirements2(&staging_buffer_memory_requirements_info, &staging_buffer_memory_requirements);
+#if BASED_RENDERER_BENCH
+using BenchClock = std::chrono::steady_clock;
 
-			staging_buffer_allocation.size = staging_buffer_memory_requirements.memoryRequirements.size;
-			staging_buffer_allocation.align = staging_buffer_memory_requirements.memoryRequirements.alignment;
+struct BenchStartupPhase
+{
+	char const *name;
+	double ms;
+};
+
+struct BenchResults
+{
+	std::string device_name;
+	std::vector<BenchStartupPhase> startup_phases;
+	// Pipelines the driver didn't give any creation feedback for don't count towards either.
+	size_t pipeline_cache_hit_count;
+	size_t pipeline_cache_miss_count;
+	// Whether GPU culling actually got used, which depends on the device as well as the options.
+	bool gpu_culling;
+	// Same for where the bindless table lives.
+	bool descriptor_buffer;
+	std::vector<double> frame_ms;
+};
+
+// TODO: Remove global variable.
+static BenchResults bench_results;
 
-			staging_buffer_allocation.memory_type_info = vulkan_get_memory_type_info(
-				physical_device_memory_properties,
-				staging_buffer_memory_requirements.memoryRequirements.memoryTypeBits,
-				vk::BufferUsageFlagBits::eTransferSrc);
+static double bench_ms_since(BenchClock::time_point const start) noexcept
+{
+	return std::chrono::duration<double, std::milli>(BenchClock::now() - start).count();
+}
 
-			image_allocation.staging_buffer = staging_buffer_allocation;
+// For strings we don't control, like the device name, which could have anything in it.
+static std::string bench_json_escape(std::string_view const str)
+{
+	std::string res;
+	res.reserve(str.size());
+	for (char c : str)
+	{
+		if (c == '"' || c == '\\')
+		{
+			res += '\\';
+			res += c;
+		}
+		else if (static_cast<unsigned char>(c) < 0x20)
+		{
+			res += std::format("\\u{:04x}", static_cast<unsigned char>(c));
+		}
+		else
+		{
+			res += c;
 		}
+	}
+	return res;
+}
+
+// Nearest rank, so the result is always a frame time that actually happened.
+// Assumes that sorted_ms is sorted and not empty.
+static double bench_percentile(std::vector<double> const &sorted_ms, double const percentile) noexcept
+{
+	size_t rank = static_cast<size_t>(std::ceil(percentile*static_cast<double>(sorted_ms.size())));
+	return sorted_ms[std::clamp<size_t>(rank, 1, sorted_ms.size()) - 1];
+}
 
-		if (memory_dedicated_requirements.prefersDedicatedAllocation || memory_dedicated_requirements.requiresDedicatedAllocation) 
+static void bench_write_results(BasedRendererOptions const &options)
+{
+	std::vector<double> sorted_ms = bench_results.frame_ms;
+	std::sort(sorted_ms.begin(), sorted_ms.end());
+
+	double total_ms = 0.0;
+	for (double ms : sorted_ms)
+	{
+		total_ms += ms;
+	}
+
+	std::string json = "{\n";
+	json += std::format("\t\"device\": \"{}\",\n", bench_json_escape(bench_results.device_name));
+	json += std::format("\t\"headless\": {},\n", options.headless);
+	json += std::format("\t\"width\": {},\n", options.width);
+	json += std::format("\t\"height\": {},\n", options.height);
+	json += std::format("\t\"frames_in_flight\": {},\n", options.frames_in_flight);
+	json += std::format("\t\"instance_count\": {},\n", options.instance_count);
+	json += std::format("\t\"draw_count\": {},\n", options.draw_count);
+	json += std::format("\t\"gpu_culling\": {},\n", bench_results.gpu_culling);
+	json += std::format("\t\"occlusion_culling\": {},\n", bench_results.gpu_culling && options.occlusion_culling);
+	json += std::format("\t\"depth_prepass\": {},\n", options.depth_prepass);
+	json += std::format("\t\"descriptor_buffer\": {},\n", bench_results.descriptor_buffer);
+	json += std::format("\t\"present_mode\": \"{}\",\n", vk::to_string(options.present_mode));
+	json += std::format("\t\"pipeline_cache_hits\": {},\n", bench_results.pipeline_cache_hit_count);
+	json += std::format("\t\"pipeline_cache_misses\": {},\n", bench_results.pipeline_cache_miss_count);
+	json += "\t\"startup_ms\": {\n";
+	for (size_t i = 0; i < bench_results.startup_phases.size(); ++i)
+	{
+		BenchStartupPhase const &phase = bench_results.startup_phases[i];
+		json += std::format("\t\t\"{}\": {:.4f}{}\n", phase.name, phase.ms, i + 1 < bench_results.startup_phases.size() ? "," : "");
+	}
+	json += "\t},\n";
+	json += "\t\"frame_ms\": {\n";
+	json += std::format("\t\t\"count\": {},\n", sorted_ms.size());
+	json += std::format("\t\t\"warmup\": {},\n", options.bench_warmup_frame_count);
+	if (!sorted_ms.empty())
+	{
+		json += std::format("\t\t\"min\": {:.4f},\n", sorted_ms.front());
+		json += std::format("\t\t\"median\": {:.4f},\n", bench_percentile(sorted_ms, 0.5));
+		json += std::format("\t\t\"p99\": {:.4f},\n", bench_percentile(sorted_ms, 0.99));
+		json += std::format("\t\t\"max\": {:.4f},\n", sorted_ms.back());
+		json += std::format("\t\t\"mean\": {:.4f}\n", total_ms/static_cast<double>(sorted_ms.size()));
+	}
+	json += "\t}\n";
+	json += "}\n";
+
+	if (options.bench_output_path)
+	{
+		std::ofstream file{*options.bench_output_path};
+		if (!file)
 		{
-			image_allocation.dedicated_allocation = true;
-			image_allocation.offset = 0;
+			throw std::runtime_error{FORMAT_ERROR(std::format("Failed to open {}.", *options.bench_output_path))};
+		}
+		file << json;
+	}
+	else
+	{
+		std::fputs(json.c_str(), stdout);
+	}
+}
 
-			vk::MemoryDedicatedAllocateInfo memory_dedicated_allocate_info;
-			memory_dedicated_allocate_info.image = image_allocation.handle;
-			
-			vk::MemoryAllocateInfo memory_allocate_info;
-			memory_allocate_info.pNext = &memory_dedicated_allocate_info;
-			memory_allocate_info.allocationSize = image_allocation.size;
-			memory_allocate_info.memoryTypeIndex = image_allocation.memory_type_info.idx;
+#define BENCH_BEGIN(NAME) BenchClock::time_point const bench_begin_##NAME = BenchClock::now()
+#define BENCH_END(NAME) bench_results.startup_phases.push_back(BenchStartupPhase{STRINGIFY(NAME), bench_ms_since(bench_begin_##NAME)})
+#else
+#define BENCH_BEGIN(NAME)
+#define BENCH_END(NAME)
+#endif
+
+// Everything that goes into a Slang session. These also get hashed into the shader cache key, so changing any of them invalidates the cache.
+#define BASED_RENDERER_SLANG_SEARCH_PATH "src"
+#define BASED_RENDERER_SLANG_PROFILE "glsl_450"
+#define BASED_RENDERER_SLANG_TARGET_FORMAT SLANG_SPIRV
+#define BASED_RENDERER_SLANG_MATRIX_LAYOUT SLANG_MATRIX_LAYOUT_COLUMN_MAJOR
+
+// Relative to the working directory, just like the Slang search path.
+#define BASED_RENDERER_SHADER_CACHE_PATH "shader_cache"
+
+static uint64_t constexpr fnv1a_offset_basis = 14695981039346656037ull;
+
+static uint64_t fnv1a(uint64_t hash, void const *const data, size_t const size) noexcept
+{
+	for (size_t i = 0; i < size; ++i)
+	{
+		hash ^= static_cast<uint64_t>(static_cast<unsigned char const *>(data)[i]);
+		hash *= 1099511628211ull;
+	}
+	return hash;
+}
+
+static uint64_t fnv1a(uint64_t const hash, std::string_view const s) noexcept
+{
+	// The null terminator gets hashed too, so that "ab" + "c" and "a" + "bc" hash differently.
+	return fnv1a(fnv1a(hash, s.data(), s.size()), "", 1);
+}
+
+// Hashes the compiler version, the session options, and every .slang file in the search path.
+// Hashing every file instead of following imports means that editing an unrelated shader invalidates the cache too, 
+// but there are only a handful of shaders and it can never miss a dependency.
+static uint64_t slang_shader_cache_hash()
+{
+	uint64_t res = fnv1a_offset_basis;
+	res = fnv1a(res, spGetBuildTagString());
+	res = fnv1a(res, BASED_RENDERER_SLANG_SEARCH_PATH);
+	res = fnv1a(res, BASED_RENDERER_SLANG_PROFILE);
+	int const options[] = {
+		BASED_RENDERER_SLANG_TARGET_FORMAT,
+		BASED_RENDERER_SLANG_MATRIX_LAYOUT,
+		BASED_RENDERER_SLANG_SPIRV_VALIDATION,
+	};
+	res = fnv1a(res, options, sizeof(options));
 
-			image_allocation.memory = device.allocateMemory(memory_allocate_info);
+	// directory_iterator doesn't guarantee any order, so the paths get sorted to keep the hash stable.
+	std::vector<std::filesystem::path> paths;
+	for (std::filesystem::directory_entry const &entry : std::filesystem::directory_iterator{BASED_RENDERER_SLANG_SEARCH_PATH})
+	{
+		if (entry.is_regular_file() && entry.path().extension() == ".slang")
+		{
+			paths.push_back(entry.path());
+		}
+	}
+	std::sort(paths.begin(), paths.end());
 
-			vk::BindImageMemoryInfo bind_image_memory_info;
-			bind_image_memory_info.image = image_allocation.handle;
-			bind_image_memory_info.memory = image_allocation.memory;
-			bind_image_memory_infos.push_back(bind_image_memory_info);
+	for (std::filesystem::path const &path : paths)
+	{
+		std::optional<std::vector<char>> source = read_entire_binary_file(path);
+		if (!source)
+		{
+			throw std::runtime_error{FORMAT_ERROR(std::format("Failed to read {}.", path.string()))};
 		}
+		res = fnv1a(res, path.filename().string());
+		res = fnv1a(res, source->data(), source->size());
 	}
 
-	for (
-		uint32_t memory_type_idx = 0; 
-		memory_type_idx < physical_device_memory_properties.memoryTypeCount; 
-		++memory_type_idx)
+	return res;
+}
+
+// Slang only gets initialized on a shader cache miss, since creating the global session alone takes longer than everything else at startup.
+// Slang global sessions are not thread safe, so every worker thread gets its own SlangCompiler, and with it its own global session.
+struct SlangCompiler
+{
+	Slang::ComPtr<slang::IGlobalSession> global_session;
+	Slang::ComPtr<slang::ISession> session;
+	std::vector<std::pair<std::string, Slang::ComPtr<slang::IModule>>> modules;
+};
+
+static void slang_compiler_init(SlangCompiler &compiler)
+{
+	using namespace Slang;
+	using namespace slang;
+
+	// The global session survives slang_compiler_reset_session.
+	if (!compiler.global_session)
 	{
-		size_t bind_buffer_memory_infos_size = bind_buffer_memory_infos.size();
-		size_t bind_image_memory_infos_size = bind_image_memory_infos.size();
+		SlangGlobalSessionDesc global_session_desc{};
+		SLANG_CHECK(createGlobalSession(&global_session_desc, compiler.global_session.writeRef()));
+	}
+
+	TargetDesc target_desc{
+		.format = BASED_RENDERER_SLANG_TARGET_FORMAT,
+		.profile = compiler.global_session->findProfile(BASED_RENDERER_SLANG_PROFILE),
+		.compilerOptionEntries = nullptr,
+		.compilerOptionEntryCount = 0,
+	};
 
-		vk::DeviceSize memory_offset = 0;
+	std::array<char const*, 1> const search_paths{
+		BASED_RENDERER_SLANG_SEARCH_PATH,
+	};
+
+	SessionDesc session_desc{
+		.targets = &target_desc,
+		.targetCount = 1,
+		.defaultMatrixLayoutMode = BASED_RENDERER_SLANG_MATRIX_LAYOUT,
+		.searchPaths = search_paths.data(),
+		.searchPathCount = search_paths.size(),
+		.preprocessorMacros = nullptr,
+		.preprocessorMacroCount = 0,
+		.enableEffectAnnotations = false,
+		.compilerOptionEntries = nullptr,
+		.compilerOptionEntryCount = 0,
+#if BASED_RENDERER_SLANG_SPIRV_VALIDATION
+		.skipSPIRVValidation = true,
+#endif
+	};
+	SLANG_CHECK(compiler.global_session->createSession(session_desc, compiler.session.writeRef()));
+}
 
-		for (size_t i = 0; i < buffer_count; ++i) 
+static slang::IModule *slang_compiler_load_module(SlangCompiler &compiler, char const *const module_name)
+{
+	for (auto const &[name, module] : compiler.modules)
+	{
+		if (name == module_name)
 		{
-			VulkanBufferAllocation const &buffer_allocation = buffer_allocations[i];
+			return module;
+		}
+	}
 
-			if (buffer_allocation.memory_type_info.idx == memory_type_idx && !buffer_allocation.memory) 
-			{
-				memory_offset = align_forward(memory_offset, buffer_allocation.align);
+	Slang::ComPtr<slang::IModule> module;
+	Slang::ComPtr<slang::IBlob> diagnostics;
+	module = compiler.session->loadModule(module_name, diagnostics.writeRef());
+	if (diagnostics.get())
+	{
+		// TODO: Find a way to get shader compile errors in the Sublime Text console.
+		throw std::runtime_error(
+			FORMAT_ERROR(std::string_view(
+				static_cast<char const *>(diagnostics->getBufferPointer()),
+				static_cast<size_t>(diagnostics->getBufferSize())
+			))
+		);
+	}
+	if (!module)
+	{
+		throw std::runtime_error{FORMAT_ERROR(std::format("Slang: failed to load module {}.", module_name))};
+	}
 
-				vk::BindBufferMemoryInfo bind_buffer_memory_info;
-				bind_buffer_memory_info.buffer = buffer_allocation.handle;
-				bind_buffer_memory_info.memoryOffset = memory_offset;
-				bind_buffer_memory_infos.push_back(bind_buffer_memory_info);
+	compiler.modules.emplace_back(module_name, module);
+	return module;
+}
 
-				memory_offset += buffer_allocation.size;
-			}
+// Links the module once with all of the entry points, instead of once per entry point, so everything they share only gets linked once.
+// Returns the SPIR-V for each entry point, in the same order as entry_point_names.
+static std::vector<std::vector<uint32_t>> slang_compile_module(
+	SlangCompiler &compiler, 
+	char const *const module_name, 
+	std::span<char const *const> const entry_point_names)
+{
+	using namespace Slang;
+	using namespace slang;
 
-			if (buffer_allocation.staging_buffer.memory_type_info.idx == memory_type_idx)
-			{
-				memory_offset = align_forward(memory_offset, buffer_allocation.staging_buffer.align);
+	TRACE_SCOPE(slang_compile_module);
+
+	if (!compiler.session)
+	{
+		slang_compiler_init(compiler);
+	}
+
+	IModule *module = slang_compiler_load_module(compiler, module_name);
+
+	std::vector<ComPtr<IEntryPoint>> entry_points(entry_point_names.size());
+	std::vector<IComponentType *> component_types{module};
+	for (size_t i = 0; i < entry_point_names.size(); ++i)
+	{
+		SLANG_CHECK(module->findEntryPointByName(entry_point_names[i], entry_points[i].writeRef()));
+		component_types.push_back(entry_points[i]);
+	}
+
+	ComPtr<IComponentType> composed_program;
+	SLANG_CHECK(compiler.session->createCompositeComponentType(
+		component_types.data(),
+		component_types.size(),
+		composed_program.writeRef()
+	));
+
+	ComPtr<IComponentType> linked_program;
+	SLANG_CHECK(composed_program->link(linked_program.writeRef()));
+
+	std::vector<std::vector<uint32_t>> res(entry_point_names.size());
+	for (size_t i = 0; i < entry_point_names.size(); ++i)
+	{
+		ComPtr<IBlob> spirv_code;
+		SLANG_CHECK(linked_program->getEntryPointCode(
+			static_cast<SlangInt>(i), // entryPointIndex
+			0, // targetIndex
+			spirv_code.writeRef()
+		));
+
+		res[i].resize(spirv_code->getBufferSize()/sizeof(uint32_t));
+		std::memcpy(res[i].data(), spirv_code->getBufferPointer(), res[i].size()*sizeof(uint32_t));
+	}
+	return res;
+}
+
+// Returns the SPIR-V for each entry point of a module. It comes from the shader cache if it's all there, otherwise the module gets compiled 
+// and written to the cache. shader_cache_hash comes from slang_shader_cache_hash.
+// The cache file names contain the hash, so stale files never get loaded, they just get deleted the next time their entry point gets compiled.
+static std::vector<std::vector<uint32_t>> slang_get_spirv(
+	SlangCompiler &compiler, 
+	uint64_t const shader_cache_hash, 
+	char const *const module_name, 
+	std::span<char const *const> const entry_point_names)
+{
+	std::filesystem::path const cache_dir{BASED_RENDERER_SHADER_CACHE_PATH};
+
+	std::vector<std::string> prefixes;
+	std::vector<std::filesystem::path> cache_paths;
+	for (char const *entry_point_name : entry_point_names)
+	{
+		prefixes.push_back(std::format("{}.{}.", module_name, entry_point_name));
+		cache_paths.push_back(cache_dir/std::format("{}{:016x}.spv", prefixes.back(), shader_cache_hash));
+	}
+
+	std::vector<std::vector<uint32_t>> res(entry_point_names.size());
+	bool hit = true;
+	for (size_t i = 0; i < entry_point_names.size() && hit; ++i)
+	{
+		std::optional<std::vector<char>> cached = read_entire_binary_file(cache_paths[i]);
+
+		// Something other than SPIR-V (e.g. a truncated write) is treated as a miss.
+		hit = cached && cached->size() >= sizeof(uint32_t) && cached->size()%sizeof(uint32_t) == 0;
+		if (hit)
+		{
+			res[i].resize(cached->size()/sizeof(uint32_t));
+			std::memcpy(res[i].data(), cached->data(), cached->size());
+			hit = res[i][0] == 0x07230203;
+		}
+	}
+	if (hit)
+	{
+		return res;
+	}
 
-				vk::BindBufferMemoryInfo bind_buffer_memory_info;
-				bind_buffer_memory_info.buffer = buffer_allocation.staging_buffer.handle;
-				bind_buffer_memory_info.memoryOffset = memory_offset;
-				bind_buffer_memory_infos.push_back(bind_buffer_memory_info);
+	res = slang_compile_module(compiler, module_name, entry_point_names);
 
-				memory_offset += buffer_allocation.staging_buffer.size;
+	// Failing to write the cache is not an error, the next startup just has to compile again.
+	std::error_code error_code;
+	std::filesystem::create_directories(cache_dir, error_code);
+	for (size_t i = 0; i < entry_point_names.size() && !error_code; ++i)
+	{
+		for (std::filesystem::directory_entry const &entry : std::filesystem::directory_iterator{cache_dir, error_code})
+		{
+			if (entry.path().filename().string().starts_with(prefixes[i]))
+			{
+				std::filesystem::remove(entry.path(), error_code);
 			}
 		}
 
-		for (size_t i = 0; i < image_count; ++i)
+		if (!error_code)
 		{
-			VulkanImageAllocation const &image_allocation = image_allocations[i];
+			error_code = write_entire_binary_file_atomically(cache_paths[i], res[i].data(), res[i].size()*sizeof(uint32_t));
+		}
+	}
+	if (error_code)
+	{
+		dprint("Failed to write the shader cache for {}: {}\n", module_name, error_code.message());
+	}
 
-			if (image_allocation.memory_type_info.idx == memory_type_idx && !image_allocation.memory) 
-			{
-				memory_offset = align_forward(memory_offset, image_allocation.align);
+	return res;
+}
 
-				vk::BindImageMemoryInfo bind_image_memory_info;
-				bind_image_memory_info.image = image_allocation.handle;
-				bind_image_memory_info.memoryOffset = memory_offset;
-				bind_image_memory_infos.push_back(bind_image_memory_info);
+// Every Slang module that gets compiled at startup, along with its entry points.
+struct SlangModuleDesc
+{
+	char const *name;
+	std::vector<char const *> entry_point_names;
+};
 
-				memory_offset += image_allocation.size;
-			}
+// Queues one job per module, since the entry points of a linked module can't be split across global sessions.
+// The results are in the same order as modules.
+// compilers needs one SlangCompiler per worker thread, and it and modules have to outlive the jobs.
+static std::vector<std::future<std::vector<std::vector<uint32_t>>>> slang_compile_async(
+	JobPool &job_pool, 
+	std::vector<SlangCompiler> &compilers, 
+	uint64_t const shader_cache_hash, 
+	std::span<SlangModuleDesc const> const modules)
+{
+	std::vector<std::future<std::vector<std::vector<uint32_t>>>> res;
+	for (SlangModuleDesc const &module : modules)
+	{
+		res.push_back(job_pool_submit(job_pool, [&compilers, shader_cache_hash, &module](size_t const thread_idx)
+		{
+			TRACE_SCOPE(slang_get_spirv);
+			return slang_get_spirv(compilers[thread_idx], shader_cache_hash, module.name, module.entry_point_names);
+		}));
+	}
+	return res;
+}
 
-			if (image_allocation.staging_buffer.memory_type_info.idx == memory_type_idx) 
-			{
-				memory_offset = align_forward(memory_offset, image_allocation.staging_buffer.align);
+// Throws away the session and every module loaded into it, but keeps the global session, which is the expensive part.
+// Slang sessions never reload a module they've already loaded, so this is needed before compiling a module again after it changed.
+static void slang_compiler_reset_session(SlangCompiler &compiler) noexcept
+{
+	compiler.modules.clear();
+	compiler.session = nullptr;
+}
 
-				vk::BindBufferMemoryInfo bind_staging_buffer_memory_info;
-				bind_staging_buffer_memory_info.buffer = image_allocation.staging_buffer.handle;
-				bind_staging_buffer_memory_info.memoryOffset = memory_offset;
-				bind_buffer_memory_infos.push_back(bind_staging_buffer_memory_info);
+// Shader hot reload watches the Slang search path and, when anything in it changes, recompiles and rebuilds the pipelines on the job pool.
+// The bench leaves it out, since it shouldn't be doing any extra work in the background.
+#define BASED_RENDERER_SHADER_HOT_RELOAD !BASED_RENDERER_BENCH
+#define BASED_RENDERER_SHADER_HOT_RELOAD_POLL_INTERVAL_MS 250
 
-				memory_offset += image_allocation.staging_buffer.size;
+using SlangFileTimes = std::vector<std::pair<std::filesystem::path, std::filesystem::file_time_type>>;
+
+// Files that disappear in the middle of this (e.g. editors that save by renaming) just get skipped, the next poll will see them again.
+static SlangFileTimes slang_file_times()
+{
+	SlangFileTimes res;
+	std::error_code error_code;
+	for (std::filesystem::directory_entry const &entry : std::filesystem::directory_iterator{BASED_RENDERER_SLANG_SEARCH_PATH, error_code})
+	{
+		if (entry.path().extension() == ".slang")
+		{
+			std::filesystem::file_time_type time = entry.last_write_time(error_code);
+			if (!error_code)
+			{
+				res.emplace_back(entry.path(), time);
 			}
 		}
+	}
+	std::sort(res.begin(), res.end());
+	return res;
+}
 
-		if (memory_offset > 0)
+struct ShaderHotReload
+{
+	std::span<SlangModuleDesc const> modules;
+	// Turns freshly compiled SPIR-V into pipelines. There is one element in spirv per module, and one element in that per entry point.
+	// Runs on a worker thread.
+	std::function<std::vector<vk::Pipeline>(std::vector<std::vector<std::vector<uint32_t>>> const &spirv)> build_pipelines;
+
+	// Only ever touched by the job that's in flight, and there's never more than one.
+	SlangFileTimes file_times;
+	std::chrono::steady_clock::time_point last_poll;
+	// Gives back no pipelines if nothing changed.
+	std::future<std::vector<vk::Pipeline>> pending;
+
+	// The job uses things that live on the stack of based_renderer_main, so it has to be done before those go away.
+	~ShaderHotReload()
+	{
+		if (pending.valid())
 		{
-			vk::MemoryAllocateInfo memory_allocate_info;
-			memory_allocate_info.allocationSize = memory_offset;
-			memory_allocate_info.memoryTypeIndex = memory_type_idx;
-			vk::DeviceMemory memory = device.allocateMemory(memory_allocate_info);
+			pending.wait();
+		}
+	}
+};
 
-			for (size_t i = 0; i < buffer_count; ++i) 
-			{
-				VulkanBufferAllocation &buffer_allocation = buffer_allocations[i];
-				if (buffer_allocation.memory_type_info.idx == memory_type_idx && !buffer_allocation.memory) 
-				{
-					buffer_allocation.memory = memory;
-				}
+// Doesn't block. Returns the new pipelines if a reload finished since the last call, and starts a new poll every so often.
+// If compiling or building the pipelines failed, the error gets printed and the old pipelines stay in use, 
+// so a typo in a shader doesn't take the whole program down.
+static std::optional<std::vector<vk::Pipeline>> shader_hot_reload_poll(
+	ShaderHotReload &reload, 
+	JobPool &job_pool, 
+	std::vector<SlangCompiler> &compilers)
+{
+	TRACE_SCOPE(shader_hot_reload_poll);
 
-				if (buffer_allocation.staging_buffer.memory_type_info.idx == memory_type_idx) 
-				{
-					buffer_allocation.staging_buffer.memory = memory;
-				}
-			}
-			for (size_t i = 0; i < image_count; ++i)
-			{
-				VulkanImageAllocation &image_allocation = image_allocations[i];
-				if (image_allocation.memory_type_info.idx == memory_type_idx && !image_allocation.memory) 
-				{
-					image_allocation.memory = memory;
-				}
+	if (reload.pending.valid())
+	{
+		if (reload.pending.wait_for(std::chrono::seconds{0}) != std::future_status::ready)
+		{
+			return std::nullopt;
+		}
 
-				if (image_allocation.staging_buffer.memory_type_info.idx == memory_type_idx) 
-				{
-					image_allocation.staging_buffer.memory = memory;
-				}
+		try
+		{
+			std::vector<vk::Pipeline> pipelines = reload.pending.get();
+			if (!pipelines.empty())
+			{
+				return pipelines;
 			}
-			for (size_t i = bind_buffer_memory_infos_size; i < bind_buffer_memory_infos.size(); ++i) 
+		}
+		catch (std::exception const &err)
+		{
+			dprint("Shader hot reload failed:\n{}\n", err.what());
+		}
+		return std::nullopt;
+	}
+
+	std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+	if (now - reload.last_poll >= std::chrono::milliseconds{BASED_RENDERER_SHADER_HOT_RELOAD_POLL_INTERVAL_MS})
+	{
+		reload.last_poll = now;
+		reload.pending = job_pool_submit(job_pool, [&reload, &compilers](size_t const thread_idx)
+		{
+			// Updated before compiling, so that a shader with an error doesn't get compiled again until it changes.
+			SlangFileTimes file_times = slang_file_times();
+			if (file_times == reload.file_times)
 			{
-				bind_buffer_memory_infos[i].memory = memory;
+				return std::vector<vk::Pipeline>{};
 			}
-			for (size_t i = bind_image_memory_infos_size; i < bind_image_memory_infos.size(); ++i) 
+			reload.file_times = std::move(file_times);
+
+			uint64_t shader_cache_hash = slang_shader_cache_hash();
+			SlangCompiler &compiler = compilers[thread_idx];
+			slang_compiler_reset_session(compiler);
+
+			std::vector<std::vector<std::vector<uint32_t>>> spirv;
+			for (SlangModuleDesc const &module : reload.modules)
 			{
-				bind_image_memory_infos[i].memory = memory;
+				spirv.push_back(slang_get_spirv(compiler, shader_cache_hash, module.name, module.entry_point_names));
 			}
-		}
+			return reload.build_pipelines(spirv);
+		});
 	}
 
-	device.bindBufferMemory2(bind_buffer_memory_infos);
-	device.bindImageMemory2(bind_image_memory_infos);
+	return std::nullopt;
 }
 
-#define SLANG_CHECK(RESULT) STMT( \
-	switch (RESULT) \
-	{ \
-		case SLANG_OK: \
-			break; \
-		case SLANG_FAIL: \
-			throw std::runtime_error{FORMAT_ERROR("Slang: failed for unknown reason.")}; \
-		case SLANG_E_NOT_IMPLEMENTED: \
-			throw std::logic_error{FORMAT_ERROR("Slang: function not implemented.")}; \
-		case SLANG_E_NO_INTERFACE: \
-			throw std::logic_error{FORMAT_ERROR("Slang: no interface.")}; \
-		case SLANG_E_ABORT: \
-			throw std::runtime_error{FORMAT_ERROR("Slang: error was aborted.")}; \
-		case SLANG_E_INVALID_HANDLE: \
-			throw std::logic_error{FORMAT_ERROR("Slang: invalid handle")}; \
-		case SLANG_E_INVALID_ARG: \
-			throw std::invalid_argument{FORMAT_ERROR("Slang: invalid argument.")}; \
-		case SLANG_E_OUT_OF_MEMORY: \
-			throw std::runtime_error{FORMAT_ERROR("Slang: ran out of memory.")}; \
-	} \
-)
+// A pipeline that got replaced, but might still be in use by frames in flight.
+struct VulkanRetiredPipeline
+{
+	vk::Pipeline pipeline;
+	// Once the frame timeline reaches this, no frame that used the pipeline is in flight anymore.
+	uint64_t destroy_timeline_value;
+};
 
+#if BASED_RENDERER_WIN32
 // TODO: Remove global variable.
 static HINSTANCE win32_instance;
+#endif
 
-static void based_renderer_main();
+static void based_renderer_main(BasedRendererOptions const &options);
 
-int WINAPI WinMain(
-	HINSTANCE instance,
-	HINSTANCE prev_instance,
-	LPSTR	 command_line,
-	int	   show_command)
+static int based_renderer_run(int const argc, char const *const *const argv) noexcept
 {
-	UNUSED(prev_instance);
-	UNUSED(command_line);
-	UNUSED(show_command);
-
-	win32_instance = instance;
-
 	try
 	{
-		based_renderer_main();
+		BasedRendererOptions options = parse_options(argc, argv);
+		TRACE_THREAD_NAME("main thread");
+		based_renderer_main(options);
+#if BASED_RENDERER_TRACE
+		// Every thread that could record anything has been joined by now.
+		trace_write(options.trace_path);
+#endif
+		return 0;
 	}
 	catch (vk::OutOfHostMemoryError err)
 	{
-		win32_message_box(err.what(), "vk::OutOfHostMemoryError");
+		show_error(err.what(), "vk::OutOfHostMemoryError");
 	}
 	catch (vk::OutOfDeviceMemoryError err)
 	{
-		win32_message_box(err.what(), "vk::OutOfDeviceMemoryError");
+		show_error(err.what(), "vk::OutOfDeviceMemoryError");
 	}
 	catch (vk::InitializationFailedError err)
 	{
-		win32_message_box(err.what(), "vk::InitializationFailedError");
+		show_error(err.what(), "vk::InitializationFailedError");
 	}
 	catch (vk::DeviceLostError err)
 	{
-		win32_message_box(err.what(), "vk::DeviceLostError");
+		show_error(err.what(), "vk::DeviceLostError");
 	}
 	catch (vk::MemoryMapFailedError err)
 	{
-		win32_message_box(err.what(), "vk::MemoryMapFailedError");
+		show_error(err.what(), "vk::MemoryMapFailedError");
 	}
 	catch (vk::LayerNotPresentError err)
 	{
-		win32_message_box(err.what(), "vk::LayerNotPresentError");
+		show_error(err.what(), "vk::LayerNotPresentError");
 	}
 	catch (vk::ExtensionNotPresentError err)
 	{
-		win32_message_box(err.what(), "vk::ExtensionNotPresentError");
+		show_error(err.what(), "vk::ExtensionNotPresentError");
 	}
 	catch (vk::FeatureNotPresentError err)
 	{
-		win32_message_box(err.what(), "vk::FeatureNotPresentError");
+		show_error(err.what(), "vk::FeatureNotPresentError");
 	}
 	catch (vk::IncompatibleDriverError err)
 	{
-		win32_message_box(err.what(), "vk::IncompatibleDriverError");
+		show_error(err.what(), "vk::IncompatibleDriverError");
 	}
 	catch (vk::TooManyObjectsError err)
 	{
-		win32_message_box(err.what(), "vk::TooManyObjectsError");
+		show_error(err.what(), "vk::TooManyObjectsError");
 	}
 	catch (vk::FormatNotSupportedError err)
 	{
-		win32_message_box(err.what(), "vk::FormatNotSupportedError");
+		show_error(err.what(), "vk::FormatNotSupportedError");
 	}
 	catch (vk::FragmentedPoolError err)
 	{
-		win32_message_box(err.what(), "vk::FragmentedPoolError");
+		show_error(err.what(), "vk::FragmentedPoolError");
 	}
 	catch (vk::UnknownError err)
 	{
-		win32_message_box(err.what(), "vk::UnknownError");
+		show_error(err.what(), "vk::UnknownError");
 	}
 	catch (vk::ValidationFailedError err)
 	{
-		win32_message_box(err.what(), "vk::ValidationFailedError");
+		show_error(err.what(), "vk::ValidationFailedError");
 	}
 	catch (vk::OutOfPoolMemoryError err)
 	{
-		win32_message_box(err.what(), "vk::OutOfPoolMemoryError");
+		show_error(err.what(), "vk::OutOfPoolMemoryError");
 	}
 	catch (vk::InvalidExternalHandleError err)
 	{
-		win32_message_box(err.what(), "vk::InvalidExternalHandleError");
+		show_error(err.what(), "vk::InvalidExternalHandleError");
 	}
 	catch (vk::InvalidOpaqueCaptureAddressError err)
 	{
-		win32_message_box(err.what(), "vk::InvalidOpaqueCaptureAddressError");
+		show_error(err.what(), "vk::InvalidOpaqueCaptureAddressError");
 	}
 	catch (vk::FragmentationError err)
 	{
-		win32_message_box(err.what(), "vk::FragmentationError");
+		show_error(err.what(), "vk::FragmentationError");
 	}
 	catch (vk::NotPermittedError err)
 	{
-		win32_message_box(err.what(), "vk::NotPermittedError");
+		show_error(err.what(), "vk::NotPermittedError");
 	}
 	catch (vk::SurfaceLostKHRError err)
 	{
-		win32_message_box(err.what(), "vk::SurfaceLostKHRError");
+		show_error(err.what(), "vk::SurfaceLostKHRError");
 	}
 	catch (vk::NativeWindowInUseKHRError err)
 	{
-		win32_message_box(err.what(), "vk::NativeWindowInUseKHRError");
+		show_error(err.what(), "vk::NativeWindowInUseKHRError");
 	}
 	catch (vk::OutOfDateKHRError err)
 	{
-		win32_message_box(err.what(), "vk::OutOfDateKHRError");
+		show_error(err.what(), "vk::OutOfDateKHRError");
 	}
 	catch (vk::InvalidShaderNVError err)
 	{
-		win32_message_box(err.what(), "vk::InvalidShaderNVError");
+		show_error(err.what(), "vk::InvalidShaderNVError");
 	}
 	catch (vk::FullScreenExclusiveModeLostEXTError err)
 	{
-		win32_message_box(err.what(), "vk::FullScreenExclusiveModeLostEXTError");
+		show_error(err.what(), "vk::FullScreenExclusiveModeLostEXTError");
 
 		// NOTE: We are not actually using this
 		// extension yet, but will be soon.
 	}
 	catch (vk::LogicError err)
 	{
-		win32_message_box(err.what(), "vk::LogicError");
+		show_error(err.what(), "vk::LogicError");
 	}
 	catch (vk::SystemError err)
 	{
-		win32_message_box(err.what(), "vk::SystemError");
+		show_error(err.what(), "vk::SystemError");
 	}
 
 	catch (std::invalid_argument err)
 	{
-		win32_message_box(err.what(), "std::invalid_argument");
+		show_error(err.what(), "std::invalid_argument");
 	}
 	catch (std::domain_error err)
 	{
-		win32_message_box(err.what(), "std::domain_error");
+		show_error(err.what(), "std::domain_error");
 	}
 	catch (std::length_error err)
 	{
-		win32_message_box(err.what(), "std::length_error");
+		show_error(err.what(), "std::length_error");
 	}
 	catch (std::out_of_range err)
 	{
-		win32_message_box(err.what(), "std::out_of_range");
+		show_error(err.what(), "std::out_of_range");
 	}
 	catch (std::range_error err)
 	{
-		win32_message_box(err.what(), "std::range_error");
+		show_error(err.what(), "std::range_error");
 	}
 	catch (std::overflow_error err)
 	{
-		win32_message_box(err.what(), "std::overflow_error");
+		show_error(err.what(), "std::overflow_error");
 	}
 	catch (std::underflow_error err)
 	{
-		win32_message_box(err.what(), "std::underflow_error");
+		show_error(err.what(), "std::underflow_error");
 	}
 	catch (std::logic_error err)
 	{
-		win32_message_box(err.what(), "std::logic_error");
+		show_error(err.what(), "std::logic_error");
 	}
 	catch (std::runtime_error err)
 	{
-		win32_message_box(err.what(), "std::runtime_error");
+		show_error(err.what(), "std::runtime_error");
 	}
 	catch (...)
 	{
-		win32_message_box("Failed for unknown reason.", "Error");
+		show_error("Failed for unknown reason.", "Error");
 	}
 
-	return 0;
+	return 1;
+}
+
+// The benchmark is a console program, so it gets a regular main, even on Windows.
+#if BASED_RENDERER_WIN32 && !BASED_RENDERER_BENCH
+int WINAPI WinMain(
+	HINSTANCE instance,
+	HINSTANCE prev_instance,
+	LPSTR	 command_line,
+	int	   show_command)
+{
+	UNUSED(prev_instance);
+	UNUSED(command_line);
+	UNUSED(show_command);
+
+	win32_instance = instance;
+
+	return based_renderer_run(__argc, __argv);
+}
+#else
+int main(int argc, char **argv)
+{
+#if BASED_RENDERER_WIN32
+	win32_instance = GetModuleHandleW(nullptr);
+#endif
+	return based_renderer_run(argc, argv);
 }
+#endif
 
 struct Uniforms
 {
 	glm::mat4 model;
 	glm::mat4 view;
 	glm::mat4 proj;
+	// proj*view*model from the frame before, which is what the Hi-Z pyramid that culling tests against was built with.
+	glm::mat4 prev_mvp;
+	// Whether culling tests against the Hi-Z pyramid at all.
+	uint32_t occlusion_culling;
+};
+
+// The vertices live in a storage buffer that gets uploaded once at startup, and the vertex shader indexes it with SV_VertexID,
+// which for indexed draws is the index. They are vec4s, since a float3 in a StructuredBuffer would get padded to 16 bytes anyway.
+// Corner i is at +0.5 on every axis whose bit is set in i (x is bit 0, y is bit 1, z is bit 2), and -0.5 on the others.
+static std::array<glm::vec4, 8> const cube_vertices{
+	glm::vec4{-0.5f, -0.5f, -0.5f, 1.0f},
+	glm::vec4{ 0.5f, -0.5f, -0.5f, 1.0f},
+	glm::vec4{-0.5f,  0.5f, -0.5f, 1.0f},
+	glm::vec4{ 0.5f,  0.5f, -0.5f, 1.0f},
+	glm::vec4{-0.5f, -0.5f,  0.5f, 1.0f},
+	glm::vec4{ 0.5f, -0.5f,  0.5f, 1.0f},
+	glm::vec4{-0.5f,  0.5f,  0.5f, 1.0f},
+	glm::vec4{ 0.5f,  0.5f,  0.5f, 1.0f},
+};
+
+// Two triangles per face. cull.slang has the count too.
+static std::array<uint16_t, 36> const cube_indices{
+	0, 1, 3, 3, 2, 0,
+	4, 5, 7, 7, 6, 4,
+	6, 2, 0, 0, 4, 6,
+	7, 3, 1, 1, 5, 7,
+	0, 1, 5, 5, 4, 0,
+	2, 3, 7, 7, 6, 2,
+};
+
+// Has to match numthreads in cull.slang.
+#define BASED_RENDERER_CULL_GROUP_SIZE 64
+
+// The Hi-Z pyramid always has the same size, no matter how big the depth image is, so it never has to be recreated along with the swapchain.
+// Level 0 is BASED_RENDERER_HIZ_SIZE squared, and every level after that is half the size of the one before it, down to 1x1.
+#define BASED_RENDERER_HIZ_SIZE 512
+#define BASED_RENDERER_HIZ_LEVEL_COUNT 10
+static_assert(BASED_RENDERER_HIZ_SIZE >> (BASED_RENDERER_HIZ_LEVEL_COUNT - 1) == 1);
+// Has to match numthreads in hiz.slang.
+#define BASED_RENDERER_HIZ_GROUP_SIZE 8
+
+// Where every cube is. The vertex shader indexes the copy on the GPU with SV_VulkanInstanceID, so one draw can render all of them.
+// Only the transforms that changed since the last frame get copied to the GPU, see vulkan_instances_stage.
+struct SceneInstances
+{
+	std::vector<glm::mat4> transforms;
+	// Indices into transforms, in the order they got dirtied. is_dirty keeps an index from showing up twice.
+	std::vector<uint32_t> dirty;
+	std::vector<bool> is_dirty;
 };
 
-static void rotate_cube(vk::Device const device, vk::DeviceMemory const uniforms_memory, Uniforms &uniforms, float const dt, float const aspect) {
+static void scene_instances_set_transform(SceneInstances &instances, uint32_t const idx, glm::mat4 const &transform)
+{
+	instances.transforms[idx] = transform;
+	if (!instances.is_dirty[idx])
+	{
+		instances.is_dirty[idx] = true;
+		instances.dirty.push_back(idx);
+	}
+}
+
+// Distance between the centers of neighbouring cubes in the grid.
+#define BASED_RENDERER_SCENE_GRID_SPACING 1.5f
+
+// How many cubes there are along each side of the smallest grid that fits count of them.
+static uint32_t scene_grid_side(uint32_t const count) noexcept
+{
+	uint32_t res = 1;
+	while (static_cast<uint64_t>(res)*res*res < count)
+	{
+		++res;
+	}
+	return res;
+}
+
+// Fills the grid one row at a time, so unless count is a cube number, the last layer isn't full. Every instance starts out dirty.
+static SceneInstances scene_instances_create_grid(uint32_t const count)
+{
+	SceneInstances res{};
+	res.transforms.resize(count);
+	res.is_dirty.resize(count);
+	res.dirty.reserve(count);
+
+	uint32_t const side = scene_grid_side(count);
+	float const center = static_cast<float>(side - 1)/2.0f;
+	for (uint32_t i = 0; i < count; ++i)
+	{
+		glm::vec3 cell{
+			static_cast<float>(i%side),
+			static_cast<float>(i/side%side),
+			static_cast<float>(i/(side*side)),
+		};
+		scene_instances_set_transform(res, i, glm::translate(glm::mat4{1}, (cell - center)*BASED_RENDERER_SCENE_GRID_SPACING));
+	}
+	return res;
+}
+
+// Writes the transforms of every dirty instance to staging, which is this frame's region of a host visible buffer,
+// and appends the copies from there into the instance buffer to copies. Runs of consecutive instances become one copy each.
+// The region has to have room for every instance, since they might all be dirty.
+// The copies get recorded on the graphics queue, so they're ordered after every earlier frame that read the transforms they overwrite,
+// without any ownership transfers or a copy of the instance buffer per frame in flight.
+static void vulkan_instances_stage(
+	SceneInstances &instances,
+	std::byte *const staging,
+	vk::DeviceSize const staging_offset,
+	std::vector<vk::BufferCopy> &copies)
+{
+	TRACE_SCOPE(instances_stage);
+	std::sort(instances.dirty.begin(), instances.dirty.end());
+
+	vk::DeviceSize head = 0;
+	size_t run_begin = 0;
+	while (run_begin < instances.dirty.size())
+	{
+		size_t run_end = run_begin + 1;
+		while (run_end < instances.dirty.size() && instances.dirty[run_end] == instances.dirty[run_end - 1] + 1)
+		{
+			++run_end;
+		}
+
+		uint32_t const first_instance = instances.dirty[run_begin];
+		vk::DeviceSize const size = (run_end - run_begin)*sizeof(glm::mat4);
+		std::memcpy(staging + head, &instances.transforms[first_instance], size);
+		copies.push_back(vk::BufferCopy{
+			staging_offset + head,
+			first_instance*sizeof(glm::mat4),
+			size,
+		});
+
+		head += size;
+		run_begin = run_end;
+	}
+
+	for (uint32_t idx : instances.dirty)
+	{
+		instances.is_dirty[idx] = false;
+	}
+	instances.dirty.clear();
+}
+
+// The longest a frame can advance the simulation by, so that a long stall (like dragging the window around) doesn't make it jump.
+#define BASED_RENDERER_MAX_DT 0.1f
+
+// The whole grid rotates, so view_distance has to be far enough back to keep the grid's corners in front of the camera,
+// and far_plane has to be far enough to keep the corners on the other side from getting clipped.
+static void rotate_cube(
+	void *const uniforms_data, 
+	Uniforms &uniforms, 
+	float const dt, 
+	float const aspect, 
+	float const view_distance, 
+	float const near_plane, 
+	float const far_plane) {
+	TRACE_SCOPE(rotate_cube);
 	static float rotation = 0.0f;
     rotation += dt;
 
+    uniforms.prev_mvp = uniforms.proj*uniforms.view*uniforms.model;
     uniforms.model = glm::rotate(glm::mat4{1}, -rotation, glm::vec3{0.0f, 1.0f, 0.0f});
-    uniforms.view = glm::translate(glm::mat4{1}, glm::vec3{0.0f, 0.0f, -3.0f});
-    uniforms.proj = glm::perspective(glm::radians(180.0f), aspect, 0.1f, 100.0f);
-
-    void *data;
-	vk::detail::resultCheck(
-		device.mapMemory(
-			uniforms_memory, 
-			0, 
-			sizeof(Uniforms), 
-			vk::MemoryMapFlags{}, 
-			&data
-		), 
-		"Failed to map memory!"
-	);
-	std::memcpy(data, &uniforms, sizeof(Uniforms));
-	device.unmapMemory(uniforms_memory);
+    uniforms.view = glm::translate(glm::mat4{1}, glm::vec3{0.0f, 0.0f, -view_distance});
+    uniforms.proj = glm::perspective(glm::radians(180.0f), aspect, near_plane, far_plane);
+
+	// uniforms_data points into this frame's region of the uniform ring, which stays mapped for the lifetime of the program.
+	std::memcpy(uniforms_data, &uniforms, sizeof(Uniforms));
 }
 
-static void based_renderer_main()
+static void based_renderer_main(BasedRendererOptions const &options)
 {
+	BENCH_BEGIN(total_startup);
+	TRACE_BEGIN(total_startup);
+
+	// Shaders don't depend on the device, so they get compiled (or loaded from the shader cache) on the job pool while the main thread 
+	// sets up Vulkan.
+	// The jobs use these, so they're declared before the job pool, which has to get destroyed (and joined) first.
+	std::array<SlangModuleDesc, 3> const slang_modules{
+		SlangModuleDesc{"cube", {"vs", "ps"}},
+		SlangModuleDesc{"cull", {"cs"}},
+		SlangModuleDesc{"hiz", {"downsample_depth", "downsample"}},
+	};
+	std::vector<SlangCompiler> slang_compilers;
+
+	JobPool job_pool{job_pool_default_thread_count()};
+	slang_compilers.resize(job_pool.threads.size());
+	std::vector<std::future<std::vector<std::vector<uint32_t>>>> slang_spirv_futures = slang_compile_async(
+		job_pool, 
+		slang_compilers, 
+		slang_shader_cache_hash(), 
+		slang_modules);
+
 	vk::ApplicationInfo vulkan_app_info{
 		"based_renderer",
 		VK_API_VERSION_1_0,
@@ -852,8 +3788,13 @@ static void based_renderer_main()
 #endif
 
 	std::vector<char const *> vulkan_instance_extensions;
-	vulkan_instance_extensions.push_back("VK_KHR_surface");
-	vulkan_instance_extensions.push_back(VK_KHR_platform_surface);
+	if (!options.headless)
+	{
+		vulkan_instance_extensions.push_back("VK_KHR_surface");
+#if BASED_RENDERER_WIN32
+		vulkan_instance_extensions.push_back(VK_KHR_platform_surface);
+#endif
+	}
 #if BASED_RENDERER_VULKAN_DEBUG_OUTPUT
 	vulkan_instance_extensions.push_back("VK_EXT_debug_utils");
 #endif
@@ -898,18 +3839,30 @@ static void based_renderer_main()
 	vulkan_instance_create_info.pNext = &vulkan_debug_output_info;
 #endif
 
+	BENCH_BEGIN(instance_creation);
+	TRACE_BEGIN(instance_creation);
 	vk::Instance vulkan_instance = vk::createInstance(vulkan_instance_create_info);
+	BENCH_END(instance_creation);
+	TRACE_END(instance_creation);
 
 	// Choose the first discrete GPU.
 	// If there is no discrete GPU, default to the last GPU.
+	// That includes CPU implementations like lavapipe, which is what we get on machines without a GPU.
 	std::vector<vk::PhysicalDevice> vulkan_physical_devices = vulkan_instance.enumeratePhysicalDevices();
-	vk::PhysicalDevice vulkan_physical_device = *std::find_if(vulkan_physical_devices.begin(), vulkan_physical_devices.end(),
+	if (vulkan_physical_devices.empty())
+	{
+		throw vk::IncompatibleDriverError{FORMAT_ERROR("No physical devices.")};
+	}
+	auto vulkan_physical_device_it = std::find_if(vulkan_physical_devices.begin(), vulkan_physical_devices.end(),
 		[](vk::PhysicalDevice p) 
 		{
 			vk::PhysicalDeviceProperties props = p.getProperties();
 			return props.deviceType == vk::PhysicalDeviceType::eDiscreteGpu;
 		}
 	);
+	vk::PhysicalDevice vulkan_physical_device = vulkan_physical_device_it != vulkan_physical_devices.end() ? 
+		*vulkan_physical_device_it : 
+		vulkan_physical_devices.back();
 
 	auto vulkan_physical_device_properties = vulkan_physical_device.getProperties2<
 		vk::PhysicalDeviceProperties2,
@@ -918,8 +3871,6 @@ static void based_renderer_main()
 		vk::PhysicalDeviceVulkan13Properties,
 		vk::PhysicalDeviceVulkan14Properties>();
 
-	vk::PhysicalDeviceMemoryProperties const vulkan_physical_device_memory_properties = vulkan_physical_device.getMemoryProperties();
-
 	auto vulkan_physical_device_features = vulkan_physical_device.getFeatures2<
 		vk::PhysicalDeviceFeatures2,
 		vk::PhysicalDeviceVulkan11Features,
@@ -956,8 +3907,9 @@ static void based_renderer_main()
 		VULKAN_DISABLE_FEATURE(sampleRateShading);
 		VULKAN_DISABLE_FEATURE(dualSrcBlend);
 		VULKAN_DISABLE_FEATURE(logicOp);
-		VULKAN_DISABLE_FEATURE(multiDrawIndirect);
-		VULKAN_DISABLE_FEATURE(drawIndirectFirstInstance);
+		// These three are for GPU culling, which falls back to CPU draws without them.
+		VULKAN_ALLOW_FEATURE(multiDrawIndirect);
+		VULKAN_ALLOW_FEATURE(drawIndirectFirstInstance);
 		VULKAN_DISABLE_FEATURE(depthClamp);
 		VULKAN_DISABLE_FEATURE(depthBiasClamp);
 		VULKAN_DISABLE_FEATURE(fillModeNonSolid);
@@ -981,13 +3933,13 @@ static void based_renderer_main()
 		VULKAN_DISABLE_FEATURE(shaderStorageImageReadWithoutFormat);
 		VULKAN_DISABLE_FEATURE(shaderStorageImageWriteWithoutFormat);
 		VULKAN_DISABLE_FEATURE(shaderUniformBufferArrayDynamicIndexing);
-		VULKAN_DISABLE_FEATURE(shaderSampledImageArrayDynamicIndexing);
+		VULKAN_REQUIRE_FEATURE(shaderSampledImageArrayDynamicIndexing);
 		VULKAN_DISABLE_FEATURE(shaderStorageBufferArrayDynamicIndexing);
-		VULKAN_DISABLE_FEATURE(shaderStorageImageArrayDynamicIndexing);
+		VULKAN_REQUIRE_FEATURE(shaderStorageImageArrayDynamicIndexing);
 		VULKAN_DISABLE_FEATURE(shaderClipDistance);
 		VULKAN_DISABLE_FEATURE(shaderCullDistance);
 		VULKAN_DISABLE_FEATURE(shaderFloat64);
-		VULKAN_DISABLE_FEATURE(shaderInt64);
+		VULKAN_REQUIRE_FEATURE(shaderInt64);
 		VULKAN_DISABLE_FEATURE(shaderInt16);
 		VULKAN_DISABLE_FEATURE(shaderResourceResidency);
 		VULKAN_DISABLE_FEATURE(shaderResourceMinLod);
@@ -1021,7 +3973,7 @@ static void based_renderer_main()
 	{
 		auto &features = std::get<2>(vulkan_physical_device_features);
 		VULKAN_DISABLE_FEATURE(samplerMirrorClampToEdge);
-		VULKAN_DISABLE_FEATURE(drawIndirectCount);
+		VULKAN_ALLOW_FEATURE(drawIndirectCount);
 		VULKAN_DISABLE_FEATURE(storageBuffer8BitAccess);
 		VULKAN_DISABLE_FEATURE(uniformAndStorageBuffer8BitAccess);
 		VULKAN_DISABLE_FEATURE(storagePushConstant8);
@@ -1029,7 +3981,7 @@ static void based_renderer_main()
 		VULKAN_DISABLE_FEATURE(shaderSharedInt64Atomics);
 		VULKAN_DISABLE_FEATURE(shaderFloat16);
 		VULKAN_DISABLE_FEATURE(shaderInt8);
-		VULKAN_DISABLE_FEATURE(descriptorIndexing);
+		VULKAN_REQUIRE_FEATURE(descriptorIndexing);
 		VULKAN_DISABLE_FEATURE(shaderInputAttachmentArrayDynamicIndexing);
 		VULKAN_DISABLE_FEATURE(shaderUniformTexelBufferArrayDynamicIndexing);
 		VULKAN_DISABLE_FEATURE(shaderStorageTexelBufferArrayDynamicIndexing);
@@ -1041,15 +3993,15 @@ static void based_renderer_main()
 		VULKAN_DISABLE_FEATURE(shaderUniformTexelBufferArrayNonUniformIndexing);
 		VULKAN_DISABLE_FEATURE(shaderStorageTexelBufferArrayNonUniformIndexing);
 		VULKAN_DISABLE_FEATURE(descriptorBindingUniformBufferUpdateAfterBind);
-		VULKAN_DISABLE_FEATURE(descriptorBindingSampledImageUpdateAfterBind);
-		VULKAN_DISABLE_FEATURE(descriptorBindingStorageImageUpdateAfterBind);
+		VULKAN_REQUIRE_FEATURE(descriptorBindingSampledImageUpdateAfterBind);
+		VULKAN_REQUIRE_FEATURE(descriptorBindingStorageImageUpdateAfterBind);
 		VULKAN_DISABLE_FEATURE(descriptorBindingStorageBufferUpdateAfterBind);
 		VULKAN_DISABLE_FEATURE(descriptorBindingUniformTexelBufferUpdateAfterBind);
 		VULKAN_DISABLE_FEATURE(descriptorBindingStorageTexelBufferUpdateAfterBind);
-		VULKAN_DISABLE_FEATURE(descriptorBindingUpdateUnusedWhilePending);
-		VULKAN_DISABLE_FEATURE(descriptorBindingPartiallyBound);
+		VULKAN_REQUIRE_FEATURE(descriptorBindingUpdateUnusedWhilePending);
+		VULKAN_REQUIRE_FEATURE(descriptorBindingPartiallyBound);
 		VULKAN_DISABLE_FEATURE(descriptorBindingVariableDescriptorCount);
-		VULKAN_DISABLE_FEATURE(runtimeDescriptorArray);
+		VULKAN_REQUIRE_FEATURE(runtimeDescriptorArray);
 		VULKAN_DISABLE_FEATURE(samplerFilterMinmax);
 		VULKAN_DISABLE_FEATURE(scalarBlockLayout);
 		VULKAN_DISABLE_FEATURE(imagelessFramebuffer);
@@ -1057,8 +4009,8 @@ static void based_renderer_main()
 		VULKAN_DISABLE_FEATURE(shaderSubgroupExtendedTypes);
 		VULKAN_DISABLE_FEATURE(separateDepthStencilLayouts);
 		VULKAN_DISABLE_FEATURE(hostQueryReset);
-		VULKAN_DISABLE_FEATURE(timelineSemaphore);
-		VULKAN_DISABLE_FEATURE(bufferDeviceAddress);
+		VULKAN_REQUIRE_FEATURE(timelineSemaphore);
+		VULKAN_REQUIRE_FEATURE(bufferDeviceAddress);
 		VULKAN_DISABLE_FEATURE(bufferDeviceAddressCaptureReplay);
 		VULKAN_DISABLE_FEATURE(bufferDeviceAddressMultiDevice);
 		VULKAN_REQUIRE_FEATURE(vulkanMemoryModel); // TODO: Do we necessarily need these?
@@ -1116,6 +4068,19 @@ static void based_renderer_main()
 		throw vk::FeatureNotPresentError{FORMAT_ERROR(to_string(vulkan_missing_features))};
 	}
 
+	bool vulkan_gpu_culling = false;
+	if (options.gpu_culling)
+	{
+		vulkan_gpu_culling = 
+			std::get<0>(vulkan_physical_device_features).features.multiDrawIndirect &&
+			std::get<0>(vulkan_physical_device_features).features.drawIndirectFirstInstance &&
+			std::get<2>(vulkan_physical_device_features).drawIndirectCount;
+		if (!vulkan_gpu_culling)
+		{
+			dprint("GPU culling needs multiDrawIndirect, drawIndirectFirstInstance and drawIndirectCount. Falling back to CPU draws.\n");
+		}
+	}
+
 	std::vector<vk::QueueFamilyProperties> vulkan_queue_family_properties = vulkan_physical_device.getQueueFamilyProperties();
 
 	// TODO: This is stupid. Find out how queue priorities should be done.
@@ -1146,7 +4111,10 @@ static void based_renderer_main()
 	}
 
 	std::vector<char const *> vulkan_device_extensions;
-	vulkan_device_extensions.push_back("VK_KHR_swapchain");
+	if (!options.headless)
+	{
+		vulkan_device_extensions.push_back("VK_KHR_swapchain");
+	}
 	auto vulkan_device_extension_properties = vulkan_physical_device.enumerateDeviceExtensionProperties();
 	std::vector<std::string> vulkan_missing_device_extensions;
 	for (char const *device_extension : vulkan_device_extensions)
@@ -1170,14 +4138,98 @@ static void based_renderer_main()
 		throw vk::ExtensionNotPresentError{FORMAT_ERROR(to_string(vulkan_missing_device_extensions))};
 	}
 
+	// Only needed for the present latency report, so these are optional.
+	void *vulkan_device_create_info_next = &std::get<0>(vulkan_physical_device_features);
+	vk::PhysicalDevicePresentWaitFeaturesKHR vulkan_present_wait_features{vk::True, vulkan_device_create_info_next};
+	vk::PhysicalDevicePresentIdFeaturesKHR vulkan_present_id_features{vk::True, &vulkan_present_wait_features};
+	bool vulkan_present_wait_enabled = false;
+	if (!options.headless)
+	{
+		bool has_present_id = false;
+		bool has_present_wait = false;
+		for (vk::ExtensionProperties const &extension_properties : vulkan_device_extension_properties)
+		{
+			has_present_id |= std::strcmp(extension_properties.extensionName, "VK_KHR_present_id") == 0;
+			has_present_wait |= std::strcmp(extension_properties.extensionName, "VK_KHR_present_wait") == 0;
+		}
+		if (has_present_id && has_present_wait)
+		{
+			auto features = vulkan_physical_device.getFeatures2<
+				vk::PhysicalDeviceFeatures2,
+				vk::PhysicalDevicePresentIdFeaturesKHR,
+				vk::PhysicalDevicePresentWaitFeaturesKHR>();
+			vulkan_present_wait_enabled = std::get<1>(features).presentId && std::get<2>(features).presentWait;
+		}
+		if (vulkan_present_wait_enabled)
+		{
+			vulkan_device_extensions.push_back("VK_KHR_present_id");
+			vulkan_device_extensions.push_back("VK_KHR_present_wait");
+			vulkan_device_create_info_next = &vulkan_present_id_features;
+		}
+		else
+		{
+			dprint("VK_KHR_present_id and VK_KHR_present_wait aren't supported, so there won't be a present latency report.\n");
+		}
+	}
+
+	// Only for --descriptor-buffer, see VulkanBindlessTable. The features can only be queried once we know the extension is there,
+	// so they get their own entry in the feature table down here instead of with the rest.
+	vk::PhysicalDeviceDescriptorBufferFeaturesEXT vulkan_descriptor_buffer_features{};
+	std::optional<vk::PhysicalDeviceDescriptorBufferPropertiesEXT> vulkan_descriptor_buffer_properties;
+	if (options.descriptor_buffer)
+	{
+		bool has_descriptor_buffer = false;
+		for (vk::ExtensionProperties const &extension_properties : vulkan_device_extension_properties)
+		{
+			has_descriptor_buffer |= std::strcmp(extension_properties.extensionName, "VK_EXT_descriptor_buffer") == 0;
+		}
+		if (has_descriptor_buffer)
+		{
+			vulkan_descriptor_buffer_features = std::get<1>(vulkan_physical_device.getFeatures2<
+				vk::PhysicalDeviceFeatures2,
+				vk::PhysicalDeviceDescriptorBufferFeaturesEXT>());
+			auto &features = vulkan_descriptor_buffer_features;
+			VULKAN_ALLOW_FEATURE(descriptorBuffer);
+			VULKAN_DISABLE_FEATURE(descriptorBufferCaptureReplay);
+			VULKAN_DISABLE_FEATURE(descriptorBufferImageLayoutIgnored);
+			VULKAN_DISABLE_FEATURE(descriptorBufferPushDescriptors);
+		}
+		if (vulkan_descriptor_buffer_features.descriptorBuffer)
+		{
+			vulkan_device_extensions.push_back("VK_EXT_descriptor_buffer");
+			vulkan_descriptor_buffer_features.pNext = vulkan_device_create_info_next;
+			vulkan_device_create_info_next = &vulkan_descriptor_buffer_features;
+			vulkan_descriptor_buffer_properties = std::get<1>(vulkan_physical_device.getProperties2<
+				vk::PhysicalDeviceProperties2,
+				vk::PhysicalDeviceDescriptorBufferPropertiesEXT>());
+			vulkan_descriptor_buffer_properties->pNext = nullptr;
+		}
+		else
+		{
+			dprint("VK_EXT_descriptor_buffer isn't supported. Falling back to a descriptor pool.\n");
+		}
+	}
+
+	BENCH_BEGIN(device_creation);
+	TRACE_BEGIN(device_creation);
 	vk::Device vulkan_device = vulkan_physical_device.createDevice(vk::DeviceCreateInfo{
 		{}, 
 		vulkan_device_queue_infos,
 		{},
 		vulkan_device_extensions,
 		{},
-		&std::get<0>(vulkan_physical_device_features),
+		vulkan_device_create_info_next,
 	});
+	BENCH_END(device_creation);
+	TRACE_END(device_creation);
+
+	// The loader library only exports core and WSI functions, so extension functions like vkWaitForPresentKHR have to be loaded.
+	vk::detail::DispatchLoaderDynamic vulkan_dispatch{
+		static_cast<VkInstance>(vulkan_instance), 
+		vkGetInstanceProcAddr, 
+		static_cast<VkDevice>(vulkan_device), 
+		vkGetDeviceProcAddr,
+	};
 
 	// Each queue family gets its own std::vector, whether or not it has any queues.
 	std::vector<std::vector<vk::Queue>> vulkan_queues{vulkan_queue_family_properties.size()};
@@ -1204,480 +4256,633 @@ static void based_renderer_main()
 	}
 	vk::Queue vulkan_graphics_queue = vulkan_queues[vulkan_graphics_queue_family_idx.value()][0];
 
+	// Prefer a queue family that can only do transfers, since those are usually backed by dedicated copy engines.
+	// Otherwise, fall back to the graphics queue family, which can always do transfers, even if it doesn't say so.
 	std::optional<size_t> vulkan_transfer_queue_family_idx;
 	for (size_t i = 0; i < vulkan_queue_family_properties.size(); ++i)
 	{
-		if ((vulkan_queue_family_properties[i].queueFlags & vk::QueueFlags{vk::QueueFlagBits::eTransfer}) != vk::QueueFlags{})
+		vk::QueueFlags flags = vulkan_queue_family_properties[i].queueFlags;
+		if ((flags & vk::QueueFlagBits::eTransfer) && !(flags & (vk::QueueFlagBits::eGraphics|vk::QueueFlagBits::eCompute)))
 		{
 			vulkan_transfer_queue_family_idx = i;
 			break;
 		}
 	}
-	vk::Queue vulkan_transfer_queue = vulkan_queues[vulkan_transfer_queue_family_idx.value()][0];
-
-	vk::CommandPool vulkan_graphics_command_pool = vulkan_device.createCommandPool({
-		vk::CommandPoolCreateFlags(vk::CommandPoolCreateFlagBits::eTransient|vk::CommandPoolCreateFlagBits::eResetCommandBuffer),
-		static_cast<uint32_t>(vulkan_graphics_queue_family_idx.value()),
-	});
-
-	vk::CommandPool vulkan_transfer_command_pool;
-	if (vulkan_graphics_queue_family_idx != vulkan_transfer_queue_family_idx)
-	{
-		vulkan_transfer_command_pool = vulkan_device.createCommandPool({
-			vk::CommandPoolCreateFlags(),
-			static_cast<uint32_t>(vulkan_transfer_queue_family_idx.value()),
-		});
-	}
-	else
+	if (!vulkan_transfer_queue_family_idx)
 	{
-		vulkan_transfer_command_pool = vulkan_graphics_command_pool;
+		vulkan_transfer_queue_family_idx = vulkan_graphics_queue_family_idx;
 	}
+	// If the transfer queue family is the graphics queue family, use a second queue from it if there is one.
+	vk::Queue vulkan_transfer_queue = vulkan_queues[vulkan_transfer_queue_family_idx.value()].size() > 1 && 
+		vulkan_transfer_queue_family_idx == vulkan_graphics_queue_family_idx ? 
+		vulkan_queues[vulkan_transfer_queue_family_idx.value()][1] : 
+		vulkan_queues[vulkan_transfer_queue_family_idx.value()][0];
+
+	// In headless mode, the render targets are offscreen images that get allocated along with everything else.
+	// Otherwise, they are the swapchain images.
+	uint32_t client_width = 0;
+	uint32_t client_height = 0;
+	// Only used in headless mode. Every headless frame advances by the same amount, so that dumps are reproducible.
+	float fixed_dt = 0.0f;
+	vk::Format vulkan_format = vk::Format::eUndefined;
+	vk::Extent2D vulkan_render_extent;
+	vk::SurfaceKHR vulkan_surface;
+	std::optional<size_t> vulkan_present_queue_family_idx;
+	vk::Queue vulkan_present_queue;
+	vk::SwapchainKHR vulkan_swapchain;
+	vk::PresentModeKHR vulkan_swapchain_present_mode = options.present_mode;
+	std::vector<vk::Image> vulkan_render_target_images;
+	std::vector<vk::ImageView> vulkan_render_target_image_views;
+#if BASED_RENDERER_WIN32
+	HWND win32_window = nullptr;
+#endif
 
-	HMONITOR win32_monitor = MonitorFromPoint({0, 0}, MONITOR_DEFAULTTOPRIMARY);
-	MONITORINFO monitor_info {sizeof(MONITORINFO)};
-	if (!GetMonitorInfoW(win32_monitor, &monitor_info)) 
+	if (options.headless)
 	{
-		throw win32_system_error();
+		client_width = options.width;
+		client_height = options.height;
+		fixed_dt = 1.0f/60.0f;
+		vulkan_format = vk::Format::eR8G8B8A8Unorm;
+		vulkan_render_extent = vk::Extent2D{client_width, client_height};
+		vulkan_render_target_images.resize(options.frames_in_flight);
+		vulkan_render_target_image_views.resize(options.frames_in_flight);
 	}
-	int32_t monitor_width = monitor_info.rcMonitor.right - monitor_info.rcMonitor.left;
-	int32_t monitor_height = monitor_info.rcMonitor.bottom - monitor_info.rcMonitor.top;
-
-	WNDCLASSEXW win32_window_class{
-		.cbSize = sizeof(WNDCLASSEXW),
-		.style = 0,
-		.lpfnWndProc = win32_event_callback,
-		.cbClsExtra = 0,
-		.cbWndExtra = 0,
-		.hInstance = win32_instance,
-		.hIcon = nullptr,
-		.hCursor = nullptr,
-		.hbrBackground = nullptr,
-		.lpszMenuName = nullptr,
-		.lpszClassName = L"based_renderer",
-		.hIconSm = nullptr,
-	};
-	if (!RegisterClassExW(&win32_window_class))
+	else
 	{
-		throw win32_system_error();
-	}
+#if BASED_RENDERER_WIN32
+		HMONITOR win32_monitor = MonitorFromPoint({0, 0}, MONITOR_DEFAULTTOPRIMARY);
+		MONITORINFO monitor_info {sizeof(MONITORINFO)};
+		if (!GetMonitorInfoW(win32_monitor, &monitor_info)) 
+		{
+			throw win32_system_error();
+		}
+		int32_t monitor_width = monitor_info.rcMonitor.right - monitor_info.rcMonitor.left;
+		int32_t monitor_height = monitor_info.rcMonitor.bottom - monitor_info.rcMonitor.top;
+
+		WNDCLASSEXW win32_window_class{
+			.cbSize = sizeof(WNDCLASSEXW),
+			.style = 0,
+			.lpfnWndProc = win32_event_callback,
+			.cbClsExtra = 0,
+			.cbWndExtra = 0,
+			.hInstance = win32_instance,
+			.hIcon = nullptr,
+			.hCursor = nullptr,
+			.hbrBackground = nullptr,
+			.lpszMenuName = nullptr,
+			.lpszClassName = L"based_renderer",
+			.hIconSm = nullptr,
+		};
+		if (!RegisterClassExW(&win32_window_class))
+		{
+			throw win32_system_error();
+		}
 
-	RECT win32_client_rect;
-	DWORD win32_window_styles;
-	DWORD win32_window_styles_ex;
+		RECT win32_client_rect;
+		DWORD win32_window_styles;
+		DWORD win32_window_styles_ex;
 #if !BASED_RENDERER_FULLSCREEN
-	win32_client_rect = RECT{
-		.left = monitor_width/4,
-		.top = monitor_height/4,
-		.right = monitor_width*3/4,
-		.bottom = monitor_height*3/4,
-	};
-	win32_window_styles = WS_OVERLAPPED|WS_CAPTION|WS_SYSMENU;
-	win32_window_styles_ex = 0;
+		win32_client_rect = RECT{
+			.left = monitor_width/4,
+			.top = monitor_height/4,
+			.right = monitor_width*3/4,
+			.bottom = monitor_height*3/4,
+		};
+		win32_window_styles = WS_OVERLAPPEDWINDOW;
+		win32_window_styles_ex = 0;
 #else
-	win32_window_styles = WS_POPUP;
-	win32_client_rect = RECT{
-		.left = 0,
-		.top = 0,
-		.right = monitor_width,
-		.bottom = monitor_height,
-	};
-	win32_window_styles_ex = WS_EX_TOPMOST;
+		win32_window_styles = WS_POPUP;
+		win32_client_rect = RECT{
+			.left = 0,
+			.top = 0,
+			.right = monitor_width,
+			.bottom = monitor_height,
+		};
+		win32_window_styles_ex = WS_EX_TOPMOST;
 #endif
-	RECT win32_window_rect = win32_client_rect;
-	if (!AdjustWindowRectEx(&win32_window_rect, win32_window_styles, false, win32_window_styles_ex))
-	{
-		throw win32_system_error();
-	}
-
-	HWND win32_window = CreateWindowExW(
-		win32_window_styles_ex,
-		L"based_renderer",
-		L"based_renderer",
-		win32_window_styles,
-		win32_window_rect.left,
-		win32_window_rect.top,
-		win32_window_rect.right - win32_window_rect.left,
-		win32_window_rect.bottom - win32_window_rect.top,
-		nullptr,
-		nullptr,
-		win32_instance,
-		nullptr
-	);
-	if (!win32_window)
-	{
-		throw win32_system_error();
-	}
+		RECT win32_window_rect = win32_client_rect;
+		if (!AdjustWindowRectEx(&win32_window_rect, win32_window_styles, false, win32_window_styles_ex))
+		{
+			throw win32_system_error();
+		}
 
-	uint32_t client_width = static_cast<uint32_t>(win32_client_rect.right - win32_client_rect.left);
-	uint32_t client_height = static_cast<uint32_t>(win32_client_rect.bottom - win32_client_rect.top);
+		win32_window = CreateWindowExW(
+			win32_window_styles_ex,
+			L"based_renderer",
+			L"based_renderer",
+			win32_window_styles,
+			win32_window_rect.left,
+			win32_window_rect.top,
+			win32_window_rect.right - win32_window_rect.left,
+			win32_window_rect.bottom - win32_window_rect.top,
+			nullptr,
+			nullptr,
+			win32_instance,
+			nullptr
+		);
+		if (!win32_window)
+		{
+			throw win32_system_error();
+		}
 
-    DEVMODEW win32_dev_mode = DEVMODEW{sizeof(DEVMODEW)};
-    if (!EnumDisplaySettingsW(nullptr, ENUM_CURRENT_SETTINGS, &win32_dev_mode))
-    {
-    	throw win32_system_error();
-    }
-    float const fixed_dt = 1.0f/static_cast<float>(win32_dev_mode.dmDisplayFrequency);
+		client_width = static_cast<uint32_t>(win32_client_rect.right - win32_client_rect.left);
+		client_height = static_cast<uint32_t>(win32_client_rect.bottom - win32_client_rect.top);
 
-	vk::SurfaceKHR vulkan_surface = vulkan_instance.createWin32SurfaceKHR({
-		{},
-		win32_instance,
-		win32_window,
-	});
+		vulkan_surface = vulkan_instance.createWin32SurfaceKHR({
+			{},
+			win32_instance,
+			win32_window,
+		});
 
-	std::optional<size_t> vulkan_present_queue_family_idx;
-	for (size_t i = 0; i < vulkan_queue_family_properties.size(); ++i)
-	{
-		if (vulkan_physical_device.getSurfaceSupportKHR(static_cast<uint32_t>(i), vulkan_surface))
+		for (size_t i = 0; i < vulkan_queue_family_properties.size(); ++i)
 		{
-			vulkan_present_queue_family_idx = i;
-			break;
+			if (vulkan_physical_device.getSurfaceSupportKHR(static_cast<uint32_t>(i), vulkan_surface))
+			{
+				vulkan_present_queue_family_idx = i;
+				break;
+			}
 		}
-	}
-	vk::Queue vulkan_present_queue = vulkan_queues[vulkan_present_queue_family_idx.value()][0];
+		vulkan_present_queue = vulkan_queues[vulkan_present_queue_family_idx.value()][0];
 
-	auto vulkan_surface_formats = vulkan_physical_device.getSurfaceFormatsKHR(vulkan_surface);
-	vk::Format vulkan_format = vulkan_surface_formats.front().format; // TODO
+		auto vulkan_surface_formats = vulkan_physical_device.getSurfaceFormatsKHR(vulkan_surface);
+		vulkan_format = vulkan_surface_formats.front().format; // TODO
 
-	auto vulkan_surface_capabilities = vulkan_physical_device.getSurfaceCapabilitiesKHR(vulkan_surface);
-
-	vk::Extent2D vulkan_swapchain_extent;
-	vulkan_swapchain_extent.width  = std::clamp(
-		client_width, 
-		vulkan_surface_capabilities.minImageExtent.width, 
-		vulkan_surface_capabilities.maxImageExtent.width
-	);
-	vulkan_swapchain_extent.height = std::clamp(
-		client_height, 
-		vulkan_surface_capabilities.minImageExtent.height, 
-		vulkan_surface_capabilities.maxImageExtent.height
-	);
+		// FIFO is the only present mode that has to be supported.
+		std::vector<vk::PresentModeKHR> vulkan_surface_present_modes = vulkan_physical_device.getSurfacePresentModesKHR(vulkan_surface);
+		if (std::find(vulkan_surface_present_modes.begin(), vulkan_surface_present_modes.end(), vulkan_swapchain_present_mode) == vulkan_surface_present_modes.end())
+		{
+			dprint("Present mode {} isn't supported, falling back to FIFO.\n", vk::to_string(vulkan_swapchain_present_mode));
+			vulkan_swapchain_present_mode = vk::PresentModeKHR::eFifo;
+		}
 
-	vk::PresentModeKHR vulkan_swapchain_present_mode = vk::PresentModeKHR::eFifo; // TODO
+		vk::SwapchainCreateInfoKHR vulkan_swapchain_create_info = vulkan_get_swapchain_create_info(
+			vulkan_physical_device,
+			vulkan_surface,
+			vulkan_format,
+			vulkan_swapchain_present_mode,
+			vk::Extent2D{client_width, client_height},
+			nullptr
+		);
+		vulkan_render_extent = vulkan_swapchain_create_info.imageExtent;
 
-	vk::SurfaceTransformFlagBitsKHR vulkan_pre_transform = 
-		(vulkan_surface_capabilities.supportedTransforms & vk::SurfaceTransformFlagBitsKHR::eIdentity) ? 
-		vk::SurfaceTransformFlagBitsKHR::eIdentity : 
-		vulkan_surface_capabilities.currentTransform;
+		std::array<uint32_t, 2> vulkan_queue_family_indices{
+			static_cast<uint32_t>(vulkan_graphics_queue_family_idx.value()),
+			static_cast<uint32_t>(vulkan_transfer_queue_family_idx.value())
+		};
 
-	vk::CompositeAlphaFlagBitsKHR vulkan_composite_alpha = 
-		(vulkan_surface_capabilities.supportedCompositeAlpha & vk::CompositeAlphaFlagBitsKHR::ePreMultiplied) ? 
-			vk::CompositeAlphaFlagBitsKHR::ePreMultiplied : 
-			(vulkan_surface_capabilities.supportedCompositeAlpha & vk::CompositeAlphaFlagBitsKHR::ePostMultiplied) ? 
-				vk::CompositeAlphaFlagBitsKHR::ePostMultiplied : 
-				(vulkan_surface_capabilities.supportedCompositeAlpha & vk::CompositeAlphaFlagBitsKHR::eInherit) ? 
-					vk::CompositeAlphaFlagBitsKHR::eInherit : 
-					vk::CompositeAlphaFlagBitsKHR::eOpaque;
+	// TODO: Could this ever be a good idea?
+#if 0
+		if (vulkan_graphics_queue_family_idx != vulkan_transfer_queue_family_idx)
+		{
+			vulkan_swapchain_create_info.imageSharingMode = vk::SharingMode::eConcurrent;
+			vulkan_swapchain_create_info.queueFamilyIndexCount = static_cast<uint32_t>(vulkan_queue_family_indices.size());
+			vulkan_swapchain_create_info.pQueueFamilyIndices = vulkan_queue_family_indices.data();
+		}
+#endif
 
-	vk::SwapchainCreateInfoKHR vulkan_swapchain_create_info{
-		vk::SwapchainCreateFlagsKHR(),
-		vulkan_surface,
-		// TODO: Right now, you are still basically assuming that the image count will be 2.
-		// IIRC, having an image count higher than two actually complicates synchronization somewhat.
-		// I might be wrong though. In any case, it's worth looking into.
-		std::clamp(2u, vulkan_surface_capabilities.minImageCount, vulkan_surface_capabilities.maxImageCount),
-		vulkan_format,
-		vk::ColorSpaceKHR::eSrgbNonlinear,
-		vulkan_swapchain_extent,
-		1,
-		vk::ImageUsageFlagBits::eColorAttachment,
-		vk::SharingMode::eExclusive,
-		{},
-		vulkan_pre_transform,
-		vulkan_composite_alpha,
-		vulkan_swapchain_present_mode,
-		true,
-		nullptr,
-	};
+		vulkan_swapchain = vulkan_device.createSwapchainKHR(vulkan_swapchain_create_info);
 
-	std::array<uint32_t, 2> vulkan_queue_family_indices{
-		static_cast<uint32_t>(vulkan_graphics_queue_family_idx.value()),
-		static_cast<uint32_t>(vulkan_transfer_queue_family_idx.value())
-	};
+		vulkan_render_target_images = vulkan_device.getSwapchainImagesKHR(vulkan_swapchain);
+		vulkan_render_target_image_views = vulkan_create_swapchain_image_views(vulkan_device, vulkan_render_target_images, vulkan_format);
+#else
+		throw std::logic_error{FORMAT_ERROR("There is no window system to render to on this system. Run with --headless.")};
+#endif
+	}
 
-// TODO: Could this ever be a good idea?
-#if 0
-	if (vulkan_graphics_queue_family_idx != vulkan_transfer_queue_family_idx)
+	std::vector<VulkanFrame> vulkan_frames{options.frames_in_flight};
+	for (VulkanFrame &frame : vulkan_frames)
 	{
-		vulkan_swapchain_create_info.imageSharingMode = vk::SharingMode::eConcurrent;
-		vulkan_swapchain_create_info.queueFamilyIndexCount = static_cast<uint32_t>(vulkan_queue_family_indices.size());
-		vulkan_swapchain_create_info.pQueueFamilyIndices = vulkan_queue_family_indices.data();
+		// The whole pool gets reset at the start of the frame, which is cheaper than resetting command buffers one by one.
+		frame.command_pool = vulkan_device.createCommandPool({
+			vk::CommandPoolCreateFlags(vk::CommandPoolCreateFlagBits::eTransient),
+			static_cast<uint32_t>(vulkan_graphics_queue_family_idx.value()),
+		});
+		frame.command_buffer = vulkan_device.allocateCommandBuffers({
+			frame.command_pool, 
+			vk::CommandBufferLevel::ePrimary, 
+			1,
+		})[0];
+		// These get re-recorded one by one, and only once in a while.
+		frame.recorded_command_pool = vulkan_device.createCommandPool({
+			vk::CommandPoolCreateFlags(vk::CommandPoolCreateFlagBits::eResetCommandBuffer),
+			static_cast<uint32_t>(vulkan_graphics_queue_family_idx.value()),
+		});
+		// One per job pool thread plus the main thread, since vulkan_record_draws_parallel never starts more jobs than that.
+		frame.recording_command_pools.resize(job_pool.threads.size() + 1);
+		for (vk::CommandPool &command_pool : frame.recording_command_pools)
+		{
+			command_pool = vulkan_device.createCommandPool({
+				vk::CommandPoolCreateFlags(vk::CommandPoolCreateFlagBits::eResetCommandBuffer),
+				static_cast<uint32_t>(vulkan_graphics_queue_family_idx.value()),
+			});
+		}
+		frame.acquire_semaphore = vulkan_device.createSemaphore({});
 	}
-#endif
 
-	vk::SwapchainKHR vulkan_swapchain = vulkan_device.createSwapchainKHR(vulkan_swapchain_create_info);
+	// Frame N signals N + 1 on this once the graphics queue is done with it, so frame N is done once the value is at least N + 1.
+	// Waiting on a value instead of a fence means nothing ever has to be reset, and anything that needs to know
+	// whether a frame is done (like deferred destruction) can just compare against the counter.
+	// The uploader has its own timeline, since a timeline semaphore's value must only ever increase, and two queues signalling
+	// the same one would have no ordering between their signals.
+	vk::SemaphoreTypeCreateInfo vulkan_frame_timeline_type_create_info{
+		vk::SemaphoreType::eTimeline,
+		0,
+	};
+	vk::Semaphore vulkan_frame_timeline = vulkan_device.createSemaphore({{}, &vulkan_frame_timeline_type_create_info});
 
-	std::vector<vk::Image> vulkan_swapchain_images = vulkan_device.getSwapchainImagesKHR(vulkan_swapchain);
+	std::vector<vk::Semaphore> vulkan_present_semaphores = vulkan_create_present_semaphores(vulkan_device, vulkan_render_target_images.size());
 
-	std::vector<vk::ImageView> vulkan_swapchain_image_views;
-	vulkan_swapchain_image_views.reserve(vulkan_swapchain_images.size());
-	vk::ImageViewCreateInfo vulkan_image_view_create_info{
-		{}, 
-		{},
-		vk::ImageViewType::e2D, 
-		vulkan_format, 
-		{}, 
-		{vk::ImageAspectFlagBits::eColor, 0, 1, 0, 1}
-	};
-	for (vk::Image image : vulkan_swapchain_images)
+	// Without a path to write to, there is no point in profiling, so the profiler stays empty and does nothing.
+	VulkanProfiler vulkan_profiler{};
+	if (options.gpu_profile_path)
 	{
-		vulkan_image_view_create_info.image = image;
-		vulkan_swapchain_image_views.push_back(vulkan_device.createImageView(vulkan_image_view_create_info));
+		vulkan_profiler = vulkan_profiler_create(
+			vulkan_device,
+			vulkan_frames.size(),
+			std::get<0>(vulkan_physical_device_properties).properties.limits.timestampPeriod,
+			vulkan_queue_family_properties[vulkan_graphics_queue_family_idx.value()].timestampValidBits
+		);
 	}
 
-	std::vector<vk::CommandBuffer> vulkan_graphics_command_buffers = vulkan_device.allocateCommandBuffers({
-		vulkan_graphics_command_pool, 
-		vk::CommandBufferLevel::ePrimary, 
-		static_cast<uint32_t>(vulkan_swapchain_images.size()),
-	});
-
-	vk::CommandBuffer vulkan_transfer_command_buffer;
-	if (vulkan_graphics_command_pool != vulkan_transfer_command_pool)
+	// Nothing uses stencil, and the depth format has to work as an attachment and for sampling, which building the Hi-Z pyramid needs.
+	// D32 is the most precise, but not every device supports it. D16 is the only one the spec guarantees.
+	std::array<vk::Format, 2> const vulkan_depth_stencil_format_candidates{
+		vk::Format::eD32Sfloat,
+		vk::Format::eD16Unorm,
+	};
+	vk::FormatFeatureFlags const vulkan_depth_stencil_format_features = 
+		vk::FormatFeatureFlagBits::eDepthStencilAttachment|vk::FormatFeatureFlagBits::eSampledImage;
+	vk::Format vulkan_depth_stencil_format = vk::Format::eUndefined;
+	for (vk::Format format : vulkan_depth_stencil_format_candidates)
 	{
-		std::vector<vk::CommandBuffer> v = vulkan_device.allocateCommandBuffers({
-			vulkan_transfer_command_pool, 
-			vk::CommandBufferLevel::ePrimary, 
-			1,
-		});
-		vulkan_transfer_command_buffer = v[0];
+		vk::FormatProperties format_properties = vulkan_physical_device.getFormatProperties(format);
+		if ((format_properties.optimalTilingFeatures&vulkan_depth_stencil_format_features) == vulkan_depth_stencil_format_features)
+		{
+			vulkan_depth_stencil_format = format;
+			break;
+		}
 	}
-	else
+	if (vulkan_depth_stencil_format == vk::Format::eUndefined)
 	{
-		// Just don't use the transfer command buffer then!
+		throw vk::FormatNotSupportedError{FORMAT_ERROR("No supported depth format.")};
 	}
 
-	std::vector<vk::Fence> vulkan_fences{vulkan_swapchain_images.size()};
-	for (vk::Fence &fence : vulkan_fences) 
+	bool vulkan_occlusion_culling = vulkan_gpu_culling && options.occlusion_culling;
+
+	// Tightly packed RGBA8, which is what the headless render targets use.
+	vk::DeviceSize vulkan_readback_size = static_cast<vk::DeviceSize>(client_width)*client_height*4;
+
+	// Each frame in flight gets its own region of the uniform buffer.
+	vk::DeviceSize vulkan_uniform_ring_region_size = align_forward(
+		BASED_RENDERER_VULKAN_UNIFORM_RING_REGION_SIZE, 
+		std::get<0>(vulkan_physical_device_properties).properties.limits.minUniformBufferOffsetAlignment);
+
+	// Created before anything gets allocated, since with a descriptor buffer, the layout decides how big the buffer has to be.
+	BENCH_BEGIN(bindless_table_creation);
+	TRACE_BEGIN(bindless_table_creation);
+	VulkanBindlessTable vulkan_bindless_table = vulkan_bindless_table_create(
+		vulkan_device, 
+		std::get<0>(vulkan_physical_device_properties).properties.limits,
+		std::get<2>(vulkan_physical_device_properties),
+		vulkan_descriptor_buffer_properties ? &*vulkan_descriptor_buffer_properties : nullptr,
+		vulkan_dispatch);
+	BENCH_END(bindless_table_creation);
+	TRACE_END(bindless_table_creation);
+
+	std::vector<vk::BufferCreateInfo> vulkan_buffer_create_infos;
+	size_t vulkan_uniform_buffer_idx = vulkan_buffer_create_infos.size();
+	vulkan_buffer_create_infos.push_back(vk::BufferCreateInfo{
+		vk::BufferCreateFlags{},
+		vulkan_uniform_ring_region_size*vulkan_frames.size(),
+		vk::BufferUsageFlagBits::eUniformBuffer|vk::BufferUsageFlagBits::eShaderDeviceAddress,
+	});
+
+	// Being nothing but a transfer source is what puts it in host visible memory.
+	size_t vulkan_staging_ring_buffer_idx = vulkan_buffer_create_infos.size();
+	vulkan_buffer_create_infos.push_back(vk::BufferCreateInfo{
+		vk::BufferCreateFlags{},
+		BASED_RENDERER_VULKAN_STAGING_RING_SIZE,
+		vk::BufferUsageFlagBits::eTransferSrc,
+	});
+
+	size_t vulkan_cube_vertex_buffer_idx = vulkan_buffer_create_infos.size();
+	vulkan_buffer_create_infos.push_back(vk::BufferCreateInfo{
+		vk::BufferCreateFlags{},
+		sizeof(cube_vertices),
+		vk::BufferUsageFlagBits::eTransferDst|vk::BufferUsageFlagBits::eStorageBuffer|vk::BufferUsageFlagBits::eShaderDeviceAddress,
+	});
+
+	size_t vulkan_cube_index_buffer_idx = vulkan_buffer_create_infos.size();
+	vulkan_buffer_create_infos.push_back(vk::BufferCreateInfo{
+		vk::BufferCreateFlags{},
+		sizeof(cube_indices),
+		vk::BufferUsageFlagBits::eTransferDst|vk::BufferUsageFlagBits::eIndexBuffer,
+	});
+
+	size_t vulkan_instance_buffer_idx = vulkan_buffer_create_infos.size();
+	vulkan_buffer_create_infos.push_back(vk::BufferCreateInfo{
+		vk::BufferCreateFlags{},
+		options.instance_count*sizeof(glm::mat4),
+		vk::BufferUsageFlagBits::eTransferDst|vk::BufferUsageFlagBits::eStorageBuffer|vk::BufferUsageFlagBits::eShaderDeviceAddress,
+	});
+
+	// One region per frame in flight, each big enough for every instance. See vulkan_instances_stage.
+	vk::DeviceSize vulkan_instance_staging_region_size = options.instance_count*sizeof(glm::mat4);
+	size_t vulkan_instance_staging_buffer_idx = vulkan_buffer_create_infos.size();
+	vulkan_buffer_create_infos.push_back(vk::BufferCreateInfo{
+		vk::BufferCreateFlags{},
+		vulkan_instance_staging_region_size*vulkan_frames.size(),
+		vk::BufferUsageFlagBits::eTransferSrc,
+	});
+
+	// What the culling shader writes: one draw per cube that survived, and how many of them there are.
+	// Frames don't need their own copies, since each frame's culling runs on the same queue after the last frame's draws.
+	size_t vulkan_cull_draw_buffer_idx = vulkan_buffer_create_infos.size();
+	vulkan_buffer_create_infos.push_back(vk::BufferCreateInfo{
+		vk::BufferCreateFlags{},
+		options.instance_count*sizeof(vk::DrawIndexedIndirectCommand),
+		vk::BufferUsageFlagBits::eStorageBuffer|vk::BufferUsageFlagBits::eShaderDeviceAddress|vk::BufferUsageFlagBits::eIndirectBuffer,
+	});
+	size_t vulkan_cull_draw_count_buffer_idx = vulkan_buffer_create_infos.size();
+	vulkan_buffer_create_infos.push_back(vk::BufferCreateInfo{
+		vk::BufferCreateFlags{},
+		sizeof(uint32_t),
+		vk::BufferUsageFlagBits::eTransferDst|vk::BufferUsageFlagBits::eStorageBuffer|vk::BufferUsageFlagBits::eShaderDeviceAddress|vk::BufferUsageFlagBits::eIndirectBuffer,
+	});
+
+	// One readback buffer per frame in flight, so that reading back one frame never waits on the frame after it.
+	size_t vulkan_readback_buffer_idx = vulkan_buffer_create_infos.size();
+	if (options.headless)
 	{
-		fence = vulkan_device.createFence({{vk::FenceCreateFlagBits::eSignaled}});
+		for (size_t i = 0; i < vulkan_frames.size(); ++i)
+		{
+			vulkan_buffer_create_infos.push_back(vk::BufferCreateInfo{
+				vk::BufferCreateFlags{},
+				vulkan_readback_size,
+				vk::BufferUsageFlagBits::eTransferDst,
+			});
+		}
 	}
 
-	std::vector<vk::Semaphore> vulkan_semaphores_wait{vulkan_swapchain_images.size()};
-	std::vector<vk::Semaphore> vulkan_semaphores_signal{vulkan_swapchain_images.size()};
-	for (size_t i = 0; i < vulkan_swapchain_images.size(); ++i)
+	// Only with a descriptor buffer. Frames don't need their own copies, since each frame's depth descriptor already has its own slot.
+	size_t vulkan_bindless_buffer_idx = vulkan_buffer_create_infos.size();
+	if (vulkan_bindless_table.descriptor_buffer)
 	{
-		vulkan_semaphores_wait[i] = vulkan_device.createSemaphore({});
-		vulkan_semaphores_signal[i] = vulkan_device.createSemaphore({});
+		vulkan_buffer_create_infos.push_back(vk::BufferCreateInfo{
+			vk::BufferCreateFlags{},
+			vulkan_bindless_table.buffer_size,
+			vulkan_bindless_descriptor_buffer_usage,
+		});
 	}
 
-	vk::Format vulkan_depth_stencil_format = vk::Format::eD24UnormS8Uint; // TODO: Check for different formats.
-
-	size_t vulkan_uniform_buffer_idx = 0;
-	std::array<vk::BufferCreateInfo, 1> vulkan_buffer_create_infos;
-	vulkan_buffer_create_infos[vulkan_uniform_buffer_idx] = vk::BufferCreateInfo{
-		vk::BufferCreateFlags{},
-		sizeof(Uniforms),
-		vk::BufferUsageFlagBits::eTransferDst|vk::BufferUsageFlagBits::eUniformBuffer,
-	};
-
-	size_t vulkan_depth_stencil_image_idx = 0;
-	std::array<vk::ImageCreateInfo, 1> vulkan_image_create_infos;
-	vulkan_image_create_infos[0] = vk::ImageCreateInfo{
+	// Kept around, since the depth stencil image gets reallocated whenever the swapchain gets recreated.
+	vk::ImageCreateInfo vulkan_depth_stencil_image_create_info{
 		vk::ImageCreateFlags{},
 		vk::ImageType::e2D,
 		vulkan_depth_stencil_format, 
-		vk::Extent3D{client_width, client_height, 1},
+		vk::Extent3D{vulkan_render_extent.width, vulkan_render_extent.height, 1},
 		1,
 		1,
 		vk::SampleCountFlagBits::e1,
 		vk::ImageTiling::eOptimal,
-		vk::ImageUsageFlagBits::eDepthStencilAttachment,
+		vk::ImageUsageFlagBits::eDepthStencilAttachment|vk::ImageUsageFlagBits::eSampled,
 	};
 
-	std::array<VulkanBufferAllocation, vulkan_buffer_create_infos.size()> vulkan_buffer_allocations{};
-	std::array<VulkanImageAllocation, vulkan_image_create_infos.size()> vulkan_image_allocations{};
+	std::vector<vk::ImageCreateInfo> vulkan_image_create_infos;
+	size_t vulkan_depth_stencil_image_idx = vulkan_image_create_infos.size();
+	vulkan_image_create_infos.push_back(vulkan_depth_stencil_image_create_info);
+
+	// Stays in the general layout for its whole life, since it gets written and read one level at a time.
+	size_t vulkan_hiz_image_idx = vulkan_image_create_infos.size();
+	vulkan_image_create_infos.push_back(vk::ImageCreateInfo{
+		vk::ImageCreateFlags{},
+		vk::ImageType::e2D,
+		vk::Format::eR32Sfloat,
+		vk::Extent3D{BASED_RENDERER_HIZ_SIZE, BASED_RENDERER_HIZ_SIZE, 1},
+		BASED_RENDERER_HIZ_LEVEL_COUNT,
+		1,
+		vk::SampleCountFlagBits::e1,
+		vk::ImageTiling::eOptimal,
+		vk::ImageUsageFlagBits::eSampled|vk::ImageUsageFlagBits::eStorage|vk::ImageUsageFlagBits::eTransferDst,
+	});
+
+	size_t vulkan_render_target_image_idx = vulkan_image_create_infos.size();
+	if (options.headless)
+	{
+		for (size_t i = 0; i < vulkan_render_target_images.size(); ++i)
+		{
+			vulkan_image_create_infos.push_back(vk::ImageCreateInfo{
+				vk::ImageCreateFlags{},
+				vk::ImageType::e2D,
+				vulkan_format, 
+				vk::Extent3D{client_width, client_height, 1},
+				1,
+				1,
+				vk::SampleCountFlagBits::e1,
+				vk::ImageTiling::eOptimal,
+				vk::ImageUsageFlagBits::eColorAttachment|vk::ImageUsageFlagBits::eTransferSrc,
+			});
+		}
+	}
+
+	std::vector<VulkanBufferAllocation> vulkan_buffer_allocations{vulkan_buffer_create_infos.size()};
+	std::vector<VulkanImageAllocation> vulkan_image_allocations{vulkan_image_create_infos.size()};
+	// Lives for as long as the device does. Everything allocated later, like streamed resources, comes from here too.
+	VulkanHeap vulkan_heap = vulkan_heap_create(vulkan_device, vulkan_physical_device);
+
+	BENCH_BEGIN(vulkan_allocate);
+	TRACE_BEGIN(vulkan_allocate);
 	vulkan_allocate(
-		vulkan_device, 
-		vulkan_physical_device_memory_properties,
+		vulkan_heap,
 		vulkan_buffer_create_infos,
 		vulkan_image_create_infos,
 		vulkan_buffer_allocations,
 		vulkan_image_allocations
 	);
+	BENCH_END(vulkan_allocate);
+	TRACE_END(vulkan_allocate);
 
 	vk::Buffer vulkan_uniform_buffer = vulkan_buffer_allocations[vulkan_uniform_buffer_idx].handle;
 
+	if (vulkan_bindless_table.descriptor_buffer)
+	{
+		vulkan_bindless_table_set_buffer(vulkan_bindless_table, vulkan_device, vulkan_buffer_allocations[vulkan_bindless_buffer_idx]);
+	}
+
+	// For flushing and invalidating memory that isn't host coherent.
+	vk::DeviceSize const vulkan_non_coherent_atom_size = std::get<0>(vulkan_physical_device_properties).properties.limits.nonCoherentAtomSize;
+
+	VulkanUploader vulkan_uploader = vulkan_uploader_create(
+		vulkan_device,
+		vulkan_transfer_queue,
+		static_cast<uint32_t>(vulkan_transfer_queue_family_idx.value()),
+		static_cast<uint32_t>(vulkan_graphics_queue_family_idx.value()),
+		vulkan_non_coherent_atom_size,
+		vulkan_buffer_allocations[vulkan_staging_ring_buffer_idx]
+	);
+
+	if (options.headless)
+	{
+		for (size_t i = 0; i < vulkan_render_target_images.size(); ++i)
+		{
+			vulkan_render_target_images[i] = vulkan_image_allocations[vulkan_render_target_image_idx + i].handle;
+			vulkan_render_target_image_views[i] = vulkan_device.createImageView({
+				vk::ImageViewCreateFlags{},
+				vulkan_render_target_images[i],
+				vk::ImageViewType::e2D,
+				vulkan_format,
+				vk::ComponentMapping{},
+				vk::ImageSubresourceRange{vk::ImageAspectFlagBits::eColor, 0, 1, 0, 1},
+			});
+		}
+	}
+
 	vk::Image vulkan_depth_stencil_image = vulkan_image_allocations[vulkan_depth_stencil_image_idx].handle;
 
-	vk::ImageView vulkan_depth_stencil_image_view = vulkan_device.createImageView({
+	vk::ImageView vulkan_depth_stencil_image_view = vulkan_create_depth_stencil_image_view(vulkan_device, vulkan_depth_stencil_image, vulkan_depth_stencil_format);
+
+	// One view of the whole pyramid for culling, plus one per level for building it.
+	vk::Image vulkan_hiz_image = vulkan_image_allocations[vulkan_hiz_image_idx].handle;
+	vk::ImageView vulkan_hiz_image_view = vulkan_device.createImageView({
 		vk::ImageViewCreateFlags{},
-		vulkan_depth_stencil_image,
+		vulkan_hiz_image,
 		vk::ImageViewType::e2D,
-		vulkan_depth_stencil_format,
+		vk::Format::eR32Sfloat,
 		vk::ComponentMapping{},
-		vk::ImageSubresourceRange{
-			vk::ImageAspectFlagBits::eDepth|vk::ImageAspectFlagBits::eStencil,
-			0,
-			1,
-			0,
-			1
-		},
+		vk::ImageSubresourceRange{vk::ImageAspectFlagBits::eColor, 0, BASED_RENDERER_HIZ_LEVEL_COUNT, 0, 1},
 	});
+	std::array<vk::ImageView, BASED_RENDERER_HIZ_LEVEL_COUNT> vulkan_hiz_level_image_views;
+	for (uint32_t i = 0; i < BASED_RENDERER_HIZ_LEVEL_COUNT; ++i)
+	{
+		vulkan_hiz_level_image_views[i] = vulkan_device.createImageView({
+			vk::ImageViewCreateFlags{},
+			vulkan_hiz_image,
+			vk::ImageViewType::e2D,
+			vk::Format::eR32Sfloat,
+			vk::ComponentMapping{},
+			vk::ImageSubresourceRange{vk::ImageAspectFlagBits::eColor, i, 1, 0, 1},
+		});
+	}
+	// Starts out as 1, the far plane, so that the first frame, which has nothing to test against yet, doesn't cull anything.
+	bool vulkan_hiz_image_cleared = false;
+
+	VulkanUniformRing vulkan_uniform_ring{
+		.address = vulkan_device.getBufferAddress({vulkan_uniform_buffer}),
+		.mapped = vulkan_buffer_allocations[vulkan_uniform_buffer_idx].heap_allocation.mapped,
+		.region_size = vulkan_uniform_ring_region_size,
+		.align = std::get<0>(vulkan_physical_device_properties).properties.limits.minUniformBufferOffsetAlignment,
+		.region_idx = 0,
+		.head = 0,
+	};
+
+	Uniforms uniforms{};
+	uniforms.occlusion_culling = vulkan_occlusion_culling;
+	SceneInstances scene_instances = scene_instances_create_grid(options.instance_count);
+	float const scene_view_distance = 3.0f*static_cast<float>(scene_grid_side(options.instance_count));
+	// Past the far corner of the grid, however it's rotated. Half the grid's diagonal would do, the whole diagonal leaves some slack.
+	float const scene_far_plane = scene_view_distance + 
+		static_cast<float>(scene_grid_side(options.instance_count))*BASED_RENDERER_SCENE_GRID_SPACING*std::sqrt(3.0f);
+
+	// The first frame's submit waits for this, and nothing waits for it on the CPU.
+	vulkan_uploader_upload_buffer(
+		vulkan_uploader,
+		vulkan_buffer_allocations[vulkan_cube_vertex_buffer_idx],
+		0,
+		cube_vertices.data(),
+		sizeof(cube_vertices),
+		vk::PipelineStageFlagBits2::eVertexShader,
+		vk::AccessFlagBits2::eShaderStorageRead
+	);
+	vulkan_uploader_upload_buffer(
+		vulkan_uploader,
+		vulkan_buffer_allocations[vulkan_cube_index_buffer_idx],
+		0,
+		cube_indices.data(),
+		sizeof(cube_indices),
+		vk::PipelineStageFlagBits2::eIndexInput,
+		vk::AccessFlagBits2::eIndexRead
+	);
+	vulkan_uploader_flush(vulkan_uploader);
+
+	// The uniforms get filled in whenever a frame gets recorded, since every frame has its own.
+	PushConstants vulkan_push_constants{};
+	vulkan_push_constants.vertices = vulkan_device.getBufferAddress({vulkan_buffer_allocations[vulkan_cube_vertex_buffer_idx].handle});
+	vulkan_push_constants.instances = vulkan_device.getBufferAddress({vulkan_buffer_allocations[vulkan_instance_buffer_idx].handle});
+	vulkan_push_constants.draws = vulkan_device.getBufferAddress({vulkan_buffer_allocations[vulkan_cull_draw_buffer_idx].handle});
+	vulkan_push_constants.draw_count = vulkan_device.getBufferAddress({vulkan_buffer_allocations[vulkan_cull_draw_count_buffer_idx].handle});
+	vulkan_push_constants.instance_count = options.instance_count;
+	vulkan_push_constants.hiz = vulkan_bindless_table_add_image(vulkan_device, vulkan_bindless_table, vulkan_bindless_sampled_image_binding, vk::DescriptorImageInfo{
+		vk::Sampler{},
+		vulkan_hiz_image_view,
+		vk::ImageLayout::eGeneral,
+	}, vulkan_dispatch);
+
+	// Every level gets read as the source of the next one, and written as the destination of the one before it.
+	std::array<uint32_t, BASED_RENDERER_HIZ_LEVEL_COUNT> vulkan_hiz_level_sampled_bindless_idxs;
+	std::array<uint32_t, BASED_RENDERER_HIZ_LEVEL_COUNT> vulkan_hiz_level_storage_bindless_idxs;
+	for (uint32_t i = 0; i < BASED_RENDERER_HIZ_LEVEL_COUNT; ++i)
+	{
+		vk::DescriptorImageInfo const vulkan_hiz_level_image_info{
+			vk::Sampler{},
+			vulkan_hiz_level_image_views[i],
+			vk::ImageLayout::eGeneral,
+		};
+		vulkan_hiz_level_sampled_bindless_idxs[i] = vulkan_bindless_table_add_image(
+			vulkan_device, vulkan_bindless_table, vulkan_bindless_sampled_image_binding, vulkan_hiz_level_image_info, vulkan_dispatch);
+		vulkan_hiz_level_storage_bindless_idxs[i] = vulkan_bindless_table_add_image(
+			vulkan_device, vulkan_bindless_table, vulkan_bindless_storage_image_binding, vulkan_hiz_level_image_info, vulkan_dispatch);
+	}
 
-	Uniforms uniforms;
-	if (vulkan_buffer_allocations[vulkan_uniform_buffer_idx].has_staging_buffer()) 
+	// Only reserved here. They get written lazily in the frame loop, see depth_image_bindless_generation.
+	for (VulkanFrame &frame : vulkan_frames)
 	{
-		void *data;
-		vk::DeviceMemory memory = vulkan_buffer_allocations[vulkan_uniform_buffer_idx].staging_buffer.memory;
-		vk::detail::resultCheck(vulkan_device.mapMemory(memory, 0, sizeof(Uniforms), vk::MemoryMapFlags{}, &data), "Failed to map memory!");
-		uniforms.model = glm::rotate(glm::mat4{1}, glm::radians(-55.0f), glm::vec3{1.0f, 0.0f, 0.0f}); 
-		uniforms.view = glm::translate(glm::mat4{1}, glm::vec3{0.0f, 0.0f, -3.0f});
-		uniforms.proj = glm::perspective(glm::radians(45.0f), static_cast<float>(client_width)/static_cast<float>(client_height), 0.1f, 100.0f);
-		std::memcpy(data, &uniforms, sizeof(Uniforms));
-		vulkan_device.unmapMemory(memory);
+		frame.depth_image_bindless_idx = vulkan_bindless_table_reserve(vulkan_bindless_table, vulkan_bindless_sampled_image_binding);
 	}
 
-	std::array<vk::DescriptorSetLayoutBinding, 1> vulkan_descriptor_set_layout_bindings{
-		vk::DescriptorSetLayoutBinding{
+	// The bindless table is the only descriptor set. Everything else comes in through the push constants.
+	std::array<vk::DescriptorSetLayout, 1> const vulkan_descriptor_set_layouts{
+		vulkan_bindless_table.descriptor_set_layout,
+	};
+	std::array<vk::PushConstantRange, 1> const vulkan_push_constant_ranges{
+		vk::PushConstantRange{
+			vulkan_bindless_stages,
 			0,
-			vk::DescriptorType::eUniformBuffer,
-			1,
-			vk::ShaderStageFlagBits::eVertex,
+			sizeof(PushConstants),
 		},
 	};
 
-	std::array<vk::DescriptorSetLayout, 1> vulkan_descriptor_set_layouts{};
-    vulkan_descriptor_set_layouts[0] = vulkan_device.createDescriptorSetLayout(vk::DescriptorSetLayoutCreateInfo{
-    	vk::DescriptorSetLayoutCreateFlags{},
-    	vulkan_descriptor_set_layout_bindings,
-    });
-
-    std::array<vk::DescriptorPoolSize, 1> vulkan_descriptor_pool_sizes{
-    	vk::DescriptorPoolSize{
-    		vk::DescriptorType::eUniformBuffer,
-    		static_cast<uint32_t>(vulkan_swapchain_images.size()),
-    	},
-    };
-
-    vk::DescriptorPool vulkan_descriptor_pool = vulkan_device.createDescriptorPool(vk::DescriptorPoolCreateInfo{
-    	vk::DescriptorPoolCreateFlags{},
-    	static_cast<uint32_t>(vulkan_swapchain_images.size()),
-    	vulkan_descriptor_pool_sizes,
-    });
-
-    std::vector<vk::DescriptorSet> vulkan_descriptor_sets = vulkan_device.allocateDescriptorSets({
-    	vulkan_descriptor_pool,
-    	vulkan_descriptor_set_layouts,
-    });
-
-    std::array<vk::DescriptorBufferInfo, 1> vulkan_descriptor_buffer_infos{
-    	vk::DescriptorBufferInfo{
-    		vulkan_uniform_buffer,
-    		0,
-    		sizeof(Uniforms),
-    	},
-    };
-
-    std::array<vk::WriteDescriptorSet, 1> vulkan_descriptor_writes{
-    	vk::WriteDescriptorSet{
-    		vulkan_descriptor_sets[0],
-    		0, 0,
-    		vk::DescriptorType::eUniformBuffer,
-    		{},
-    		vulkan_descriptor_buffer_infos,
-    	},
-    };
-
-    vulkan_device.updateDescriptorSets(vulkan_descriptor_writes, {});
-
-    vk::PipelineLayout vulkan_pipeline_layout = vulkan_device.createPipelineLayout(vk::PipelineLayoutCreateInfo{
-    	vk::PipelineLayoutCreateFlags{},
-    	vulkan_descriptor_set_layouts,
-    });
-
-	// slang_init
-	Slang::ComPtr<slang::IGlobalSession> slang_global_session;
-	Slang::ComPtr<slang::ISession> slang_session;
-	{
-		using namespace Slang;
-		using namespace slang;
-
-		SlangGlobalSessionDesc global_session_desc{};
-		SLANG_CHECK(createGlobalSession(&global_session_desc, slang_global_session.writeRef()));
-
-		TargetDesc target_desc{
-			.format = SLANG_SPIRV,
-			.profile = slang_global_session->findProfile("glsl_450"),
-			.compilerOptionEntries = nullptr,
-			.compilerOptionEntryCount = 0,
-		};
-
-		std::array<char const*, 1> const search_paths{
-			"src",
-		};
-
-		SessionDesc session_desc{
-			.targets = &target_desc,
-			.targetCount = 1,
-			.defaultMatrixLayoutMode = SLANG_MATRIX_LAYOUT_COLUMN_MAJOR,
-			.searchPaths = search_paths.data(),
-			.searchPathCount = search_paths.size(),
-			.preprocessorMacros = nullptr,
-			.preprocessorMacroCount = 0,
-			.enableEffectAnnotations = false,
-			.compilerOptionEntries = nullptr,
-			.compilerOptionEntryCount = 0,
-#if BASED_RENDERER_SLANG_SPIRV_VALIDATION
-			.skipSPIRVValidation = true,
-#endif
-		};
-		SLANG_CHECK(slang_global_session->createSession(session_desc, slang_session.writeRef()));
-	}
+	vk::PipelineLayout vulkan_pipeline_layout = vulkan_device.createPipelineLayout(vk::PipelineLayoutCreateInfo{
+		vk::PipelineLayoutCreateFlags{},
+		vulkan_descriptor_set_layouts,
+		vulkan_push_constant_ranges,
+	});
 
 	vk::PipelineCacheCreateFlagBits vulkan_pipeline_cache_flag_bits{};
 	if (std::get<3>(vulkan_physical_device_features).pipelineCreationCacheControl)
 	{
 		vulkan_pipeline_cache_flag_bits = vk::PipelineCacheCreateFlagBits::eExternallySynchronized;
 	}
-	vk::PipelineCache vulkan_pipeline_cache = vulkan_device.createPipelineCache(
-		{vulkan_pipeline_cache_flag_bits}
+	vk::PipelineCache vulkan_pipeline_cache = vulkan_pipeline_cache_create(
+		vulkan_device, 
+		vulkan_pipeline_cache_flag_bits, 
+		std::get<0>(vulkan_physical_device_properties).properties
 	);
 
-	Slang::ComPtr<slang::IModule> slang_module;
-	Slang::ComPtr<slang::IBlob> slang_module_diagnostics;
-	slang_module = slang_session->loadModule("cube", slang_module_diagnostics.writeRef());
-	if (slang_module_diagnostics.get())
-	{
-		// TODO: Find a way to get shader compile errors in the Sublime Text console.
-		throw std::runtime_error(
-			FORMAT_ERROR(std::string_view(
-				static_cast<char const *>(slang_module_diagnostics->getBufferPointer()),
-				static_cast<size_t>(slang_module_diagnostics->getBufferSize())
-			))
-		);
-	}
-
-	Slang::ComPtr<slang::IBlob> slang_spirv_code_vs;
-	Slang::ComPtr<slang::IEntryPoint> slang_entry_point_vs;
-	Slang::ComPtr<slang::IComponentType> slang_composed_program_vs;
-	Slang::ComPtr<slang::IComponentType> slang_linked_program_vs;
-	{
-		using namespace Slang;
-		using namespace slang;
-
-		SLANG_CHECK(slang_module->findEntryPointByName("vs", slang_entry_point_vs.writeRef()));
-
-		std::array<IComponentType *, 2> component_types{
-			slang_module,
-			slang_entry_point_vs,
-		};
-		SLANG_CHECK(slang_session->createCompositeComponentType(
-			component_types.data(),
-			component_types.size(),
-			slang_composed_program_vs.writeRef()
-		));
-
-		SLANG_CHECK(slang_composed_program_vs->link(slang_linked_program_vs.writeRef()));
+	// Only measures how long the main thread had to wait, the rest of the shader work overlapped with everything above.
+	BENCH_BEGIN(shader_compile_wait);
+	TRACE_BEGIN(shader_compile_wait);
+	std::vector<std::vector<uint32_t>> slang_spirv_code_cube = slang_spirv_futures[0].get();
+	std::vector<std::vector<uint32_t>> slang_spirv_code_cull = slang_spirv_futures[1].get();
+	std::vector<std::vector<uint32_t>> slang_spirv_code_hiz = slang_spirv_futures[2].get();
+	BENCH_END(shader_compile_wait);
+	TRACE_END(shader_compile_wait);
+	std::vector<uint32_t> const &slang_spirv_code_vs = slang_spirv_code_cube[0];
+	std::vector<uint32_t> const &slang_spirv_code_ps = slang_spirv_code_cube[1];
 
-		SLANG_CHECK(slang_linked_program_vs->getEntryPointCode(
-			0, // entryPointIndex
-			0, // targetIndex
-			slang_spirv_code_vs.writeRef()
-		));
-	}
 	vk::ShaderModule vulkan_vertex_shader_module = vulkan_device.createShaderModule({
 		{},
-		static_cast<uint32_t>(slang_spirv_code_vs->getBufferSize()),
-		static_cast<uint32_t const *>(slang_spirv_code_vs->getBufferPointer()),
+		slang_spirv_code_vs.size()*sizeof(uint32_t),
+		slang_spirv_code_vs.data(),
 	});
 	vk::PipelineShaderStageCreateInfo vulkan_vertex_shader_stage_create_info{
 		{},
@@ -1686,38 +4891,10 @@ static void based_renderer_main()
 		"main",
 	};
 
-	Slang::ComPtr<slang::IBlob> slang_spirv_code_ps;
-	Slang::ComPtr<slang::IEntryPoint> slang_entry_point_ps;
-	Slang::ComPtr<slang::IComponentType> slang_composed_program_ps;
-	Slang::ComPtr<slang::IComponentType> slang_linked_program_ps;
-	{
-		using namespace Slang;
-		using namespace slang;
-
-		SLANG_CHECK(slang_module->findEntryPointByName("ps", slang_entry_point_ps.writeRef()));
-
-		std::array<IComponentType *, 2> component_types{
-			slang_module,
-			slang_entry_point_ps,
-		};
-		SLANG_CHECK(slang_session->createCompositeComponentType(
-			component_types.data(),
-			component_types.size(),
-			slang_composed_program_ps.writeRef()
-		));
-
-		SLANG_CHECK(slang_composed_program_ps->link(slang_linked_program_ps.writeRef()));
-
-		SLANG_CHECK(slang_linked_program_ps->getEntryPointCode(
-			0, // entryPointIndex
-			0, // targetIndex
-			slang_spirv_code_ps.writeRef()
-		));
-	}
 	vk::ShaderModule vulkan_fragment_shader_module = vulkan_device.createShaderModule({
 		{},
-		static_cast<uint32_t>(slang_spirv_code_ps->getBufferSize()),
-		static_cast<uint32_t const *>(slang_spirv_code_ps->getBufferPointer()),
+		slang_spirv_code_ps.size()*sizeof(uint32_t),
+		slang_spirv_code_ps.data(),
 	});
 	vk::PipelineShaderStageCreateInfo vulkan_fragment_shader_stage_create_info{
 		{},
@@ -1750,28 +4927,13 @@ static void based_renderer_main()
 		vk::PrimitiveTopology::eTriangleList,
 	};
 
-	std::array<vk::Viewport, 1> vulkan_viewports{
-		vk::Viewport{
-			0.0f,
-			0.0f,
-			static_cast<float>(vulkan_swapchain_extent.width),
-			static_cast<float>(vulkan_swapchain_extent.height),
-			0.0f,
-			1.0f,
-		},
-	};
-
-	std::array<vk::Rect2D, 1> vulkan_scissors{
-		vk::Rect2D{
-			vk::Offset2D{0, 0},
-			vulkan_swapchain_extent,
-		},
-	};
-
+	// The viewport and scissor are dynamic, so that pipelines don't have to be recreated along with the swapchain.
 	vk::PipelineViewportStateCreateInfo vulkan_pipeline_viewport_state_create_info{
 		vk::PipelineViewportStateCreateFlags{},
-		vulkan_viewports,
-		vulkan_scissors,
+		1,
+		nullptr,
+		1,
+		nullptr,
 	};
 
 	vk::PipelineRasterizationStateCreateInfo vulkan_pipeline_rasterization_state_create_info{
@@ -1789,19 +4951,19 @@ static void based_renderer_main()
 	};
 	vk::PipelineMultisampleStateCreateInfo vulkan_pipeline_multisample_state_create_info{};
 
-	// vk::PipelineDepthStencilStateCreateInfo vulkan_pipeline_depth_stencil_state_create_info{
-	// 	vk::PipelineDepthStencilStateCreateFlags{},
-	// 	vk::True,
-	// 	vk::True,
-	// 	vk::CompareOp::eLess,
-	// 	vk::True,
-	// 	vk::True,
-	// 	vk::StencilOp::eKeep, // TODO
-	// 	vk::StencilOp::eKeep, // TODO
-	// 	0.1f,		// TODO
-	// 	100.0f, 	// TODO
-	// };
-	vk::PipelineDepthStencilStateCreateInfo vulkan_pipeline_depth_stencil_state_create_info{};
+	// After a depth pre-pass, the depth buffer already has the nearest depth of every pixel, so the main pass only has to match it.
+	vk::PipelineDepthStencilStateCreateInfo vulkan_pipeline_depth_stencil_state_create_info{
+		vk::PipelineDepthStencilStateCreateFlags{},
+		vk::True,
+		options.depth_prepass ? vk::False : vk::True,
+		options.depth_prepass ? vk::CompareOp::eLessOrEqual : vk::CompareOp::eLess,
+	};
+	vk::PipelineDepthStencilStateCreateInfo vulkan_depth_prepass_pipeline_depth_stencil_state_create_info{
+		vk::PipelineDepthStencilStateCreateFlags{},
+		vk::True,
+		vk::True,
+		vk::CompareOp::eLess,
+	};
 
 	std::array<vk::PipelineColorBlendAttachmentState, 1> vulkan_pipeline_color_blend_attachment_states{
 		vk::PipelineColorBlendAttachmentState{
@@ -1819,342 +4981,1156 @@ static void based_renderer_main()
 		},
 	};
 
-	vk::PipelineColorBlendStateCreateInfo vulkan_pipeline_color_blend_state_create_info{
-		vk::PipelineColorBlendStateCreateFlags{},
-		{},
-		vk::LogicOp::eClear,
-		vulkan_pipeline_color_blend_attachment_states,
-	};
+	vk::PipelineColorBlendStateCreateInfo vulkan_pipeline_color_blend_state_create_info{
+		vk::PipelineColorBlendStateCreateFlags{},
+		{},
+		vk::LogicOp::eClear,
+		vulkan_pipeline_color_blend_attachment_states,
+	};
+
+	// The depth pre-pass still has the color attachment, since it's in the same render pass, but it doesn't write to it.
+	std::array<vk::PipelineColorBlendAttachmentState, 1> vulkan_depth_prepass_pipeline_color_blend_attachment_states{
+		vk::PipelineColorBlendAttachmentState{},
+	};
+	vk::PipelineColorBlendStateCreateInfo vulkan_depth_prepass_pipeline_color_blend_state_create_info{
+		vk::PipelineColorBlendStateCreateFlags{},
+		{},
+		vk::LogicOp::eClear,
+		vulkan_depth_prepass_pipeline_color_blend_attachment_states,
+	};
+
+	std::array<vk::DynamicState, 2> const vulkan_pipeline_dynamic_states{
+		vk::DynamicState::eViewport,
+		vk::DynamicState::eScissor,
+	};
+
+	vk::PipelineDynamicStateCreateInfo vulkan_pipeline_dynamic_state_create_info{
+		vk::PipelineDynamicStateCreateFlags{},
+		vulkan_pipeline_dynamic_states,
+	};
+
+	std::array<vk::Format const, 1> const vulkan_pipeline_rendering_formats{
+		vulkan_format,
+	};
+
+	vk::PipelineRenderingCreateInfo vulkan_pipeline_rendering_create_info{
+		0,
+		vulkan_pipeline_rendering_formats,
+		vulkan_depth_stencil_format,
+		vk::Format::eUndefined,
+	};
+
+	vk::GraphicsPipelineCreateInfo vulkan_graphics_pipeline_create_info{
+#if BASED_RENDERER_VULKAN_DISABLE_PIPELINE_OPTIMIZATION
+		vk::PipelineCreateFlagBits::eDisableOptimization,
+#else
+		{},
+#endif
+		vulkan_shader_stage_create_infos,
+		&vulkan_vertex_input_state_create_info,
+		&vulkan_pipeline_input_assembly_state_create_info,
+		nullptr,
+		&vulkan_pipeline_viewport_state_create_info,
+		&vulkan_pipeline_rasterization_state_create_info,
+		&vulkan_pipeline_multisample_state_create_info,
+		&vulkan_pipeline_depth_stencil_state_create_info,
+		&vulkan_pipeline_color_blend_state_create_info,
+		&vulkan_pipeline_dynamic_state_create_info,
+		vulkan_pipeline_layout,
+		{},
+		{},
+		{},
+		{},
+		&vulkan_pipeline_rendering_create_info,
+	};
+	if (vulkan_bindless_table.descriptor_buffer)
+	{
+		vulkan_graphics_pipeline_create_info.flags |= vk::PipelineCreateFlagBits::eDescriptorBufferEXT;
+	}
+
+	// No fragment shader, since all it does is write depth.
+	vk::GraphicsPipelineCreateInfo vulkan_depth_prepass_pipeline_create_info = vulkan_graphics_pipeline_create_info;
+	vulkan_depth_prepass_pipeline_create_info.setStages({1, &vulkan_vertex_shader_stage_create_info});
+	vulkan_depth_prepass_pipeline_create_info.pDepthStencilState = &vulkan_depth_prepass_pipeline_depth_stencil_state_create_info;
+	vulkan_depth_prepass_pipeline_create_info.pColorBlendState = &vulkan_depth_prepass_pipeline_color_blend_state_create_info;
+
+	std::vector<vk::GraphicsPipelineCreateInfo> vulkan_graphics_pipeline_create_infos{
+		vulkan_graphics_pipeline_create_info,
+	};
+	if (options.depth_prepass)
+	{
+		vulkan_graphics_pipeline_create_infos.push_back(vulkan_depth_prepass_pipeline_create_info);
+	}
+
+	vk::ShaderModule vulkan_cull_shader_module = vulkan_device.createShaderModule({
+		{},
+		slang_spirv_code_cull[0].size()*sizeof(uint32_t),
+		slang_spirv_code_cull[0].data(),
+	});
+
+	// Like every other pipeline, this one uses vulkan_pipeline_layout, so they all share the bindless table.
+	vk::ComputePipelineCreateInfo vulkan_cull_pipeline_create_info{
+#if BASED_RENDERER_VULKAN_DISABLE_PIPELINE_OPTIMIZATION
+		vk::PipelineCreateFlagBits::eDisableOptimization,
+#else
+		{},
+#endif
+		vk::PipelineShaderStageCreateInfo{
+			{},
+			vk::ShaderStageFlagBits::eCompute,
+			vulkan_cull_shader_module,
+			"main",
+		},
+		vulkan_pipeline_layout,
+	};
+	if (vulkan_bindless_table.descriptor_buffer)
+	{
+		vulkan_cull_pipeline_create_info.flags |= vk::PipelineCreateFlagBits::eDescriptorBufferEXT;
+	}
+
+	vk::ShaderModule vulkan_hiz_downsample_depth_shader_module = vulkan_device.createShaderModule({
+		{},
+		slang_spirv_code_hiz[0].size()*sizeof(uint32_t),
+		slang_spirv_code_hiz[0].data(),
+	});
+	vk::ShaderModule vulkan_hiz_downsample_shader_module = vulkan_device.createShaderModule({
+		{},
+		slang_spirv_code_hiz[1].size()*sizeof(uint32_t),
+		slang_spirv_code_hiz[1].data(),
+	});
+
+	vk::ComputePipelineCreateInfo vulkan_hiz_downsample_depth_pipeline_create_info = vulkan_cull_pipeline_create_info;
+	vulkan_hiz_downsample_depth_pipeline_create_info.stage.module = vulkan_hiz_downsample_depth_shader_module;
+	vk::ComputePipelineCreateInfo vulkan_hiz_downsample_pipeline_create_info = vulkan_cull_pipeline_create_info;
+	vulkan_hiz_downsample_pipeline_create_info.stage.module = vulkan_hiz_downsample_shader_module;
+
+	std::array<vk::ComputePipelineCreateInfo, 3> const vulkan_compute_pipeline_create_infos{
+		vulkan_cull_pipeline_create_info,
+		vulkan_hiz_downsample_depth_pipeline_create_info,
+		vulkan_hiz_downsample_pipeline_create_info,
+	};
+
+	// Indices into vulkan_pipelines. The graphics pipelines come first, then the compute pipelines.
+	// vulkan_depth_prepass_pipeline_idx is only valid with a depth pre-pass.
+	size_t const vulkan_cube_pipeline_idx = 0;
+	size_t const vulkan_depth_prepass_pipeline_idx = 1;
+	size_t const vulkan_cull_pipeline_idx = vulkan_graphics_pipeline_create_infos.size();
+	size_t const vulkan_hiz_downsample_depth_pipeline_idx = vulkan_cull_pipeline_idx + 1;
+	size_t const vulkan_hiz_downsample_pipeline_idx = vulkan_cull_pipeline_idx + 2;
+
+	BENCH_BEGIN(pipeline_creation);
+	TRACE_BEGIN(pipeline_creation);
+	VulkanPipelineBuildResult vulkan_pipeline_build_result = vulkan_create_pipelines<vk::GraphicsPipelineCreateInfo>(
+		job_pool,
+		vulkan_device,
+		vulkan_pipeline_cache,
+		vulkan_pipeline_cache_flag_bits,
+		std::span<vk::GraphicsPipelineCreateInfo const>{vulkan_graphics_pipeline_create_infos}
+	);
+	VulkanPipelineBuildResult vulkan_compute_pipeline_build_result = vulkan_create_pipelines<vk::ComputePipelineCreateInfo>(
+		job_pool,
+		vulkan_device,
+		vulkan_pipeline_cache,
+		vulkan_pipeline_cache_flag_bits,
+		vulkan_compute_pipeline_create_infos
+	);
+	BENCH_END(pipeline_creation);
+	TRACE_END(pipeline_creation);
+	vulkan_pipeline_build_result.pipelines.insert(
+		vulkan_pipeline_build_result.pipelines.end(), 
+		vulkan_compute_pipeline_build_result.pipelines.begin(), 
+		vulkan_compute_pipeline_build_result.pipelines.end());
+	vulkan_pipeline_build_result.cache_hit_count += vulkan_compute_pipeline_build_result.cache_hit_count;
+	vulkan_pipeline_build_result.cache_miss_count += vulkan_compute_pipeline_build_result.cache_miss_count;
+	vulkan_pipeline_build_result.driver_ms += vulkan_compute_pipeline_build_result.driver_ms;
+	std::vector<vk::Pipeline> vulkan_pipelines = vulkan_pipeline_build_result.pipelines;
+
+	dprint("Created {} pipelines ({} pipeline cache hits, {} misses, {:.3f} ms in the driver).\n", 
+		vulkan_pipelines.size(), 
+		vulkan_pipeline_build_result.cache_hit_count, 
+		vulkan_pipeline_build_result.cache_miss_count, 
+		vulkan_pipeline_build_result.driver_ms);
+#if BASED_RENDERER_BENCH
+	bench_results.pipeline_cache_hit_count = vulkan_pipeline_build_result.cache_hit_count;
+	bench_results.pipeline_cache_miss_count = vulkan_pipeline_build_result.cache_miss_count;
+#endif
+
+	// Only gets written back if something new went into it.
+	// Drivers that don't give any feedback count as a miss, since then we can't know.
+	bool vulkan_pipeline_cache_dirty = 
+		vulkan_pipeline_build_result.cache_hit_count < vulkan_pipelines.size();
+
+#if BASED_RENDERER_SHADER_HOT_RELOAD
+	ShaderHotReload shader_hot_reload{};
+	shader_hot_reload.modules = slang_modules;
+	shader_hot_reload.build_pipelines = [&](std::vector<std::vector<std::vector<uint32_t>>> const &spirv)
+	{
+		std::vector<uint32_t> const &spirv_code_vs = spirv[0][0];
+		std::vector<uint32_t> const &spirv_code_ps = spirv[0][1];
+
+		vk::ShaderModule vertex_shader_module = vulkan_device.createShaderModule({
+			{},
+			spirv_code_vs.size()*sizeof(uint32_t),
+			spirv_code_vs.data(),
+		});
+		vk::ShaderModule fragment_shader_module = vulkan_device.createShaderModule({
+			{},
+			spirv_code_ps.size()*sizeof(uint32_t),
+			spirv_code_ps.data(),
+		});
+
+		vk::ShaderModule cull_shader_module = vulkan_device.createShaderModule({
+			{},
+			spirv[1][0].size()*sizeof(uint32_t),
+			spirv[1][0].data(),
+		});
+		vk::ShaderModule hiz_downsample_depth_shader_module = vulkan_device.createShaderModule({
+			{},
+			spirv[2][0].size()*sizeof(uint32_t),
+			spirv[2][0].data(),
+		});
+		vk::ShaderModule hiz_downsample_shader_module = vulkan_device.createShaderModule({
+			{},
+			spirv[2][1].size()*sizeof(uint32_t),
+			spirv[2][1].data(),
+		});
+
+		std::array<vk::PipelineShaderStageCreateInfo, 2> shader_stage_create_infos = vulkan_shader_stage_create_infos;
+		shader_stage_create_infos[0].module = vertex_shader_module;
+		shader_stage_create_infos[1].module = fragment_shader_module;
+
+		vk::GraphicsPipelineCreateInfo graphics_pipeline_create_info = vulkan_graphics_pipeline_create_info;
+		graphics_pipeline_create_info.setStages(shader_stage_create_infos);
+
+		vk::GraphicsPipelineCreateInfo depth_prepass_pipeline_create_info = vulkan_depth_prepass_pipeline_create_info;
+		depth_prepass_pipeline_create_info.setStages({1, &shader_stage_create_infos[0]});
+
+		vk::ComputePipelineCreateInfo cull_pipeline_create_info = vulkan_cull_pipeline_create_info;
+		cull_pipeline_create_info.stage.module = cull_shader_module;
+		vk::ComputePipelineCreateInfo hiz_downsample_depth_pipeline_create_info = vulkan_hiz_downsample_depth_pipeline_create_info;
+		hiz_downsample_depth_pipeline_create_info.stage.module = hiz_downsample_depth_shader_module;
+		vk::ComputePipelineCreateInfo hiz_downsample_pipeline_create_info = vulkan_hiz_downsample_pipeline_create_info;
+		hiz_downsample_pipeline_create_info.stage.module = hiz_downsample_shader_module;
+
+		// The persisted pipeline cache belongs to the render thread, and these pipelines will most likely be thrown away soon anyway.
+		// If anything here throws, whatever got created before it leaks, which is fine for something that only happens while editing shaders.
+		std::vector<vk::Pipeline> pipelines{
+			vulkan_device.createGraphicsPipeline({}, graphics_pipeline_create_info).value,
+		};
+		if (options.depth_prepass)
+		{
+			pipelines.push_back(vulkan_device.createGraphicsPipeline({}, depth_prepass_pipeline_create_info).value);
+		}
+		pipelines.push_back(vulkan_device.createComputePipeline({}, cull_pipeline_create_info).value);
+		pipelines.push_back(vulkan_device.createComputePipeline({}, hiz_downsample_depth_pipeline_create_info).value);
+		pipelines.push_back(vulkan_device.createComputePipeline({}, hiz_downsample_pipeline_create_info).value);
+
+		// Shader modules aren't needed anymore once the pipeline exists.
+		vulkan_device.destroyShaderModule(vertex_shader_module);
+		vulkan_device.destroyShaderModule(fragment_shader_module);
+		vulkan_device.destroyShaderModule(cull_shader_module);
+		vulkan_device.destroyShaderModule(hiz_downsample_depth_shader_module);
+		vulkan_device.destroyShaderModule(hiz_downsample_shader_module);
+
+		// In the same order as vulkan_pipelines.
+		return pipelines;
+	};
+	shader_hot_reload.file_times = slang_file_times();
+	shader_hot_reload.last_poll = std::chrono::steady_clock::now();
+
+	std::vector<VulkanRetiredPipeline> vulkan_retired_pipelines;
+#endif
+
+	// Bumped whenever something that the recorded command buffers depend on changes, like the swapchain or the pipelines 
+	// (or eventually, the scene). Each one gets recorded again the next time it's used.
+	uint64_t vulkan_command_buffer_generation = 1;
+
+	// The instances get split into draw_count draws of (nearly) the same size. One draw is the whole point of instancing,
+	// more than that is there to stress command recording, up to one draw per cube.
+	std::vector<VulkanDraw> vulkan_draws;
+	vulkan_draws.reserve(options.draw_count);
+	for (uint32_t i = 0; i < options.draw_count; ++i)
+	{
+		uint32_t first_instance = static_cast<uint32_t>(static_cast<uint64_t>(options.instance_count)*i/options.draw_count);
+		uint32_t end_instance = static_cast<uint32_t>(static_cast<uint64_t>(options.instance_count)*(i + 1)/options.draw_count);
+		vulkan_draws.push_back(VulkanDraw{
+			static_cast<uint32_t>(cube_indices.size()),
+			end_instance - first_instance,
+			0,
+			0,
+			first_instance,
+		});
+	}
+
+	std::vector<vk::BufferCopy> vulkan_instance_copies;
+
+	// Set when acquiring or presenting says the swapchain doesn't match the surface anymore.
+	bool vulkan_swapchain_out_of_date = false;
+	std::vector<VulkanRetiredSwapchain> vulkan_retired_swapchains;
+
+	size_t vulkan_frame_idx = 0;
+	uint64_t frame_number = 0;
+
+	VulkanPresentLatency vulkan_present_latency;
+	std::chrono::steady_clock::time_point last_frame_start{};
+
+	// The last frame that was read back in headless mode.
+	std::vector<std::byte> headless_frame;
+	if (options.headless)
+	{
+		headless_frame.resize(vulkan_readback_size);
+	}
+
+#if BASED_RENDERER_BENCH
+	bench_results.device_name = std::get<0>(vulkan_physical_device_properties).properties.deviceName.data();
+	bench_results.gpu_culling = vulkan_gpu_culling;
+	bench_results.descriptor_buffer = vulkan_bindless_table.descriptor_buffer;
+	bench_results.frame_ms.reserve(options.frame_count);
+	BenchClock::time_point bench_frame_start{};
+#endif
+
+	BENCH_END(total_startup);
+	TRACE_END(total_startup);
+
+#if BASED_RENDERER_WIN32
+	win32_running = true;
+#endif
+	for (;;) 
+	{
+		if (options.headless)
+		{
+			if (frame_number == options.frame_count) break;
+		}
+#if BASED_RENDERER_WIN32
+		else
+		{
+			if (!win32_running) break;
+
+			MSG win32_message;
+			if (PeekMessageW(&win32_message, win32_window, 0, 0, PM_REMOVE))
+			{
+				TRACE_SCOPE(message_pump);
+				TranslateMessage(&win32_message);
+				DispatchMessageW(&win32_message);
+				continue;
+			}
 
-	vk::PipelineDynamicStateCreateInfo vulkan_pipeline_dynamic_state_create_info{};
+			// Recreating doesn't wait for anything. Frames in flight keep going with the old swapchain, which only gets destroyed
+			// once they're done with it, so a resize costs about as much as creating the new swapchain does.
+			if (vulkan_swapchain_out_of_date || win32_resized)
+			{
+				win32_resized = false;
 
-	std::array<vk::Format const, 1> const vulkan_pipeline_rendering_formats{
-		vulkan_format,
-	};
+				RECT win32_client_rect;
+				if (!GetClientRect(win32_window, &win32_client_rect))
+				{
+					throw win32_system_error();
+				}
+				client_width = static_cast<uint32_t>(win32_client_rect.right - win32_client_rect.left);
+				client_height = static_cast<uint32_t>(win32_client_rect.bottom - win32_client_rect.top);
 
-	vk::PipelineRenderingCreateInfo vulkan_pipeline_rendering_create_info{
-		0,
-		vulkan_pipeline_rendering_formats,
-		vk::Format::eUndefined,
-		vk::Format::eUndefined,
-		// vulkan_depth_stencil_format,
-		// vulkan_depth_stencil_format,
-	};
+				// Minimized. There is nothing to present to, so wait for the window to come back instead of spinning.
+				if (client_width == 0 || client_height == 0)
+				{
+					vulkan_swapchain_out_of_date = true;
+					WaitMessage();
+					continue;
+				}
 
-	vk::GraphicsPipelineCreateInfo vulkan_graphics_pipeline_create_info{
-#if BASED_RENDERER_VULKAN_DISABLE_PIPELINE_OPTIMIZATION
-		vk::PipelineCreateFlagBits::eDisableOptimization,
-#else
-		{},
+				if (vulkan_swapchain_out_of_date || client_width != vulkan_render_extent.width || client_height != vulkan_render_extent.height)
+				{
+					TRACE_SCOPE(swapchain_recreation);
+					vulkan_swapchain_out_of_date = false;
+
+					vk::SwapchainCreateInfoKHR vulkan_swapchain_create_info = vulkan_get_swapchain_create_info(
+						vulkan_physical_device,
+						vulkan_surface,
+						vulkan_format,
+						vulkan_swapchain_present_mode,
+						vk::Extent2D{client_width, client_height},
+						vulkan_swapchain
+					);
+					vk::SwapchainKHR vulkan_new_swapchain = vulkan_device.createSwapchainKHR(vulkan_swapchain_create_info);
+
+					// The last frame that used the old swapchain is the previous one, which signals frame_number. 
+					// Its present can still be waiting on its semaphore after that, and without VK_EXT_swapchain_maintenance1 there is no way 
+					// to know when it's done, so the old swapchain sticks around for another round of frames in flight on top.
+					vulkan_retired_swapchains.push_back(VulkanRetiredSwapchain{
+						vulkan_swapchain,
+						std::move(vulkan_render_target_image_views),
+						std::move(vulkan_present_semaphores),
+						vulkan_image_allocations[vulkan_depth_stencil_image_idx],
+						vulkan_depth_stencil_image_view,
+						frame_number + vulkan_frames.size(),
+					});
+					// Present IDs belong to the swapchain they were presented to.
+					vulkan_present_latency.pending.clear();
+
+					vulkan_swapchain = vulkan_new_swapchain;
+					vulkan_render_extent = vulkan_swapchain_create_info.imageExtent;
+					vulkan_render_target_images = vulkan_device.getSwapchainImagesKHR(vulkan_swapchain);
+					vulkan_render_target_image_views = vulkan_create_swapchain_image_views(vulkan_device, vulkan_render_target_images, vulkan_format);
+					vulkan_present_semaphores = vulkan_create_present_semaphores(vulkan_device, vulkan_render_target_images.size());
+
+					// Only the attachments that depend on the size get reallocated. Everything else stays where it is.
+					vulkan_depth_stencil_image_create_info.extent = vk::Extent3D{vulkan_render_extent.width, vulkan_render_extent.height, 1};
+					vulkan_allocate(
+						vulkan_heap,
+						{},
+						{&vulkan_depth_stencil_image_create_info, 1},
+						{},
+						{&vulkan_image_allocations[vulkan_depth_stencil_image_idx], 1}
+					);
+					vulkan_depth_stencil_image = vulkan_image_allocations[vulkan_depth_stencil_image_idx].handle;
+					vulkan_depth_stencil_image_view = vulkan_create_depth_stencil_image_view(vulkan_device, vulkan_depth_stencil_image, vulkan_depth_stencil_format);
+
+					vulkan_command_buffer_generation += 1;
+
+					dprint("Recreated the swapchain at {}x{}.\n", vulkan_render_extent.width, vulkan_render_extent.height);
+				}
+			}
+		}
 #endif
-		vulkan_shader_stage_create_infos,
-		&vulkan_vertex_input_state_create_info,
-		&vulkan_pipeline_input_assembly_state_create_info,
-		nullptr,
-		&vulkan_pipeline_viewport_state_create_info,
-		&vulkan_pipeline_rasterization_state_create_info,
-		&vulkan_pipeline_multisample_state_create_info,
-		&vulkan_pipeline_depth_stencil_state_create_info,
-		&vulkan_pipeline_color_blend_state_create_info,
-		&vulkan_pipeline_dynamic_state_create_info,
-		vulkan_pipeline_layout,
-		{},
-		{},
-		{},
-		{},
-		&vulkan_pipeline_rendering_create_info,
-	};
 
+		TRACE_BEGIN(frame);
+		
+#if BASED_RENDERER_BENCH
+		// A frame's time is the time from its start to the start of the next one, so time spent waiting on the GPU counts too.
+		{
+			BenchClock::time_point now = BenchClock::now();
+			if (frame_number > options.bench_warmup_frame_count)
+			{
+				bench_results.frame_ms.push_back(std::chrono::duration<double, std::milli>(now - bench_frame_start).count());
+			}
+			bench_frame_start = now;
+		}
+#endif
 
-	auto vulkan_pipelines = *vulkan_device.createGraphicsPipelines(
-		vulkan_pipeline_cache,
+		// Windowed frames advance by however long the last frame actually took, instead of assuming that every frame takes one refresh interval,
+		// which stops being true as soon as the present mode isn't FIFO or a frame gets missed.
+		std::chrono::steady_clock::time_point frame_start = std::chrono::steady_clock::now();
+		float dt = fixed_dt;
+		if (!options.headless)
 		{
-			vulkan_graphics_pipeline_create_info
+			dt = frame_number == 0 ? 0.0f : std::min(std::chrono::duration<float>(frame_start - last_frame_start).count(), BASED_RENDERER_MAX_DT);
 		}
-	);
+		last_frame_start = frame_start;
 
-	size_t vulkan_frame_idx = 0;
+		if (vulkan_present_wait_enabled)
+		{
+			vulkan_present_latency_poll(vulkan_present_latency, vulkan_device, vulkan_swapchain, vulkan_dispatch);
+		}
 
-	win32_running = true;
-	while (win32_running) 
-	{
-		MSG win32_message;
-		if (PeekMessageW(&win32_message, win32_window, 0, 0, PM_REMOVE))
+		VulkanFrame &vulkan_frame = vulkan_frames[vulkan_frame_idx];
+
+		// The last frame that used this frame's resources is the one frames in flight ago.
+		TRACE_BEGIN(wait_for_frame);
+		if (frame_number >= vulkan_frames.size())
 		{
-			TranslateMessage(&win32_message);
-			DispatchMessageW(&win32_message);
-			continue;
+			// Has to be an lvalue, since vk::SemaphoreWaitInfo doesn't take temporaries.
+			uint64_t const wait_value = frame_number + 1 - vulkan_frames.size();
+			vk::detail::resultCheck(vulkan_device.waitSemaphores(
+				{{}, vulkan_frame_timeline, wait_value},
+				std::numeric_limits<uint64_t>::max()), "Failed to wait for frame.");
 		}
-		
-		vk::detail::resultCheck(vulkan_device.waitForFences(
-			{vulkan_fences[vulkan_frame_idx]}, 
-			vk::True, 
-			std::numeric_limits<uint64_t>::max()), "Failed to wait for fence.");
-		vulkan_device.resetFences({vulkan_fences[vulkan_frame_idx]});
-
-		uint32_t vulkan_image_idx = *vulkan_device.acquireNextImageKHR(
-			vulkan_swapchain, 
-			std::numeric_limits<uint64_t>::max(), 
-			vulkan_semaphores_wait[vulkan_frame_idx]
-		);
+		TRACE_END(wait_for_frame);
+		vulkan_device.resetCommandPool(vulkan_frame.command_pool);
 
-		// We only show the window once we've arrived back at the first frame.
-		// This only makes sense if there are just two frames, that is, one backbuffer
-		// and one frontbuffer. Which is to say, it is to be thrown away!
-		if (vulkan_image_idx == 0) 
+		// Frames can finish ahead of what we just waited for, so this asks the semaphore instead.
+		uint64_t vulkan_frame_timeline_value = vulkan_device.getSemaphoreCounterValue(vulkan_frame_timeline);
+		for (size_t i = 0; i < vulkan_retired_swapchains.size();)
 		{
-			static int win32_window_ready = -1;
-			if (win32_window_ready == -1) 
+			VulkanRetiredSwapchain &retired = vulkan_retired_swapchains[i];
+			if (vulkan_frame_timeline_value >= retired.destroy_timeline_value)
 			{
-				win32_window_ready += 1;
-			} 
-			else if (win32_window_ready == 0) 
+				for (vk::ImageView image_view : retired.image_views)
+				{
+					vulkan_device.destroyImageView(image_view);
+				}
+				for (vk::Semaphore semaphore : retired.present_semaphores)
+				{
+					vulkan_device.destroySemaphore(semaphore);
+				}
+				vulkan_device.destroyImageView(retired.depth_stencil_image_view);
+				vulkan_free(vulkan_heap, retired.depth_stencil_image);
+				vulkan_device.destroySwapchainKHR(retired.swapchain);
+				unordered_remove(vulkan_retired_swapchains, i);
+			}
+			else
 			{
-				win32_window_ready += 1;
-				ShowWindow(win32_window, SW_SHOW);
+				++i;
 			}
 		}
 
-		rotate_cube(vulkan_device, vulkan_buffer_allocations[vulkan_uniform_buffer_idx].staging_buffer.memory, uniforms, fixed_dt, static_cast<float>(client_width)/static_cast<float>(client_height));
-
-		vk::CommandBuffer cb = vulkan_graphics_command_buffers[vulkan_frame_idx];
-		cb.begin({
-			vk::CommandBufferUsageFlagBits::eOneTimeSubmit,
-		});
+#if BASED_RENDERER_SHADER_HOT_RELOAD
+		for (size_t i = 0; i < vulkan_retired_pipelines.size();)
+		{
+			if (vulkan_frame_timeline_value >= vulkan_retired_pipelines[i].destroy_timeline_value)
+			{
+				vulkan_device.destroyPipeline(vulkan_retired_pipelines[i].pipeline);
+				unordered_remove(vulkan_retired_pipelines, i);
+			}
+			else
+			{
+				++i;
+			}
+		}
 
-		static size_t staged = 0;
-
-		std::array<vk::BufferMemoryBarrier2, 2> vulkan_buffer_memory_barriers_transfer{
-		    vk::BufferMemoryBarrier2{
-		    	vk::PipelineStageFlags2{},
-		    	vk::AccessFlags2{},
-		    	vk::PipelineStageFlagBits2::eTransfer,
-		    	vk::AccessFlagBits2::eTransferRead,
-		    	0, // TODO
-		    	0, // TODO
-		        vulkan_buffer_allocations[vulkan_uniform_buffer_idx].staging_buffer.handle,
-		        0,
-		        sizeof(Uniforms),
-		    },
-		    vk::BufferMemoryBarrier2{
-	        	vk::PipelineStageFlags2{},
-	        	vk::AccessFlags2{},
-	        	vk::PipelineStageFlagBits2::eTransfer,
-	        	vk::AccessFlagBits2::eTransferWrite,
-	        	0, // TODO
-	        	0, // TODO
-	            vulkan_uniform_buffer,
-	            0,
-	            sizeof(Uniforms),
-		    },
-		};
+		// Swapping only ever happens here, between frames, so a frame never sees two different versions of the shaders.
+		if (std::optional<std::vector<vk::Pipeline>> pipelines = shader_hot_reload_poll(shader_hot_reload, job_pool, slang_compilers))
+		{
+			// The last frame that used the old pipelines was the previous one, which signals frame_number.
+			for (vk::Pipeline pipeline : vulkan_pipelines)
+			{
+				vulkan_retired_pipelines.push_back({pipeline, frame_number});
+			}
+			vulkan_pipelines = std::move(*pipelines);
+			vulkan_command_buffer_generation += 1;
+			dprint("Reloaded shaders.\n");
+		}
+#endif
 
-		std::array<vk::ImageMemoryBarrier2, 1> vulkan_image_memory_barriers_render{
-			vk::ImageMemoryBarrier2{
-				vk::PipelineStageFlags2{vk::PipelineStageFlagBits2::eColorAttachmentOutput},
-				vk::AccessFlags2{},
-				vk::PipelineStageFlags2{vk::PipelineStageFlagBits2::eColorAttachmentOutput},
-				vk::AccessFlags2{vk::AccessFlagBits2::eColorAttachmentWrite},
-				vk::ImageLayout::eUndefined,
-				vk::ImageLayout::eColorAttachmentOptimal,
-				0, // TODO: srcQueueFamilyIdx
-				0, // TODO: dstQueueFamilyIdx
-				vulkan_swapchain_images[vulkan_image_idx],
-				vk::ImageSubresourceRange{
-					vk::ImageAspectFlags{vk::ImageAspectFlagBits::eColor},
-					0,
-					1,
-					0,
-					1,
+		// This frame's previous use is done, so its descriptor can finally point at the current depth image.
+		// Other frames might still be in flight with the table bound, which update-after-bind and descriptor buffers both allow, since they don't use this descriptor.
+		if (vulkan_occlusion_culling && vulkan_frame.depth_image_bindless_generation != vulkan_command_buffer_generation)
+		{
+			vulkan_bindless_table_write_image(
+				vulkan_device, 
+				vulkan_bindless_table, 
+				vulkan_bindless_sampled_image_binding, 
+				vulkan_frame.depth_image_bindless_idx, 
+				vk::DescriptorImageInfo{
+					vk::Sampler{},
+					vulkan_depth_stencil_image_view,
+					vk::ImageLayout::eShaderReadOnlyOptimal,
 				},
-			},
-			// vk::ImageMemoryBarrier2{
-			// 	vk::PipelineStageFlagBits2::eEarlyFragmentTests | vk::PipelineStageFlagBits2::eLateFragmentTests,
-			// 	vk::AccessFlags2{vk::AccessFlagBits2::eDepthStencilAttachmentWrite},
-			// 	vk::PipelineStageFlagBits2::eEarlyFragmentTests | vk::PipelineStageFlagBits2::eLateFragmentTests,
-			// 	vk::AccessFlags2{vk::AccessFlagBits2::eDepthStencilAttachmentWrite},
-			// 	vk::ImageLayout::eUndefined,
-			// 	vk::ImageLayout::eDepthStencilAttachmentOptimal,
-			// 	0, // TODO: srcQueueFamilyIdx
-			// 	0, // TODO: dstQueueFamilyIdx
-			// 	vulkan_depth_stencil_image,
-			// 	vk::ImageSubresourceRange{
-			// 		vk::ImageAspectFlags{vk::ImageAspectFlagBits::eDepth|vk::ImageAspectFlagBits::eStencil},
-			// 		0,
-			// 		1,
-			// 		0,
-			// 		1,
-			// 	},
-			// },
-		};
+				vulkan_dispatch);
+			vulkan_frame.depth_image_bindless_generation = vulkan_command_buffer_generation;
+		}
 
-		if (staged == vulkan_swapchain_images.size())
+		// The frame we just waited on is the last one that used this readback buffer,
+		// so the frame in it is complete. Reading it now, instead of right after submitting, is what keeps the readback from stalling.
+		if (options.headless && frame_number >= vulkan_frames.size())
 		{
-			vulkan_image_memory_barriers_render[0].oldLayout = vk::ImageLayout::ePresentSrcKHR;
+			VulkanBufferAllocation const &vulkan_readback_allocation = vulkan_buffer_allocations[vulkan_readback_buffer_idx + vulkan_frame_idx];
+			vulkan_invalidate_host_reads(vulkan_device, vulkan_readback_allocation, vulkan_non_coherent_atom_size);
+			std::memcpy(headless_frame.data(), vulkan_readback_allocation.heap_allocation.mapped, headless_frame.size());
 		}
-		if (staged > 0)
+
+		uint32_t vulkan_image_idx;
+		if (options.headless)
 		{
-			cb.pipelineBarrier2({
-				vk::DependencyFlags{},
-				
-				0,
-				nullptr,
+			vulkan_image_idx = static_cast<uint32_t>(vulkan_frame_idx);
+		}
+		else
+		{
+			// Suboptimal still acquires an image and signals the semaphore, so the frame goes ahead, and the swapchain gets recreated after.
+			// Out of date doesn't, so the frame starts over with a new swapchain.
+			TRACE_BEGIN(acquire);
+			try
+			{
+				vk::ResultValue<uint32_t> vulkan_acquire_result = vulkan_device.acquireNextImageKHR(
+					vulkan_swapchain, 
+					std::numeric_limits<uint64_t>::max(), 
+					vulkan_frame.acquire_semaphore
+				);
+				vulkan_swapchain_out_of_date |= vulkan_acquire_result.result == vk::Result::eSuboptimalKHR;
+				vulkan_image_idx = vulkan_acquire_result.value;
+			}
+			catch (vk::OutOfDateKHRError const &)
+			{
+				vulkan_swapchain_out_of_date = true;
+				continue;
+			}
+			TRACE_END(acquire);
+		}
 
-				0,
-				nullptr,
+		// This frame's previous use has been waited on, so the GPU is done with this frame's region.
+		vulkan_uniform_ring_begin_frame(vulkan_uniform_ring, vulkan_frame_idx);
+
+		vk::DeviceAddress vulkan_uniforms_address;
+		void *vulkan_uniforms_data = vulkan_uniform_ring_allocate(vulkan_uniform_ring, sizeof(Uniforms), vulkan_uniforms_address);
+		rotate_cube(vulkan_uniforms_data, uniforms, dt, static_cast<float>(vulkan_render_extent.width)/static_cast<float>(vulkan_render_extent.height), scene_view_distance, 0.1f, scene_far_plane);
+
+		// Like the uniforms, this frame's staging region is free again, since the frame's previous use has been waited on.
+		VulkanBufferAllocation const &vulkan_instance_staging_buffer = vulkan_buffer_allocations[vulkan_instance_staging_buffer_idx];
+		vk::DeviceSize vulkan_instance_staging_offset = vulkan_frame_idx*vulkan_instance_staging_region_size;
+		vulkan_instance_copies.clear();
+		vulkan_instances_stage(
+			scene_instances,
+			vulkan_instance_staging_buffer.heap_allocation.mapped + vulkan_instance_staging_offset,
+			vulkan_instance_staging_offset,
+			vulkan_instance_copies);
+		if (!vulkan_instance_copies.empty())
+		{
+			vulkan_uploader_flush_host_writes(vulkan_uploader, vulkan_instance_staging_buffer, vulkan_instance_staging_offset);
+		}
 
-				// The depth stencil buffer only has to get transitioned once.
-				1,
-				&vulkan_image_memory_barriers_render[0],
+		// Anything uploaded this frame goes to the transfer queue before the frame gets recorded, so the frame can pick it up.
+		vulkan_uploader_flush(vulkan_uploader);
+
+		TRACE_BEGIN(record);
+		std::vector<vk::SemaphoreSubmitInfo> vulkan_wait_semaphore_infos;
+		if (!options.headless)
+		{
+			vulkan_wait_semaphore_infos.push_back(vk::SemaphoreSubmitInfo{
+				vulkan_frame.acquire_semaphore,
+				0,
+				vk::PipelineStageFlagBits2::eColorAttachmentOutput,
 			});
 		}
-		else
+
+		std::vector<vk::CommandBufferSubmitInfo> vulkan_command_buffer_submit_infos;
+
+		// Only the things that really do change every frame go in here. If there aren't any, it doesn't get recorded at all.
+		bool const vulkan_hiz_image_clear = vulkan_occlusion_culling && !vulkan_hiz_image_cleared;
+		if (vulkan_profiler.query_pool || 
+			vulkan_uploader_has_pending_acquire(vulkan_uploader) || 
+			!vulkan_instance_copies.empty() || 
+			vulkan_hiz_image_clear)
 		{
-			cb.pipelineBarrier2({
-				vk::DependencyFlags{},
-				{},
-				vulkan_buffer_memory_barriers_transfer,
-				vulkan_image_memory_barriers_render,
+			vk::CommandBuffer cb = vulkan_frame.command_buffer;
+			cb.begin({
+				vk::CommandBufferUsageFlagBits::eOneTimeSubmit,
 			});
+			vulkan_profiler_begin_frame(vulkan_profiler, cb, vulkan_frame_idx, frame_number);
+			vulkan_uploader_acquire(vulkan_uploader, cb, vulkan_wait_semaphore_infos);
+			if (!vulkan_instance_copies.empty())
+			{
+				// Earlier frames might still be reading the transforms that are about to be overwritten.
+				std::array<vk::MemoryBarrier2, 1> vulkan_memory_barriers_instances_copy{
+					vk::MemoryBarrier2{
+						vk::PipelineStageFlagBits2::eVertexShader|vk::PipelineStageFlagBits2::eComputeShader,
+						vk::AccessFlagBits2::eNone,
+						vk::PipelineStageFlagBits2::eCopy,
+						vk::AccessFlagBits2::eNone,
+					},
+				};
+				cb.pipelineBarrier2({
+					vk::DependencyFlags{},
+					vulkan_memory_barriers_instances_copy,
+					{},
+					{},
+				});
+
+				cb.copyBuffer(
+					vulkan_instance_staging_buffer.handle,
+					vulkan_buffer_allocations[vulkan_instance_buffer_idx].handle,
+					vulkan_instance_copies);
+
+				std::array<vk::MemoryBarrier2, 1> vulkan_memory_barriers_instances_read{
+					vk::MemoryBarrier2{
+						vk::PipelineStageFlagBits2::eCopy,
+						vk::AccessFlagBits2::eTransferWrite,
+						vk::PipelineStageFlagBits2::eVertexShader|vk::PipelineStageFlagBits2::eComputeShader,
+						vk::AccessFlagBits2::eShaderStorageRead,
+					},
+				};
+				cb.pipelineBarrier2({
+					vk::DependencyFlags{},
+					vulkan_memory_barriers_instances_read,
+					{},
+					{},
+				});
+			}
+			if (vulkan_hiz_image_clear)
+			{
+				vk::ImageSubresourceRange const vulkan_hiz_subresource_range{
+					vk::ImageAspectFlagBits::eColor, 0, BASED_RENDERER_HIZ_LEVEL_COUNT, 0, 1,
+				};
+				std::array<vk::ImageMemoryBarrier2, 1> vulkan_image_memory_barriers_hiz_clear{
+					vk::ImageMemoryBarrier2{
+						vk::PipelineStageFlagBits2::eNone,
+						vk::AccessFlagBits2::eNone,
+						vk::PipelineStageFlagBits2::eClear,
+						vk::AccessFlagBits2::eTransferWrite,
+						vk::ImageLayout::eUndefined,
+						vk::ImageLayout::eGeneral,
+						vk::QueueFamilyIgnored,
+						vk::QueueFamilyIgnored,
+						vulkan_hiz_image,
+						vulkan_hiz_subresource_range,
+					},
+				};
+				cb.pipelineBarrier2({
+					vk::DependencyFlags{},
+					{},
+					{},
+					vulkan_image_memory_barriers_hiz_clear,
+				});
+
+				cb.clearColorImage(vulkan_hiz_image, vk::ImageLayout::eGeneral, vk::ClearColorValue{1.0f, 1.0f, 1.0f, 1.0f}, vulkan_hiz_subresource_range);
+
+				std::array<vk::MemoryBarrier2, 1> vulkan_memory_barriers_hiz_cull{
+					vk::MemoryBarrier2{
+						vk::PipelineStageFlagBits2::eClear,
+						vk::AccessFlagBits2::eTransferWrite,
+						vk::PipelineStageFlagBits2::eComputeShader,
+						vk::AccessFlagBits2::eShaderSampledRead|vk::AccessFlagBits2::eShaderStorageWrite,
+					},
+				};
+				cb.pipelineBarrier2({
+					vk::DependencyFlags{},
+					vulkan_memory_barriers_hiz_cull,
+					{},
+					{},
+				});
+				vulkan_hiz_image_cleared = true;
+			}
+			cb.end();
+			vulkan_command_buffer_submit_infos.push_back({cb});
+		}
 
-			std::array<vk::BufferCopy, 1> buffer_copies{
-				vk::BufferCopy{
-					0,
-					0,
-					sizeof(Uniforms),
-				},
-			};
+		// Everything else only depends on which frame and which image this is, plus things that rarely change, 
+		// so it gets recorded once and then resubmitted until one of them does.
+		if (vulkan_image_idx >= vulkan_frame.recorded_command_buffers.size())
+		{
+			vulkan_frame.recorded_command_buffers.resize(vulkan_image_idx + 1);
+		}
+		VulkanRecordedCommandBuffer &vulkan_recorded_command_buffer = vulkan_frame.recorded_command_buffers[vulkan_image_idx];
+		if (!vulkan_recorded_command_buffer.command_buffer)
+		{
+			vulkan_recorded_command_buffer.command_buffer = vulkan_device.allocateCommandBuffers({
+				vulkan_frame.recorded_command_pool, 
+				vk::CommandBufferLevel::ePrimary, 
+				1,
+			})[0];
+		}
+		if (vulkan_recorded_command_buffer.generation != vulkan_command_buffer_generation || 
+			vulkan_recorded_command_buffer.uniforms_address != vulkan_uniforms_address)
+		{
+			TRACE_SCOPE(record_static);
+			vulkan_recorded_command_buffer.generation = vulkan_command_buffer_generation;
+			vulkan_recorded_command_buffer.uniforms_address = vulkan_uniforms_address;
+
+			PushConstants vulkan_frame_push_constants = vulkan_push_constants;
+			vulkan_frame_push_constants.uniforms = vulkan_uniforms_address;
+
+			vk::CommandBuffer cb = vulkan_recorded_command_buffer.command_buffer;
+			cb.begin(vk::CommandBufferBeginInfo{});
+			vulkan_profiler_begin_recording(vulkan_profiler, vulkan_frame_idx);
+			VULKAN_PROFILER_ZONE_BEGIN(vulkan_profiler, cb, frame);
+
+			// The shader reads the camera from the uniforms, and those change every frame, but the commands don't,
+			// so culling doesn't cost the CPU anything no matter how many cubes there are.
+			if (vulkan_gpu_culling)
+			{
+				VULKAN_PROFILER_ZONE_BEGIN(vulkan_profiler, cb, culling);
+				vk::Buffer vulkan_cull_draw_buffer = vulkan_buffer_allocations[vulkan_cull_draw_buffer_idx].handle;
+				vk::Buffer vulkan_cull_draw_count_buffer = vulkan_buffer_allocations[vulkan_cull_draw_count_buffer_idx].handle;
+
+				// The last frame's draws might still be reading the count.
+				std::array<vk::MemoryBarrier2, 1> vulkan_memory_barriers_cull_clear{
+					vk::MemoryBarrier2{
+						vk::PipelineStageFlagBits2::eDrawIndirect,
+						vk::AccessFlagBits2::eNone,
+						vk::PipelineStageFlagBits2::eClear,
+						vk::AccessFlagBits2::eNone,
+					},
+				};
+				cb.pipelineBarrier2({
+					vk::DependencyFlags{},
+					vulkan_memory_barriers_cull_clear,
+					{},
+					{},
+				});
+				cb.fillBuffer(vulkan_cull_draw_count_buffer, 0, sizeof(uint32_t), 0);
+
+				// Besides the cleared count, the last frame's draws might also still be reading the draws that are about to be overwritten.
+				// The Hi-Z pyramid that gets tested against was written by the last frame.
+				std::array<vk::MemoryBarrier2, 1> vulkan_memory_barriers_cull_dispatch{
+					vk::MemoryBarrier2{
+						vk::PipelineStageFlagBits2::eClear|vk::PipelineStageFlagBits2::eDrawIndirect|vk::PipelineStageFlagBits2::eComputeShader,
+						vk::AccessFlagBits2::eTransferWrite|vk::AccessFlagBits2::eShaderStorageWrite,
+						vk::PipelineStageFlagBits2::eComputeShader,
+						vk::AccessFlagBits2::eShaderStorageRead|vk::AccessFlagBits2::eShaderStorageWrite|vk::AccessFlagBits2::eShaderSampledRead,
+					},
+				};
+				cb.pipelineBarrier2({
+					vk::DependencyFlags{},
+					vulkan_memory_barriers_cull_dispatch,
+					{},
+					{},
+				});
+
+				cb.bindPipeline(vk::PipelineBindPoint::eCompute, vulkan_pipelines[vulkan_cull_pipeline_idx]);
+				vulkan_bindless_table_bind(cb, vulkan_bindless_table, vk::PipelineBindPoint::eCompute, vulkan_pipeline_layout, vulkan_dispatch);
+				cb.pushConstants<PushConstants>(vulkan_pipeline_layout, vulkan_bindless_stages, 0, vulkan_frame_push_constants);
+				cb.dispatch((options.instance_count + BASED_RENDERER_CULL_GROUP_SIZE - 1)/BASED_RENDERER_CULL_GROUP_SIZE, 1, 1);
+
+				std::array<vk::MemoryBarrier2, 1> vulkan_memory_barriers_cull_draw{
+					vk::MemoryBarrier2{
+						vk::PipelineStageFlagBits2::eComputeShader,
+						vk::AccessFlagBits2::eShaderStorageWrite,
+						vk::PipelineStageFlagBits2::eDrawIndirect,
+						vk::AccessFlagBits2::eIndirectCommandRead,
+					},
+				};
+				cb.pipelineBarrier2({
+					vk::DependencyFlags{},
+					vulkan_memory_barriers_cull_draw,
+					{},
+					{},
+				});
+				VULKAN_PROFILER_ZONE_END(vulkan_profiler, cb, culling);
+			}
 
-			cb.copyBuffer(vulkan_buffer_allocations[vulkan_uniform_buffer_idx].staging_buffer.handle, vulkan_buffer_allocations[vulkan_uniform_buffer_idx].handle, buffer_copies);
-
-			std::array<vk::BufferMemoryBarrier2, 1> buffer_barriers{
-			    vk::BufferMemoryBarrier2{
-			    	vk::PipelineStageFlagBits2::eTransfer,
-			    	vk::AccessFlagBits2::eTransferWrite,
-			    	vk::PipelineStageFlagBits2::eVertexShader,
-			    	vk::AccessFlagBits2::eUniformRead,
-			    	0, // TODO
-			    	0, // TODO
-			        vulkan_uniform_buffer,
-			        0,
-			        sizeof(Uniforms),
-			    },
+			std::array<vk::ImageMemoryBarrier2, 2> vulkan_image_memory_barriers_render{
+				vk::ImageMemoryBarrier2{
+					vk::PipelineStageFlags2{vk::PipelineStageFlagBits2::eColorAttachmentOutput},
+					vk::AccessFlags2{},
+					vk::PipelineStageFlags2{vk::PipelineStageFlagBits2::eColorAttachmentOutput},
+					vk::AccessFlags2{vk::AccessFlagBits2::eColorAttachmentWrite},
+					vk::ImageLayout::eUndefined,
+					vk::ImageLayout::eColorAttachmentOptimal,
+					vk::QueueFamilyIgnored,
+					vk::QueueFamilyIgnored,
+					vulkan_render_target_images[vulkan_image_idx],
+					vk::ImageSubresourceRange{
+						vk::ImageAspectFlags{vk::ImageAspectFlagBits::eColor},
+						0,
+						1,
+						0,
+						1,
+					},
+				},
+				// The last frame might still be testing against it, or building the Hi-Z pyramid from it.
+				vk::ImageMemoryBarrier2{
+					vk::PipelineStageFlagBits2::eEarlyFragmentTests|vk::PipelineStageFlagBits2::eLateFragmentTests|vk::PipelineStageFlagBits2::eComputeShader,
+					vk::AccessFlags2{},
+					vk::PipelineStageFlagBits2::eEarlyFragmentTests|vk::PipelineStageFlagBits2::eLateFragmentTests,
+					vk::AccessFlagBits2::eDepthStencilAttachmentRead|vk::AccessFlagBits2::eDepthStencilAttachmentWrite,
+					vk::ImageLayout::eUndefined,
+					vk::ImageLayout::eDepthStencilAttachmentOptimal,
+					vk::QueueFamilyIgnored,
+					vk::QueueFamilyIgnored,
+					vulkan_depth_stencil_image,
+					vk::ImageSubresourceRange{
+						vk::ImageAspectFlags{vk::ImageAspectFlagBits::eDepth},
+						0,
+						1,
+						0,
+						1,
+					},
+				},
 			};
 
+			// The render target and the depth image get fully cleared every frame, so their old contents (and with them their old layouts) 
+			// can always be thrown away.
+			VULKAN_PROFILER_ZONE_BEGIN(vulkan_profiler, cb, render_barrier);
 			cb.pipelineBarrier2({
 				vk::DependencyFlags{},
-				{},
-				buffer_barriers,
-				{},
+			
+				0,
+				nullptr,
+
+				0,
+				nullptr,
+
+				static_cast<uint32_t>(vulkan_image_memory_barriers_render.size()),
+				vulkan_image_memory_barriers_render.data(),
 			});
-		}
+			VULKAN_PROFILER_ZONE_END(vulkan_profiler, cb, render_barrier);
+
+			std::array<vk::RenderingAttachmentInfo, 1> vulkan_rendering_attachment_infos{
+				vk::RenderingAttachmentInfo{
+					vulkan_render_target_image_views[vulkan_image_idx],
+					vk::ImageLayout::eColorAttachmentOptimal,
+
+					vk::ResolveModeFlagBits::eNone,
+					vk::ImageView{},
+					vk::ImageLayout::eUndefined,
 
-		std::array<vk::RenderingAttachmentInfo, 1> vulkan_rendering_attachment_infos{
-			vk::RenderingAttachmentInfo{
-				vulkan_swapchain_image_views[vulkan_image_idx],
-				vk::ImageLayout::eColorAttachmentOptimal,
+					vk::AttachmentLoadOp::eClear,
+					vk::AttachmentStoreOp::eStore,
+					vk::ClearValue{},
+				},
+			};
+
+			// Depth only has to survive the render pass if the Hi-Z pyramid gets built from it.
+			vk::RenderingAttachmentInfo vulkan_depth_attachment_info{
+				vulkan_depth_stencil_image_view,
+				vk::ImageLayout::eDepthStencilAttachmentOptimal,
 
 				vk::ResolveModeFlagBits::eNone,
 				vk::ImageView{},
 				vk::ImageLayout::eUndefined,
 
 				vk::AttachmentLoadOp::eClear,
-				vk::AttachmentStoreOp::eStore,
-				vk::ClearValue{},
-			},
-		};
+				vulkan_occlusion_culling ? vk::AttachmentStoreOp::eStore : vk::AttachmentStoreOp::eDontCare,
+				vk::ClearDepthStencilValue{1.0f, 0},
+			};
 
-		// vk::RenderingAttachmentInfo vulkan_depth_stencil_attachment_info{
-		// 	vulkan_depth_stencil_image_view,
-		// 	vk::ImageLayout::eDepthStencilAttachmentOptimal,
+			VULKAN_PROFILER_ZONE_BEGIN(vulkan_profiler, cb, rendering);
+			VulkanDrawState const vulkan_draw_state{
+				vulkan_pipelines[vulkan_cube_pipeline_idx],
+				vulkan_pipeline_layout,
+				&vulkan_bindless_table,
+				&vulkan_dispatch,
+				vulkan_frame_push_constants,
+				vulkan_render_extent,
+				vulkan_buffer_allocations[vulkan_cube_index_buffer_idx].handle,
+				options.depth_prepass ? vulkan_pipelines[vulkan_depth_prepass_pipeline_idx] : vk::Pipeline{},
+			};
+			// With enough draws, they get recorded in parallel before the render pass begins, which then just executes them.
+			bool const vulkan_record_in_parallel = 
+				!vulkan_gpu_culling &&
+				vulkan_recording_job_count(vulkan_draws.size(), vulkan_frame.recording_command_pools.size()) > 1;
+			std::span<vk::CommandBuffer const> vulkan_secondary_command_buffers;
+			if (vulkan_record_in_parallel)
+			{
+				vulkan_secondary_command_buffers = vulkan_record_draws_parallel(
+					job_pool,
+					vulkan_device,
+					vulkan_frame.recording_command_pools,
+					vulkan_recorded_command_buffer.secondary_command_buffers,
+					vulkan_format,
+					vulkan_depth_stencil_format,
+					vulkan_draw_state,
+					vulkan_draws);
+			}
 
-		// 	vk::ResolveModeFlagBits::eNone,
-		// 	vk::ImageView{},
-		// 	vk::ImageLayout::eUndefined,
+			cb.beginRendering({
+				vulkan_record_in_parallel ? 
+					vk::RenderingFlags{vk::RenderingFlagBits::eContentsSecondaryCommandBuffers} :
+					vk::RenderingFlags{},
+				vk::Rect2D{
+					vk::Offset2D{0, 0},
+					vulkan_render_extent,
+				},
+				1,
+				0,
+				vulkan_rendering_attachment_infos,
+				&vulkan_depth_attachment_info,
+			});
 
-		// 	vk::AttachmentLoadOp::eClear,
-		// 	vk::AttachmentStoreOp::eDontCare,
-		// 	vk::ClearValue{},
-		// };
+			if (vulkan_gpu_culling)
+			{
+				vulkan_record_passes(cb, vulkan_draw_state, [&]
+				{
+					cb.drawIndexedIndirectCount(
+						vulkan_buffer_allocations[vulkan_cull_draw_buffer_idx].handle,
+						0,
+						vulkan_buffer_allocations[vulkan_cull_draw_count_buffer_idx].handle,
+						0,
+						options.instance_count,
+						sizeof(vk::DrawIndexedIndirectCommand));
+				});
+			}
+			else if (vulkan_record_in_parallel)
+			{
+				cb.executeCommands(vulkan_secondary_command_buffers);
+			}
+			else
+			{
+				vulkan_record_draws(cb, vulkan_draw_state, vulkan_draws);
+			}
 
-		cb.beginRendering({
-			vk::RenderingFlags{},
-			vk::Rect2D{
-				vk::Offset2D{0, 0},
-				vulkan_swapchain_extent,
-			},
-			1,
-			0,
-			vulkan_rendering_attachment_infos,
-			// &vulkan_depth_stencil_attachment_info,
-			// &vulkan_depth_stencil_attachment_info,
-		});
+			cb.endRendering();
+			VULKAN_PROFILER_ZONE_END(vulkan_profiler, cb, rendering);
 
-		cb.bindPipeline(
-			vk::PipelineBindPoint::eGraphics,
-			vulkan_pipelines[0]
-		);
-		cb.bindDescriptorSets(
-			vk::PipelineBindPoint::eGraphics,
-			vulkan_pipeline_layout,
-			0,
-			vulkan_descriptor_sets,
-			{});
-		cb.draw(6, 1, 0, 0);
-
-		cb.endRendering();
-
-		std::array<vk::ImageMemoryBarrier2, 1> vulkan_image_memory_barriers_present{
-			vk::ImageMemoryBarrier2{
-				vk::PipelineStageFlags2{vk::PipelineStageFlagBits2::eColorAttachmentOutput},
-				vk::AccessFlags2{vk::AccessFlagBits2::eColorAttachmentWrite},
-				vk::PipelineStageFlags2{},
-				vk::AccessFlags2{},
-				vk::ImageLayout::eColorAttachmentOptimal,
-				vk::ImageLayout::ePresentSrcKHR,
-				0, // TODO
-				0, // TODO
-				vulkan_swapchain_images[vulkan_image_idx],
-				vk::ImageSubresourceRange{
-					vk::ImageAspectFlags{vk::ImageAspectFlagBits::eColor},
-					0,
-					1,
-					0,
-					1,
-				},
-			},
-		};
+			// Next frame's culling tests against this frame's depth. Level 0 covers the whole depth image, whatever its size,
+			// and every level after that halves the one before it.
+			if (vulkan_occlusion_culling)
+			{
+				VULKAN_PROFILER_ZONE_BEGIN(vulkan_profiler, cb, hiz);
+				std::array<vk::MemoryBarrier2, 1> vulkan_memory_barriers_hiz{
+					vk::MemoryBarrier2{
+						vk::PipelineStageFlagBits2::eComputeShader,
+						vk::AccessFlagBits2::eNone,
+						vk::PipelineStageFlagBits2::eComputeShader,
+						vk::AccessFlagBits2::eNone,
+					},
+				};
+				std::array<vk::ImageMemoryBarrier2, 1> vulkan_image_memory_barriers_hiz{
+					vk::ImageMemoryBarrier2{
+						vk::PipelineStageFlagBits2::eLateFragmentTests,
+						vk::AccessFlagBits2::eDepthStencilAttachmentWrite,
+						vk::PipelineStageFlagBits2::eComputeShader,
+						vk::AccessFlagBits2::eShaderSampledRead,
+						vk::ImageLayout::eDepthStencilAttachmentOptimal,
+						vk::ImageLayout::eShaderReadOnlyOptimal,
+						vk::QueueFamilyIgnored,
+						vk::QueueFamilyIgnored,
+						vulkan_depth_stencil_image,
+						vk::ImageSubresourceRange{
+							vk::ImageAspectFlags{vk::ImageAspectFlagBits::eDepth},
+							0,
+							1,
+							0,
+							1,
+						},
+					},
+				};
+				cb.pipelineBarrier2({
+					vk::DependencyFlags{},
+					vulkan_memory_barriers_hiz,
+					{},
+					vulkan_image_memory_barriers_hiz,
+				});
+
+				// The table has to be bound again, even though culling bound it for compute already. Binding a descriptor buffer for the
+				// render pass invalidates the offsets of every bind point, and secondary command buffers leave the bound state undefined.
+				// After that, every level only needs different push constants.
+				PushConstants vulkan_hiz_push_constants = vulkan_frame_push_constants;
+				vulkan_hiz_push_constants.src = vulkan_frame.depth_image_bindless_idx;
+				vulkan_hiz_push_constants.dst = vulkan_hiz_level_storage_bindless_idxs[0];
+				uint32_t const vulkan_hiz_group_count = BASED_RENDERER_HIZ_SIZE/BASED_RENDERER_HIZ_GROUP_SIZE;
+				cb.bindPipeline(vk::PipelineBindPoint::eCompute, vulkan_pipelines[vulkan_hiz_downsample_depth_pipeline_idx]);
+				vulkan_bindless_table_bind(cb, vulkan_bindless_table, vk::PipelineBindPoint::eCompute, vulkan_pipeline_layout, vulkan_dispatch);
+				cb.pushConstants<PushConstants>(vulkan_pipeline_layout, vulkan_bindless_stages, 0, vulkan_hiz_push_constants);
+				cb.dispatch(vulkan_hiz_group_count, vulkan_hiz_group_count, 1);
+
+				cb.bindPipeline(vk::PipelineBindPoint::eCompute, vulkan_pipelines[vulkan_hiz_downsample_pipeline_idx]);
+				for (uint32_t i = 1; i < BASED_RENDERER_HIZ_LEVEL_COUNT; ++i)
+				{
+					std::array<vk::MemoryBarrier2, 1> vulkan_memory_barriers_hiz_level{
+						vk::MemoryBarrier2{
+							vk::PipelineStageFlagBits2::eComputeShader,
+							vk::AccessFlagBits2::eShaderStorageWrite,
+							vk::PipelineStageFlagBits2::eComputeShader,
+							vk::AccessFlagBits2::eShaderSampledRead,
+						},
+					};
+					cb.pipelineBarrier2({
+						vk::DependencyFlags{},
+						vulkan_memory_barriers_hiz_level,
+						{},
+						{},
+					});
+
+					uint32_t const vulkan_hiz_level_group_count = 
+						((BASED_RENDERER_HIZ_SIZE >> i) + BASED_RENDERER_HIZ_GROUP_SIZE - 1)/BASED_RENDERER_HIZ_GROUP_SIZE;
+					vulkan_hiz_push_constants.src = vulkan_hiz_level_sampled_bindless_idxs[i - 1];
+					vulkan_hiz_push_constants.dst = vulkan_hiz_level_storage_bindless_idxs[i];
+					cb.pushConstants<PushConstants>(vulkan_pipeline_layout, vulkan_bindless_stages, 0, vulkan_hiz_push_constants);
+					cb.dispatch(vulkan_hiz_level_group_count, vulkan_hiz_level_group_count, 1);
+				}
+				VULKAN_PROFILER_ZONE_END(vulkan_profiler, cb, hiz);
+			}
 
-		cb.pipelineBarrier2({
-			vk::DependencyFlags{},
-			{},
-			{},
-			vulkan_image_memory_barriers_present,
-		});
-		if (staged < vulkan_swapchain_images.size())
-		{
-			staged += 1;
-		}
+			if (options.headless)
+			{
+				VULKAN_PROFILER_ZONE_BEGIN(vulkan_profiler, cb, readback);
+
+				std::array<vk::ImageMemoryBarrier2, 1> vulkan_image_memory_barriers_readback{
+					vk::ImageMemoryBarrier2{
+						vk::PipelineStageFlags2{vk::PipelineStageFlagBits2::eColorAttachmentOutput},
+						vk::AccessFlags2{vk::AccessFlagBits2::eColorAttachmentWrite},
+						vk::PipelineStageFlags2{vk::PipelineStageFlagBits2::eCopy},
+						vk::AccessFlags2{vk::AccessFlagBits2::eTransferRead},
+						vk::ImageLayout::eColorAttachmentOptimal,
+						vk::ImageLayout::eTransferSrcOptimal,
+						vk::QueueFamilyIgnored,
+						vk::QueueFamilyIgnored,
+						vulkan_render_target_images[vulkan_image_idx],
+						vk::ImageSubresourceRange{
+							vk::ImageAspectFlags{vk::ImageAspectFlagBits::eColor},
+							0,
+							1,
+							0,
+							1,
+						},
+					},
+				};
+
+				cb.pipelineBarrier2({
+					vk::DependencyFlags{},
+					{},
+					{},
+					vulkan_image_memory_barriers_readback,
+				});
+
+				vk::Buffer vulkan_readback_buffer = vulkan_buffer_allocations[vulkan_readback_buffer_idx + vulkan_image_idx].handle;
+
+				std::array<vk::BufferImageCopy, 1> vulkan_readback_copies{
+					vk::BufferImageCopy{
+						0,
+						0,
+						0,
+						vk::ImageSubresourceLayers{vk::ImageAspectFlagBits::eColor, 0, 0, 1},
+						vk::Offset3D{0, 0, 0},
+						vk::Extent3D{vulkan_render_extent.width, vulkan_render_extent.height, 1},
+					},
+				};
+				cb.copyImageToBuffer(
+					vulkan_render_target_images[vulkan_image_idx], 
+					vk::ImageLayout::eTransferSrcOptimal, 
+					vulkan_readback_buffer, 
+					vulkan_readback_copies
+				);
+
+				// Makes the copy visible to the host once the frame timeline is signaled.
+				std::array<vk::BufferMemoryBarrier2, 1> vulkan_buffer_memory_barriers_readback{
+					vk::BufferMemoryBarrier2{
+						vk::PipelineStageFlagBits2::eCopy,
+						vk::AccessFlagBits2::eTransferWrite,
+						vk::PipelineStageFlagBits2::eHost,
+						vk::AccessFlagBits2::eHostRead,
+						vk::QueueFamilyIgnored,
+						vk::QueueFamilyIgnored,
+						vulkan_readback_buffer,
+						0,
+						vk::WholeSize,
+					},
+				};
+
+				cb.pipelineBarrier2({
+					vk::DependencyFlags{},
+					{},
+					vulkan_buffer_memory_barriers_readback,
+					{},
+				});
+				VULKAN_PROFILER_ZONE_END(vulkan_profiler, cb, readback);
+			}
+			else
+			{
+				VULKAN_PROFILER_ZONE_BEGIN(vulkan_profiler, cb, present_barrier);
+
+				std::array<vk::ImageMemoryBarrier2, 1> vulkan_image_memory_barriers_present{
+					vk::ImageMemoryBarrier2{
+						vk::PipelineStageFlags2{vk::PipelineStageFlagBits2::eColorAttachmentOutput},
+						vk::AccessFlags2{vk::AccessFlagBits2::eColorAttachmentWrite},
+						vk::PipelineStageFlags2{},
+						vk::AccessFlags2{},
+						vk::ImageLayout::eColorAttachmentOptimal,
+						vk::ImageLayout::ePresentSrcKHR,
+						vk::QueueFamilyIgnored,
+						vk::QueueFamilyIgnored,
+						vulkan_render_target_images[vulkan_image_idx],
+						vk::ImageSubresourceRange{
+							vk::ImageAspectFlags{vk::ImageAspectFlagBits::eColor},
+							0,
+							1,
+							0,
+							1,
+						},
+					},
+				};
+
+				cb.pipelineBarrier2({
+					vk::DependencyFlags{},
+					{},
+					{},
+					vulkan_image_memory_barriers_present,
+				});
+				VULKAN_PROFILER_ZONE_END(vulkan_profiler, cb, present_barrier);
+			}
 
-		cb.end();
+			VULKAN_PROFILER_ZONE_END(vulkan_profiler, cb, frame);
+			cb.end();
+		}
+		vulkan_command_buffer_submit_infos.push_back({vulkan_recorded_command_buffer.command_buffer});
+		TRACE_END(record);
 
-		std::array<vk::SemaphoreSubmitInfo, 1> vulkan_wait_semaphore_infos{
+		std::array<vk::SemaphoreSubmitInfo, 2> vulkan_signal_semaphore_infos{
 			vk::SemaphoreSubmitInfo{
-				vulkan_semaphores_wait[vulkan_frame_idx],
-				0,
-				vk::PipelineStageFlagBits2::eColorAttachmentOutput,
-			},
-		};
-
-		std::array<vk::CommandBufferSubmitInfo, 1> vulkan_command_buffer_submit_infos{
-			{
-				cb,
+				vulkan_frame_timeline,
+				frame_number + 1,
+				vk::PipelineStageFlagBits2::eAllCommands,
 			},
-		};
-
-		std::array<vk::SemaphoreSubmitInfo, 1> vulkan_signal_semaphore_infos{
 			vk::SemaphoreSubmitInfo{
-				vulkan_semaphores_signal[vulkan_frame_idx],
+				vulkan_present_semaphores[vulkan_image_idx],
 				0,
 				vk::PipelineStageFlagBits2::eAllCommands, // This is needed, or else the present will start before all commands have finished.
 			},
@@ -2168,21 +6144,120 @@ static void based_renderer_main()
 				vulkan_signal_semaphore_infos,
 			}
 		};
-		vulkan_graphics_queue.submit2(vulkan_submit_infos, vulkan_fences[vulkan_frame_idx]);
-
-		std::array<vk::Semaphore, 1> vulkan_present_wait_semaphores{vulkan_semaphores_signal[vulkan_frame_idx]};
-		std::array<vk::SwapchainKHR, 1> vulkan_present_swapchains{vulkan_swapchain};
-		std::array<uint32_t, 1> vulkan_present_image_indices{vulkan_image_idx};
-		std::array<vk::Result, 1> vulkan_present_results;
-		// TODO: Use the present queue.
-		vk::detail::resultCheck(vulkan_graphics_queue.presentKHR({
-			vulkan_present_wait_semaphores,
-			vulkan_present_swapchains,
-			vulkan_present_image_indices,
-			vulkan_present_results
-		}), "Failed to present.");
-		vk::detail::resultCheck(vulkan_present_results[0], "Failed to present.");
-
-		vulkan_frame_idx = (vulkan_frame_idx + 1) % vulkan_swapchain_images.size();
+		// Without a swapchain, there is nothing to present, so only the frame timeline gets signalled.
+		if (options.headless)
+		{
+			vulkan_submit_infos[0].signalSemaphoreInfoCount = 1;
+		}
+		TRACE_BEGIN(submit);
+		vulkan_graphics_queue.submit2(vulkan_submit_infos);
+		TRACE_END(submit);
+
+		if (!options.headless)
+		{
+			std::array<vk::Semaphore, 1> vulkan_present_wait_semaphores{vulkan_present_semaphores[vulkan_image_idx]};
+			std::array<vk::SwapchainKHR, 1> vulkan_present_swapchains{vulkan_swapchain};
+			std::array<uint32_t, 1> vulkan_present_image_indices{vulkan_image_idx};
+			vk::PresentInfoKHR vulkan_present_info{
+				vulkan_present_wait_semaphores,
+				vulkan_present_swapchains,
+				vulkan_present_image_indices,
+			};
+			// Present IDs have to go up with every present, and can't be 0.
+			std::array<uint64_t, 1> vulkan_present_ids{frame_number + 1};
+			vk::PresentIdKHR vulkan_present_id{vulkan_present_ids};
+			if (vulkan_present_wait_enabled)
+			{
+				vulkan_present_info.pNext = &vulkan_present_id;
+			}
+			// Even when presenting fails because the swapchain is out of date, the wait on the present semaphore still happens,
+			// so the frame counts as done either way.
+			TRACE_BEGIN(present);
+			try
+			{
+				// TODO: Use the present queue.
+				vk::Result vulkan_present_result = vulkan_graphics_queue.presentKHR(vulkan_present_info);
+				vulkan_swapchain_out_of_date |= vulkan_present_result == vk::Result::eSuboptimalKHR;
+				if (vulkan_present_wait_enabled)
+				{
+					vulkan_present_latency.pending.push_back({vulkan_present_ids[0], frame_start});
+				}
+			}
+			catch (vk::OutOfDateKHRError const &)
+			{
+				vulkan_swapchain_out_of_date = true;
+			}
+			TRACE_END(present);
+
+#if BASED_RENDERER_WIN32
+			// The window only gets shown once there is something in it.
+			if (frame_number == 0)
+			{
+				ShowWindow(win32_window, SW_SHOW);
+			}
+#endif
+		}
+
+		vulkan_frame_idx = (vulkan_frame_idx + 1) % vulkan_frames.size();
+		++frame_number;
+		TRACE_END(frame);
+
+		if (vulkan_pipeline_cache_dirty && frame_number % BASED_RENDERER_VULKAN_PIPELINE_CACHE_SAVE_INTERVAL == 0)
+		{
+			vulkan_pipeline_cache_save(vulkan_device, vulkan_pipeline_cache);
+			vulkan_pipeline_cache_dirty = false;
+		}
+	}
+
+#if BASED_RENDERER_BENCH
+	// The last frame has no next frame to start, so it ends here instead, before waiting for the GPU to go idle.
+	if (frame_number > options.bench_warmup_frame_count)
+	{
+		bench_results.frame_ms.push_back(std::chrono::duration<double, std::milli>(BenchClock::now() - bench_frame_start).count());
+	}
+#endif
+
+	vulkan_device.waitIdle();
+
+	vulkan_present_latency_report(vulkan_present_latency);
+
+	if (options.gpu_profile_path)
+	{
+		vulkan_profiler_end(vulkan_profiler);
+		vulkan_profiler_write_results(vulkan_profiler, *options.gpu_profile_path);
+	}
+
+	if (vulkan_pipeline_cache_dirty)
+	{
+		vulkan_pipeline_cache_save(vulkan_device, vulkan_pipeline_cache);
+	}
+
+#if BASED_RENDERER_BENCH
+	bench_write_results(options);
+#endif
+
+	if (options.headless && frame_number > 0)
+	{
+		// Everything has finished, so the newest frame is ready too.
+		size_t last_frame_idx = static_cast<size_t>((frame_number - 1) % vulkan_frames.size());
+		VulkanBufferAllocation const &vulkan_readback_allocation = vulkan_buffer_allocations[vulkan_readback_buffer_idx + last_frame_idx];
+		vulkan_invalidate_host_reads(vulkan_device, vulkan_readback_allocation, vulkan_non_coherent_atom_size);
+		std::memcpy(headless_frame.data(), vulkan_readback_allocation.heap_allocation.mapped, headless_frame.size());
+
+		dprint("Rendered {} frames at {}x{}.\n", frame_number, client_width, client_height);
+
+		if (options.dump_path)
+		{
+			std::ofstream file{*options.dump_path, std::ios::binary};
+			if (!file)
+			{
+				throw std::runtime_error{FORMAT_ERROR(std::format("Failed to open {}.", *options.dump_path))};
+			}
+			file << std::format("P6\n{} {}\n255\n", client_width, client_height);
+			for (size_t i = 0; i < headless_frame.size(); i += 4)
+			{
+				file.write(reinterpret_cast<char const *>(&headless_frame[i]), 3);
+			}
+		}
 	}
 }
\ No newline at end of file
@@ -1,5 +1,6 @@
 #pragma once
 
+#ifdef _WIN32
 #define WIN32_LEAN_AND_MEAN
 #include <Windows.h>
 
@@ -12,6 +13,8 @@
 #endif
 
 #define VK_USE_PLATFORM_WIN32_KHR
+#endif // _WIN32
+
 // As far as I can tell, VULKAN_HPP_TYPESAFE_CONVERSION is needed in order to allow assigning certain vulkan handles.
 #include <vulkan/vulkan.hpp>
 
@@ -22,8 +25,25 @@
 #include <glm/gtc/type_ptr.hpp>
 
 #include <algorithm>
+#include <bit>
+#include <charconv>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <exception>
+#include <filesystem>
 #include <format>
-// #include <fstream>
+#include <fstream>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
 #include <optional>
 #include <span>
-// #include <sstream>
\ No newline at end of file
+#include <string_view>
+#include <thread>
+#include <type_traits>
+// #include <sstream>